@@ -7,4 +7,19 @@
 #include <csum_sw.h>
 #endif
 
+/* Sum a buffer as 16 bit words in memory order, 32 bit unfolded, ready
+ * for csum_fold() or csum_tcpudp_magic(). Vectorised where the CPU allows.
+ */
+extern uint32_t (*csum_block)(const uint8_t *buf, size_t len);
+const char *csum_kernel(void);
+
+static inline int tcpudp_csum(uint32_t saddr, uint32_t daddr,
+				uint16_t len, uint16_t proto,
+				const uint8_t *ptr)
+{
+	uint16_t sum;
+	sum = csum_tcpudp_magic(saddr, daddr, len, proto, csum_block(ptr, len));
+	return (sum == 0);
+}
+
 #endif /* _CSUM_H */
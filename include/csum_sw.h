@@ -100,61 +100,4 @@ static inline uint16_t csum_tcpudp_magic(uint32_t saddr, uint32_t daddr,
 	return csum_fold(csum_tcpudp_nofold(saddr, daddr, len, proto, sum));
 }
 
-#if 0
-static inline int tcpudp_csum(uint32_t saddr, uint32_t daddr,
-				uint16_t len, uint16_t proto,
-				const uint8_t *ptr)
-{
-	uint16_t sum;
-	sum = csum_tcpudp_magic(saddr, daddr, len, proto, do_csum_sw(ptr, len));
-	return (sum == 0);
-}
-#else
-static inline int tcpudp_csum(uint32_t saddr, uint32_t daddr,
-				uint16_t len, uint16_t proto,
-				const uint8_t *ptr)
-{
-	struct tcp_phdr ph;
-	uint16_t *tmp;
-	uint32_t sum = 0;
-	uint16_t csum;
-	int i;
-
-	/* Make pseudo-header */
-	ph.sip = saddr;
-	ph.dip = daddr;
-	ph.zero = 0;
-	ph.proto = proto;
-	ph.tcp_len = htobe16(len);
-
-	/* Checksum the pseudo-header */
-	tmp = (uint16_t *)&ph;
-	for(i = 0; i < 6; i++)
-		sum += tmp[i];
-
-	/* Checksum the header+data */
-	tmp = (uint16_t *)ptr;
-	for(i = 0; i < (len >> 1); i++)
-		sum += tmp[i];
-
-	/* Deal with last byte (if odd number of bytes) */
-	if ( len & 1 ) {
-		union {
-			uint8_t b[2];
-			uint16_t s;
-		}f;
-
-		f.b[0] = ((uint8_t *)ptr)[len - 1];
-		f.b[1] = 0;
-		sum += f.s;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	csum = ~sum & 0xffff;
-
-	return (csum == 0);
-}
-#endif				
-
 #endif /* _CSUM_SW_H */
@@ -49,7 +49,7 @@ static inline unsigned short from32to16(unsigned a)
  * Unrolling to an 128 bytes inner loop.
  * Using interleaving with more registers to break the carry chains.
  */
-static unsigned do_csum64(const unsigned char *buff, unsigned len)
+static inline unsigned do_csum64(const unsigned char *buff, unsigned len)
 {
 	unsigned odd, count;
 	unsigned long result = 0;
@@ -197,13 +197,4 @@ static inline uint16_t csum_tcpudp_magic(uint32_t saddr, uint32_t daddr,
 	return csum_fold(csum_tcpudp_nofold(saddr, daddr, len, proto, sum));
 }
 
-static inline int tcpudp_csum(uint32_t saddr, uint32_t daddr,
-				uint16_t len, uint16_t proto,
-				const uint8_t *ptr)
-{
-	uint16_t sum;
-	sum = csum_tcpudp_magic(saddr, daddr, len, proto, do_csum64(ptr, len));
-	return (sum == 0);
-}
-
 #endif /* _CSUM_X86_64_H */
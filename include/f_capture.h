@@ -7,6 +7,7 @@
 #define _FIRESTORM_CAPTURE_HEADER_INCLUDED_
 
 #include <nbio.h>
+#include <f_packet.h>
 
 struct _source {
 	struct nbio s_io;
@@ -14,13 +15,19 @@ struct _source {
 	const char *s_name;
 	decoder_t s_decoder;
 	unsigned int s_swab;
+	unsigned int s_csum;
 	struct list_head s_list;
+	/* reassembled packets go back in to the pipeline they came from */
+	pipeline_t s_pipeline;
 };
 
 /** Are timestamps on packets the current system time? */
 #define CAPDEV_REALTIME	(1<<0)
 /** The only way a capture can be "asynchronous" is to use the nbio API. */
 #define CAPDEV_ASYNC	(1<<1)
+/** Packet data stays put until the source is freed, so it can be batched
+ * and referenced by flow state, see PKT_STABLE */
+#define CAPDEV_STABLE	(1<<2)
 
 struct _capdev {
 	bitmask_t c_flags;
@@ -42,6 +49,19 @@ struct _capdev {
 void _source_new(struct _source *s, const struct _capdev *c, const char *label)
 	_nonull(1,2,3);
 
+/* Should L4 checksums on this packet be verified? */
+static inline int source_csum_verify(struct _source *src, const struct _pkt *p)
+{
+	switch(src->s_csum) {
+	case SOURCE_CSUM_VERIFY:
+		return 1;
+	case SOURCE_CSUM_OFF:
+		return 0;
+	default:
+		return (p->pkt_csum == PKT_CSUM_NONE);
+	}
+}
+
 static inline uint16_t source_h16(struct _source *src, uint16_t i)
 {
 	return (src->s_swab) ? sys_bswap16(i) : i;
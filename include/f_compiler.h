@@ -41,6 +41,10 @@
 #define _check_result __attribute__((warn_unused_result))
 #endif
 
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 1)
+#define prefetch(x) __builtin_prefetch(x)
+#endif
+
 #ifndef _packed
 #define _packed
 #endif
@@ -98,10 +102,19 @@
 #define likely(x) (x)
 #endif
 
+#ifndef prefetch
+#define prefetch(x) do{}while(0)
+#endif
+
 #ifndef unlikely
 #define unlikely(x) (x)
 #endif
 
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE 64
+#endif
+#define _cacheline __attribute__((aligned(CACHELINE_SIZE)))
+
 #define BITMASK_ANY (-1UL)
 typedef unsigned long bitmask_t;
 
@@ -17,14 +17,19 @@ enum {
 	NS_IPX, /* Novell Netware's IPX */
 	NS_CISCO, /* Cisco SNAP id's */
 	NS_APPLE, /* Apple SNAP id's */
+	NS_UDP, /* UDP destination ports, network byte order */
 	NS_MAX,
 };
 
+/* d_flow_ctor() is called once for each pipeline, whatever it returns is
+ * that pipeline's flow tracking state and is handed to p_flowtrack() and
+ * p_flowprefetch() of all the decoder's protocols. NULL means failure.
+ */
 struct _decoder {
 	unsigned int d_idx;
 	void (*d_decode)(struct _pkt *p);
-	int (*d_flow_ctor)(void);
-	void (*d_flow_dtor)(void);
+	void *(*d_flow_ctor)(void);
+	void (*d_flow_dtor)(void *flow);
 	struct _proto *d_protos;
 	struct _decoder *d_next;
 	const char *d_label;
@@ -46,15 +51,30 @@ struct _proto {
 	struct _proto *p_next;
 	struct _decoder *p_owner;
 	size_t p_dcb_sz; /* max dcb size */
-	void (*p_flowtrack)(pkt_t pkt, dcb_t dcb);
+	void (*p_flowtrack)(void *flow, pkt_t pkt, dcb_t dcb);
+	/* optional: warm the cache for p_flowtrack() ahead of a burst */
+	void (*p_flowprefetch)(void *flow, pkt_t pkt, dcb_t dcb,
+				unsigned int pass);
 	const char *p_label;
 };
 
+/* p_flowprefetch() passes, each is run over the whole burst in turn */
+#define FLOW_PREFETCH_BUCKET	0 /* hash and prefetch table slots */
+#define FLOW_PREFETCH_ENTRY	1 /* prefetch what the slots point at */
+#define FLOW_PREFETCH_PASSES	2
+
 struct _dcb {
 	struct _proto *dcb_proto;
 	struct _dcb *dcb_next;
 };
 
+struct decode_stats {
+	uint64_t ds_pkts; /* layers decoded */
+	uint64_t ds_bytes; /* total length of packets with this layer */
+	uint64_t ds_trunc;
+	uint64_t ds_malformed;
+};
+
 /* ===[ Front end API: decoding ]=== */
 unsigned int decode_num_protocols(void);
 unsigned int decode_num_decoders(void);
@@ -63,6 +83,9 @@ int decode_foreach_protocol(int(*cbfn)(proto_t p, void *priv), void *priv)
 				_nonull(1);
 int decode_foreach_decoder(int(*cbfn)(decoder_t, void *priv), void *priv)
 				_nonull(1);
+void decode_proto_stats(proto_t p, struct decode_stats *st) _nonull(1,2);
+void decode_total_stats(struct decode_stats *st) _nonull(1);
+void decode_stats_report(void);
 
 /* ===[ Backend API: for protocol/decoder plugins ]=== */
 void decoder_add(struct _decoder *d);
@@ -74,5 +97,7 @@ struct _dcb *decode_layer(pkt_t pkt, struct _proto *p);
 struct _dcb *decode_layer0(pkt_t pkt, struct _proto *p);
 struct _dcb *decode_layerv(pkt_t pkt, struct _proto *p, size_t sz);
 struct _dcb *decode_layerv0(pkt_t pkt, struct _proto *p, size_t sz);
+void decode_truncated(pkt_t pkt, struct _proto *p) _nonull(1,2);
+void decode_malformed(pkt_t pkt, struct _proto *p) _nonull(1,2);
 
 #endif /* _FIRESTORM_DECODE_HEADER_INCLUDED_ */
@@ -0,0 +1,77 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Flow accounting. Flow trackers keep a flow_acct in each of their
+ * sessions and hand a flow_rec to flow_export() when the session goes
+ * away. Records are written out as biflow IPFIX to the file named by
+ * $FIRESTORM_IPFIX, if set. Each tracker instance gets an exporter of its
+ * own from flow_exporter_new(), which only it may use.
+*/
+#ifndef _FIRESTORM_FLOW_HEADER_INCLUDED_
+#define _FIRESTORM_FLOW_HEADER_INCLUDED_
+
+/* Why a flow ended, these are the IPFIX flowEndReason values */
+#define FLOW_END_IDLE		1
+#define FLOW_END_ACTIVE		2
+#define FLOW_END_EOF		3
+#define FLOW_END_FORCED		4
+#define FLOW_END_OOM		5
+
+#define FLOW_DIR_FWD		0 /* from the initiator */
+#define FLOW_DIR_REV		1
+
+/* Every pipeline has its own trackers, each keeping to a private reserve
+ * of memchunks. memchunk_init() has to be given FLOW_PIPELINE_CHUNKS for
+ * each pipeline that will be running at once.
+ */
+#define FLOW_TCP_CHUNKS		1024
+#define FLOW_UDP_CHUNKS		64
+#define FLOW_IP_CHUNKS		64
+#define FLOW_DEFRAG_CHUNKS	32
+#define FLOW_PIPELINE_CHUNKS	(FLOW_TCP_CHUNKS + FLOW_UDP_CHUNKS + \
+				FLOW_IP_CHUNKS + FLOW_DEFRAG_CHUNKS)
+
+struct flow_acct {
+	timestamp_t	fa_first;
+	timestamp_t	fa_last;
+	uint64_t	fa_bytes[2];
+	uint32_t	fa_pkts[2];
+	uint8_t		fa_tcp_flags;
+};
+
+/* Addresses and ports in network byte order, src is the initiator */
+struct flow_rec {
+	const struct flow_acct	*fr_acct;
+	uint32_t		fr_saddr, fr_daddr;
+	uint16_t		fr_sport, fr_dport;
+	uint32_t		fr_vlan;
+	uint8_t			fr_proto;
+	uint8_t			fr_end;
+};
+
+static inline void flow_acct_init(struct flow_acct *fa, timestamp_t now)
+{
+	memset(fa, 0, sizeof(*fa));
+	fa->fa_first = fa->fa_last = now;
+}
+
+static inline void flow_acct_update(struct flow_acct *fa, unsigned int dir,
+					size_t len, timestamp_t now)
+{
+	fa->fa_pkts[dir]++;
+	fa->fa_bytes[dir] += len;
+	fa->fa_last = now;
+}
+
+typedef struct _flow_exporter *flow_exporter_t;
+
+int _flow_export_ctor(void);
+void _flow_export_dtor(void);
+flow_exporter_t flow_exporter_new(void);
+void flow_exporter_free(flow_exporter_t fx);
+void flow_export(flow_exporter_t fx, const struct flow_rec *fr) _nonull(1,2);
+void flow_export_tick(flow_exporter_t fx, timestamp_t now) _nonull(1);
+
+#endif /* _FIRESTORM_FLOW_HEADER_INCLUDED_ */
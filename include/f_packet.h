@@ -6,9 +6,21 @@
 #ifndef _FIRESTORM_PACKET_HEADER_INCLUDED_
 #define _FIRESTORM_PACKET_HEADER_INCLUDED_
 
+/** Nothing known, checksums need verifying */
+#define PKT_CSUM_NONE		0
+/** Checksum already verified by the NIC or capture device */
+#define PKT_CSUM_VALID		1
+/** Transmit offload: checksum not filled in yet, can't be verified */
+#define PKT_CSUM_PARTIAL	2
+
+/** Packet data stays put until the source is freed, see CAPDEV_STABLE */
+#define PKT_STABLE		(1<<0)
+
 struct _pkt {
 	source_t	pkt_source;
 	timestamp_t 	pkt_ts;
+	/* sub-second part of pkt_ts in microseconds, 0 if unknown */
+	uint32_t	pkt_usec;
 
 	size_t		pkt_caplen;
 	size_t		pkt_len;
@@ -17,6 +29,16 @@ struct _pkt {
 
 	const uint8_t	*pkt_nxthdr;
 
+	/* innermost tunnel id (GRE key, VXLAN VNI, ERSPAN session) or 0 */
+	uint32_t	pkt_tunnel;
+	/* VLAN tag stack, 12 bits per tag, innermost in the low bits */
+	uint32_t	pkt_vlan;
+
+	/* PKT_CSUM_*, what the capture device knows about L4 checksums */
+	uint8_t		pkt_csum;
+	/* PKT_STABLE */
+	uint8_t		pkt_flags;
+
 	struct _dcb	*pkt_dcb_top;
 	struct _dcb	*pkt_dcb;
 	struct _dcb	*pkt_dcb_end;
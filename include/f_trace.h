@@ -0,0 +1,56 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Developer trace points. Unless configured with --enable-trace these
+ * compile to nothing. Otherwise they're enabled at runtime per module via
+ * $FIRESTORM_TRACE (eg. "tcp_state,tcp_segment" or "all") and optionally
+ * restricted to flows with an endpoint matching $FIRESTORM_TRACE_FLOW
+ * (eg. "10.0.0.1" or "10.0.0.1:80"). A disabled trace point costs one
+ * well predicted branch.
+*/
+#ifndef _FIRESTORM_TRACE_HEADER_INCLUDED_
+#define _FIRESTORM_TRACE_HEADER_INCLUDED_
+
+#define TRACE_TCP_STATE		(1U << 0)
+#define TRACE_TCP_SEGMENT	(1U << 1)
+#define TRACE_TCP_STREAM	(1U << 2)
+#define TRACE_TCP_REASM		(1U << 3)
+#define TRACE_ALL		(~0U)
+
+#if ENABLE_TRACE
+/* modules enabled, and modules enabled for the flow being processed */
+extern unsigned int _trace_mask;
+extern unsigned int _trace_cur;
+
+extern uint32_t _trace_addr;
+extern uint16_t _trace_port;
+
+#define trace_on(mod) unlikely(_trace_cur & (mod))
+#define tmesg(mod, x...) \
+	do { if ( trace_on(mod) ) mesg(M_DEBUG, x); } while(0)
+#define thex_dump(mod, x...) \
+	do { if ( trace_on(mod) ) hex_dump(x); } while(0)
+
+/* Select the trace set for an IPv4 flow, addresses/ports network order */
+static inline void trace_flow4(uint32_t saddr, uint16_t sport,
+				uint32_t daddr, uint16_t dport)
+{
+	if ( likely(!_trace_mask) )
+		return;
+	if ( !_trace_addr ||
+		(saddr == _trace_addr && (!_trace_port || sport == _trace_port)) ||
+		(daddr == _trace_addr && (!_trace_port || dport == _trace_port)) )
+		_trace_cur = _trace_mask;
+	else
+		_trace_cur = 0;
+}
+#else
+#define trace_on(mod) 0
+#define tmesg(mod, x...) do { } while(0)
+#define thex_dump(mod, x...) do { } while(0)
+#define trace_flow4(saddr, sport, daddr, dport) do { } while(0)
+#endif
+
+#endif /* _FIRESTORM_TRACE_HEADER_INCLUDED_ */
@@ -80,12 +80,15 @@ int vcasecmp(const struct ro_vec *v1, const struct ro_vec *v2);
 int vcmp(const struct ro_vec *v1, const struct ro_vec *v2);
 int vstrcmp(const struct ro_vec *v1, const char *str);
 size_t vtouint(struct ro_vec *v, unsigned int *u);
+const uint8_t *vlinear(const struct ro_vec *vec, size_t numv,
+			size_t ofs, size_t len, uint8_t *buf);
 
 /* -- Memchunk routines */
 int memchunk_init(size_t numchunks);
 void memchunk_fini(void);
 
 mempool_t mempool_new(const char *label, size_t numchunks);
+mempool_t mempool_new_private(const char *label, size_t numchunks);
 void mempool_free(mempool_t m);
 
 objcache_t objcache_init(mempool_t p, const char *l, size_t obj_sz) _malloc;
@@ -94,6 +97,7 @@ void *objcache_alloc(objcache_t o) _malloc;
 void *objcache_alloc0(objcache_t o) _malloc;
 void objcache_free(void *obj);
 void objcache_free2(objcache_t o, void *obj);
+size_t objcache_size(objcache_t o) _constfn;
 
 /* --- Data-source plugins */
 source_t capture_tcpdump_open(const char *fn);
@@ -106,6 +110,14 @@ source_t capture_pcap_open_live(const char *ifname, size_t mtu, int promisc);
 #endif
 void source_free(source_t s) _nonull(1);
 
+/** Skip packets the capture device says are verified or offloaded */
+#define SOURCE_CSUM_TRUST	0
+/** Verify everything regardless of what the capture device says */
+#define SOURCE_CSUM_VERIFY	1
+/** Never verify, eg. the NIC drops frames with bad checksums */
+#define SOURCE_CSUM_OFF		2
+void source_csum_policy(source_t s, unsigned int policy) _nonull(1);
+
 /* --- Decode API */
 void decode_init(void);
 decoder_t decoder_get(proto_ns_t ns, proto_id_t id);
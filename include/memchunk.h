@@ -65,6 +65,8 @@ struct _mempool {
 	const char *p_label;
 	unsigned int p_numfree;
 	unsigned int p_reserve;
+	/* never borrows from the global pool */
+	unsigned int p_private;
 };
 
 struct _memchunk {
@@ -0,0 +1,27 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _P_ETHER_HEADER_INCLUDED_
+#define _P_ETHER_HEADER_INCLUDED_
+
+#define VLAN_MAX_TAGS	4
+struct vlan_dcb {
+	struct _dcb vlan_dcb;
+	const struct pkt_vlanhdr *vlan_hdr; /* outermost tag */
+	/* VLAN ID's, outermost first, only the first VLAN_MAX_TAGS kept */
+	uint16_t vlan_id[VLAN_MAX_TAGS];
+	uint8_t vlan_num;
+};
+
+#define MPLS_MAX_LABELS	8
+struct mpls_dcb {
+	struct _dcb mpls_dcb;
+	const struct pkt_mplshdr *mpls_hdr; /* top of stack */
+	/* labels, top of stack first, only the first MPLS_MAX_LABELS kept */
+	uint32_t mpls_label[MPLS_MAX_LABELS];
+	uint8_t mpls_num;
+};
+
+#endif /* _P_ETHER_HEADER_INCLUDED_ */
@@ -0,0 +1,25 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _P_IPV6_HEADER_INCLUDED_
+#define _P_IPV6_HEADER_INCLUDED_
+
+struct ip6_dcb {
+	struct _dcb ip6_dcb;
+	const struct pkt_ip6hdr *ip6_iph;
+	uint8_t ip6_proto; /* upper layer protocol */
+};
+
+struct ip6frag_dcb {
+	struct _dcb ip6_dcb;
+	const struct pkt_ip6hdr *ip6_iph;
+	const struct pkt_ip6frag *ip6_frag;
+	/* offset of the next-header field which names the fragment header */
+	uint16_t ip6_nhoff;
+};
+
+extern struct _decoder _ipv6_decoder;
+
+#endif /* _P_IPV6_HEADER_INCLUDED_ */
@@ -18,20 +18,52 @@ struct tcpstream_dcb {
 	tcp_chan_t chan;
 };
 
+/* Stream protocol parsers. Sessions are bound to an app by server port once
+ * they're established. If a_state_sz is non-zero then that much per-session
+ * state is allocated for the app, see tcp_sesh_priv().
+ *
+ * a_push is called when the receiver acknowledges data, it's handed the
+ * bytes on chan that haven't been consumed yet as vectors pointing in to
+ * the reassembly buffers, which are only valid for the duration of the
+ * call. Use vlinear() where a parser really needs a contiguous window.
+ * Returns how many bytes were consumed, the rest is offered again along
+ * with whatever arrives after it. a_shutdown is called after the final
+ * push once the sender's FIN is acknowledged.
+ *
+ * Only the first a_depth bytes of each direction are reassembled, zero
+ * means the tracker's default. Past that, or once the app gives up on a
+ * channel with tcp_sesh_bypass(), the channel is bypassed: the tracker
+ * follows its sequence numbers but the data isn't buffered, a_push and
+ * a_shutdown aren't called for it again.
+ */
 struct tcp_app {
-	int (*a_push)(tcp_sesh_t sesh, tcp_chan_t chan);
+	size_t (*a_push)(tcp_sesh_t sesh, tcp_chan_t chan,
+			const struct ro_vec *vec, size_t numv, size_t bytes);
 	void (*a_state_update)(tcp_sesh_t sesh, tcp_chan_t chan, pkt_t pkt);
 	int (*a_shutdown)(tcp_sesh_t sesh, tcp_chan_t chan);
 	int (*a_init)(tcp_sesh_t sesh);
 	void (*a_fini)(tcp_sesh_t sesh);
 	struct _decoder *a_decode;
 	size_t a_max_dcb;
+	size_t a_state_sz;
+	uint32_t a_depth;
+	unsigned int a_idx;
 	struct tcp_app *a_next;
 	const char *a_label;
 };
 
 void tcp_app_register(struct tcp_app *app);
 void tcp_app_register_dport(struct tcp_app *app, uint16_t dport);
+void *tcp_sesh_priv(tcp_sesh_t sesh);
+/* No further interest in chans, may be called from a_push */
+void tcp_sesh_bypass(tcp_sesh_t sesh, tcp_chan_t chans);
+
+/* Passive round trip time, measured with TCP timestamps, between the
+ * sensor and the end that chan is headed for. In microseconds, returns
+ * 0 if there's no sample yet.
+ */
+int tcp_sesh_rtt(tcp_sesh_t sesh, tcp_chan_t chan,
+			uint32_t *srtt, uint32_t *min_rtt);
 /* TODO: register content/initiator-chan heuristics for proto detection */
 
 extern struct _decoder _tcpstream_decoder;
@@ -0,0 +1,28 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _P_TUNNEL_HEADER_INCLUDED_
+#define _P_TUNNEL_HEADER_INCLUDED_
+
+struct gre_dcb {
+	struct _dcb gre_dcb;
+	const struct pkt_grehdr *gre_hdr;
+	uint32_t gre_key; /* host byte order, 0 if not present */
+};
+
+struct erspan_dcb {
+	struct _dcb erspan_dcb;
+	const uint8_t *erspan_hdr;
+	uint16_t erspan_session;
+	uint8_t erspan_ver;
+};
+
+struct vxlan_dcb {
+	struct _dcb vxlan_dcb;
+	const struct pkt_vxlanhdr *vxlan_hdr;
+	uint32_t vxlan_vni;
+};
+
+#endif /* _P_TUNNEL_HEADER_INCLUDED_ */
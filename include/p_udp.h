@@ -0,0 +1,34 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _P_UDP_HEADER_INCLUDED_
+#define _P_UDP_HEADER_INCLUDED_
+
+#define UDP_CHAN_TO_SERVER	(1<<0)
+#define UDP_CHAN_TO_CLIENT	(1<<1)
+
+typedef struct udp_session *udp_sesh_t;
+typedef uint8_t udp_chan_t;
+
+/* Datagram protocol parsers. Sessions are bound to an app by server port
+ * when they're created. If a_state_sz is non-zero then that much per-flow
+ * state is allocated for the app, see udp_sesh_priv().
+ */
+struct udp_app {
+	int (*a_init)(udp_sesh_t sesh);
+	void (*a_datagram)(udp_sesh_t sesh, udp_chan_t chan, pkt_t pkt,
+				const uint8_t *buf, size_t len);
+	void (*a_fini)(udp_sesh_t sesh);
+	size_t a_state_sz;
+	unsigned int a_idx;
+	struct udp_app *a_next;
+	const char *a_label;
+};
+
+void udp_app_register(struct udp_app *app);
+void udp_app_register_dport(struct udp_app *app, uint16_t dport);
+void *udp_sesh_priv(udp_sesh_t sesh);
+
+#endif /* _P_UDP_HEADER_INCLUDED_ */
@@ -32,11 +32,7 @@ struct pkt_snaphdr {
 	uint16_t	proto;
 } _packed;
 
-#define VLAN_ID 0xffffff
-struct pkt_vlanhdr {
-	uint16_t	vlan;
-	uint16_t	proto;
-} _packed;
+#include <pkt/vlan.h>
 
 void _eth_decode(struct _pkt *p);
 
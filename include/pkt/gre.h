@@ -8,9 +8,38 @@
 * reserved
 */
 
+#define GRE_CSUM	0x8000
+#define GRE_ROUTING	0x4000
+#define GRE_KEY		0x2000
+#define GRE_SEQ		0x1000
+#define GRE_VERSION	0x0007
+
+/* Payload types which are not ethertypes in their own right */
+#define GRE_PROTO_TEB		0x6558 /* transparent ethernet bridging */
+#define GRE_PROTO_ERSPAN2	0x88be
+#define GRE_PROTO_ERSPAN3	0x22eb
+
 struct pkt_grehdr {
 	uint16_t	c_res_ver;
 	uint16_t	proto;
 } _packed;
 
+/* Cisco ERSPAN type II */
+#define ERSPAN_SESSION	0x03ff
+struct pkt_erspan2hdr {
+	uint16_t	ver_vlan;
+	uint16_t	cos_en_t_session;
+	uint32_t	res_index;
+} _packed;
+
+/* ERSPAN type III, followed by an 8 byte platform sub-header if O is set */
+#define ERSPAN3_O	0x0001
+struct pkt_erspan3hdr {
+	uint16_t	ver_vlan;
+	uint16_t	cos_bso_t_session;
+	uint32_t	timestamp;
+	uint16_t	sgt;
+	uint16_t	p_ft_hwid_d_gra_o;
+} _packed;
+
 #endif /* _PKT_GRE_HEADER_INCLUDED_ */
@@ -27,6 +27,8 @@
 #define IP_PROTO_TCP	0x06
 #define IP_PROTO_UDP	0x11
 #define IP_PROTO_DCCP	0x21
+#define IP_PROTO_IPV6	0x29
+#define IP_PROTO_GRE	0x2f
 #define IP_PROTO_ESP	0x32
 #define IP_PROTO_AH	0x33
 #define IP_PROTO_SCTP	0x84
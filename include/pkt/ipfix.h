@@ -0,0 +1,49 @@
+#ifndef _PKT_IPFIX_HEADER_INCLUDED_
+#define _PKT_IPFIX_HEADER_INCLUDED_
+
+/* RFC 7011 */
+#define IPFIX_VERSION		10
+#define IPFIX_MAX_MSG		0xffff
+
+#define IPFIX_SET_TEMPLATE	2
+#define IPFIX_SET_DATA_MIN	256
+
+/* enterprise bit on an IE id, a 32 bit PEN follows the field specifier */
+#define IPFIX_IE_ENTERPRISE	0x8000
+
+/* RFC 5103 biflow reverse information elements */
+#define IPFIX_PEN_REVERSE	29305
+
+/* Information elements, see IANA ipfix registry */
+#define IPFIX_IE_OCTET_DELTA		1
+#define IPFIX_IE_PACKET_DELTA		2
+#define IPFIX_IE_PROTOCOL		4
+#define IPFIX_IE_TCP_FLAGS		6
+#define IPFIX_IE_SRC_PORT		7
+#define IPFIX_IE_SRC_IPV4		8
+#define IPFIX_IE_DST_PORT		11
+#define IPFIX_IE_DST_IPV4		12
+#define IPFIX_IE_VLAN_ID		58
+#define IPFIX_IE_FLOW_END_REASON	136
+#define IPFIX_IE_FLOW_START_SECONDS	150
+#define IPFIX_IE_FLOW_END_SECONDS	151
+
+struct pkt_ipfixhdr {
+	uint16_t	version;
+	uint16_t	len;
+	uint32_t	export_time;
+	uint32_t	seq;
+	uint32_t	domain;
+} _packed;
+
+struct pkt_ipfixset {
+	uint16_t	id;
+	uint16_t	len;
+} _packed;
+
+struct pkt_ipfixtmpl {
+	uint16_t	id;
+	uint16_t	num_fields;
+} _packed;
+
+#endif /* _PKT_IPFIX_HEADER_INCLUDED_ */
@@ -2,11 +2,23 @@
 #define __PKT_IPV6_HEADER_INCLUDED__
 
 #define IP6_PROTO_HOPBYHOP	0x00
+#define IP6_PROTO_IPIP		0x04
 #define IP6_PROTO_TCP		0x06
 #define IP6_PROTO_UDP		0x11
+#define IP6_PROTO_IPV6		0x29
+#define IP6_PROTO_ROUTING	0x2b
+#define IP6_PROTO_FRAGMENT	0x2c
+#define IP6_PROTO_GRE		0x2f
+#define IP6_PROTO_ESP		0x32
+#define IP6_PROTO_AH		0x33
 #define IP6_PROTO_ICMP		0x3a
+#define IP6_PROTO_NONE		0x3b
+#define IP6_PROTO_DSTOPTS	0x3c
 #define IP6_PROTO_PIM		0x67
 
+#define IP6_MF			0x0001	/* more fragments flag */
+#define IP6_OFFMASK		0xfff8	/* mask for fragment offset */
+
 struct ip6_addr {
 	union {
 		uint8_t addr[16];
@@ -24,4 +36,17 @@ struct pkt_ip6hdr {
 	struct ip6_addr ip6_src, ip6_dst;
 } _packed;
 
+/* Generic extension header: hop-by-hop, routing, destination options */
+struct pkt_ip6ext {
+	uint8_t ip6e_nxt;
+	uint8_t ip6e_len;
+} _packed;
+
+struct pkt_ip6frag {
+	uint8_t ip6f_nxt;
+	uint8_t ip6f_res;
+	uint16_t ip6f_offlg;
+	uint32_t ip6f_ident;
+} _packed;
+
 #endif /* __PKT_IPV6_HEADER_INCLUDED__ */
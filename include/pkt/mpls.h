@@ -0,0 +1,21 @@
+#ifndef _PKT_MPLS_HEADER_INCLUDED_
+#define _PKT_MPLS_HEADER_INCLUDED_
+
+#define ETHER_MPLS_UC	0x8847
+#define ETHER_MPLS_MC	0x8848
+
+/* label: 20, traffic class: 3, bottom of stack: 1, ttl: 8 */
+#define MPLS_LABEL(x)	((x) >> 12)
+#define MPLS_TC(x)	(((x) >> 9) & 0x7)
+#define MPLS_BOS	0x100
+#define MPLS_TTL(x)	((x) & 0xff)
+
+/* Reserved labels */
+#define MPLS_LABEL_IPV4_NULL	0
+#define MPLS_LABEL_IPV6_NULL	2
+
+struct pkt_mplshdr {
+	uint32_t	lbl_tc_s_ttl;
+} _packed;
+
+#endif /* _PKT_MPLS_HEADER_INCLUDED_ */
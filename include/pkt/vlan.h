@@ -1,7 +1,12 @@
 #ifndef _PKT_VLAN_HEADER_INCLUDED_
 #define _PKT_VLAN_HEADER_INCLUDED_
 
-#define VLAN_ID 0xffffff
+/* Tag protocol identifiers */
+#define VLAN_TPID_8021Q		0x8100
+#define VLAN_TPID_8021AD	0x88a8
+#define VLAN_TPID_QINQ		0x9100 /* pre-standard QinQ */
+
+#define VLAN_ID 0x0fff
 struct pkt_vlanhdr {
 	uint16_t	vlan;
 	uint16_t	proto;
@@ -0,0 +1,15 @@
+#ifndef _PKT_VXLAN_HEADER_INCLUDED_
+#define _PKT_VXLAN_HEADER_INCLUDED_
+
+#define VXLAN_PORT	4789
+
+/* I flag: VNI field is valid */
+#define VXLAN_FLAG_VNI	0x08
+
+struct pkt_vxlanhdr {
+	uint8_t		flags;
+	uint8_t		res0[3];
+	uint32_t	vni_res; /* 24 bit VNI, 8 bits reserved */
+} _packed;
+
+#endif /* _PKT_VXLAN_HEADER_INCLUDED_ */
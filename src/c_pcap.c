@@ -71,6 +71,7 @@ static void lpf_callback(u_char *user, struct pcap_pkthdr *header, u_char *data)
 		return;
 
 	p->pkt.pkt_ts = time_from_timeval(&header->ts);
+	p->pkt.pkt_usec = header->ts.tv_usec;
 	p->pkt.pkt_len = header->len;
 	p->pkt.pkt_caplen = header->caplen;
 	p->pkt.pkt_base = data;
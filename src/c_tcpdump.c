@@ -206,6 +206,7 @@ static pkt_t tcpd_dequeue(struct _source *s, struct iothread *io)
 	tmp.tv_sec = p->r32(h->tv_sec);
 	tmp.tv_usec = p->r32(h->tv_usec);
 	p->pkt.pkt_ts = time_from_timeval(&tmp);
+	p->pkt.pkt_usec = tmp.tv_usec;
 	p->pkt.pkt_len = p->r32(h->len);
 	p->pkt.pkt_caplen = p->r32(h->caplen);
 	p->pkt.pkt_base = p->cur;
@@ -218,6 +219,7 @@ static pkt_t tcpd_dequeue(struct _source *s, struct iothread *io)
 }
 
 static const struct _capdev capdev = {
+	.c_flags = CAPDEV_STABLE,
 	.c_name = "tcpdump",
 	.c_dtor = tcpd_free,
 	.c_dequeue = tcpd_dequeue,
@@ -235,6 +237,7 @@ source_t capture_tcpdump_open(const char *fn)
 
 	_source_new(&p->src, &capdev, fn);
 	p->pkt.pkt_source = &p->src;
+	p->pkt.pkt_flags = PKT_STABLE;
 	p->fd = -1;
 
 	if ( !decode_pkt_realloc(&p->pkt, DECODE_DEFAULT_MIN_LAYERS) )
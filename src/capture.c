@@ -14,9 +14,16 @@ void _source_new(struct _source *s, const struct _capdev *c, const char *label)
 	s->s_io.ops = NULL;
 	s->s_capdev = c;
 	s->s_name = label;
+	s->s_csum = SOURCE_CSUM_TRUST;
 	INIT_LIST_HEAD(&s->s_list);
 }
 
+void source_csum_policy(source_t s, unsigned int policy)
+{
+	assert(policy <= SOURCE_CSUM_OFF);
+	s->s_csum = policy;
+}
+
 void source_free(source_t s)
 {
 	if ( s ) {
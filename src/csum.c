@@ -0,0 +1,162 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Internet checksum kernels. csum_block() is bound at startup to the
+ * widest one the CPU supports. The vector kernels add the low and high
+ * halves of each 32 bit lane into separate lanes so there are no carries
+ * to propagate until the horizontal sum at the end of a batch.
+*/
+
+#include <firestorm.h>
+#include <csum.h>
+
+#if defined(__x86_64__) && (__GNUC__ > 4 || defined(__clang__))
+#define CSUM_VECTOR 1
+#include <immintrin.h>
+#endif
+
+/* Iterations before a lane can overflow: each adds at most 2 * 0xffff */
+#define CSUM_VEC_BATCH	32768
+
+static uint32_t csum_generic(const uint8_t *buf, size_t len)
+{
+#ifdef __x86_64__
+	return do_csum64(buf, len);
+#else
+	return do_csum_sw(buf, len);
+#endif
+}
+
+uint32_t (*csum_block)(const uint8_t *buf, size_t len) = csum_generic;
+
+static uint32_t fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return sum;
+}
+
+#if CSUM_VECTOR
+static uint64_t hsum128(__m128i v)
+{
+	uint32_t l[4];
+	_mm_storeu_si128((__m128i *)l, v);
+	return (uint64_t)l[0] + l[1] + l[2] + l[3];
+}
+
+static uint32_t csum_sse2(const uint8_t *buf, size_t len)
+{
+	const __m128i mask = _mm_set1_epi32(0xffff);
+	uint64_t sum = 0;
+
+	while ( len >= 32 ) {
+		__m128i a = _mm_setzero_si128();
+		__m128i b = _mm_setzero_si128();
+		size_t n;
+
+		n = len / 32;
+		if ( n > CSUM_VEC_BATCH )
+			n = CSUM_VEC_BATCH;
+		len -= n * 32;
+
+		for(; n; n--, buf += 32) {
+			__m128i x, y;
+
+			x = _mm_loadu_si128((const __m128i *)buf);
+			y = _mm_loadu_si128((const __m128i *)(buf + 16));
+			a = _mm_add_epi32(a, _mm_and_si128(x, mask));
+			b = _mm_add_epi32(b, _mm_srli_epi32(x, 16));
+			a = _mm_add_epi32(a, _mm_and_si128(y, mask));
+			b = _mm_add_epi32(b, _mm_srli_epi32(y, 16));
+		}
+
+		sum += hsum128(a) + hsum128(b);
+	}
+
+	/* tail starts on an even offset so the word pairing is unchanged */
+	sum += csum_generic(buf, len);
+	return fold64(sum);
+}
+
+static inline uint64_t hsum256(__m256i v)
+	__attribute__((target("avx2")));
+static inline uint64_t hsum256(__m256i v)
+{
+	uint32_t l[8];
+	unsigned int i;
+	uint64_t ret;
+
+	_mm256_storeu_si256((__m256i *)l, v);
+	for(ret = i = 0; i < 8; i++)
+		ret += l[i];
+	return ret;
+}
+
+/* Mustn't call out to the SSE kernel for the tail, the transition from
+ * dirty upper halves to legacy SSE code costs more than the whole sum.
+ */
+__attribute__((target("avx2")))
+static uint32_t csum_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	uint64_t sum = 0;
+
+	while ( len >= 32 ) {
+		__m256i a = _mm256_setzero_si256();
+		__m256i b = _mm256_setzero_si256();
+		__m256i x, y;
+		size_t n;
+
+		n = len / 64;
+		if ( n > CSUM_VEC_BATCH )
+			n = CSUM_VEC_BATCH;
+		len -= n * 64;
+
+		for(; n; n--, buf += 64) {
+			x = _mm256_loadu_si256((const __m256i *)buf);
+			y = _mm256_loadu_si256((const __m256i *)(buf + 32));
+			a = _mm256_add_epi32(a, _mm256_and_si256(x, mask));
+			b = _mm256_add_epi32(b, _mm256_srli_epi32(x, 16));
+			a = _mm256_add_epi32(a, _mm256_and_si256(y, mask));
+			b = _mm256_add_epi32(b, _mm256_srli_epi32(y, 16));
+		}
+
+		if ( len >= 32 && len < 64 ) {
+			x = _mm256_loadu_si256((const __m256i *)buf);
+			a = _mm256_add_epi32(a, _mm256_and_si256(x, mask));
+			b = _mm256_add_epi32(b, _mm256_srli_epi32(x, 16));
+			buf += 32;
+			len -= 32;
+		}
+
+		sum += hsum256(a) + hsum256(b);
+	}
+
+	_mm256_zeroupper();
+	return fold64(sum + csum_generic(buf, len));
+}
+#endif
+
+static void __attribute__((constructor)) csum_ctor(void)
+{
+#if CSUM_VECTOR
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )
+		csum_block = csum_avx2;
+	else
+		csum_block = csum_sse2;
+#endif
+}
+
+const char *csum_kernel(void)
+{
+#if CSUM_VECTOR
+	if ( csum_block == csum_avx2 )
+		return "avx2";
+	if ( csum_block == csum_sse2 )
+		return "sse2";
+#endif
+	return "generic";
+}
@@ -23,6 +23,7 @@ static struct _namespace ns_arr[NS_MAX] = {
 	[NS_IPX]	{.ns_label = "IPX"},
 	[NS_APPLE]	{.ns_label = "APPLE"},
 	[NS_CISCO]	{.ns_label = "CISCO"},
+	[NS_UDP]	{.ns_label = "UDP"},
 };
 
 static unsigned int num_decoders;
@@ -34,6 +35,120 @@ static struct _proto *special_protos;
 
 static size_t max_dcb;
 
+/* Per-protocol counters. Every thread gets a private cacheline aligned
+ * array, indexed by p_idx, so updating them never contends. The arrays are
+ * pushed on to a lock-free list and only summed when someone asks. The
+ * extra slot at the end counts frames passed to decode().
+ */
+struct stats_block {
+	struct stats_block *sb_next;
+	struct decode_stats sb_stats[] _cacheline;
+};
+
+static struct stats_block *stats_list;
+static __thread struct decode_stats *tls_stats;
+
+static struct decode_stats *stats_alloc(void)
+{
+	struct stats_block *b;
+	size_t sz;
+
+	sz = sizeof(*b) + (num_protos + 1) * sizeof(*b->sb_stats);
+	if ( posix_memalign((void **)&b, CACHELINE_SIZE, sz) )
+		return NULL;
+
+	memset(b, 0, sz);
+
+	do {
+		b->sb_next = stats_list;
+	}while( !__sync_bool_compare_and_swap(&stats_list, b->sb_next, b) );
+
+	tls_stats = b->sb_stats;
+	return tls_stats;
+}
+
+static inline struct decode_stats *stats_get(void)
+{
+	if ( likely(tls_stats) )
+		return tls_stats;
+	return stats_alloc();
+}
+
+static inline void stats_layer(pkt_t pkt, struct _proto *p)
+{
+	struct decode_stats *st;
+
+	if ( NULL == p || NULL == (st = stats_get()) )
+		return;
+
+	st[p->p_idx].ds_pkts++;
+	st[p->p_idx].ds_bytes += pkt->pkt_len;
+}
+
+void decode_truncated(pkt_t pkt, struct _proto *p)
+{
+	struct decode_stats *st = stats_get();
+	if ( st )
+		st[p->p_idx].ds_trunc++;
+}
+
+void decode_malformed(pkt_t pkt, struct _proto *p)
+{
+	struct decode_stats *st = stats_get();
+	if ( st )
+		st[p->p_idx].ds_malformed++;
+}
+
+static void stats_sum(unsigned int idx, struct decode_stats *st)
+{
+	const struct stats_block *b;
+
+	memset(st, 0, sizeof(*st));
+	for(b = stats_list; b; b = b->sb_next) {
+		st->ds_pkts += b->sb_stats[idx].ds_pkts;
+		st->ds_bytes += b->sb_stats[idx].ds_bytes;
+		st->ds_trunc += b->sb_stats[idx].ds_trunc;
+		st->ds_malformed += b->sb_stats[idx].ds_malformed;
+	}
+}
+
+void decode_proto_stats(proto_t p, struct decode_stats *st)
+{
+	stats_sum(p->p_idx, st);
+}
+
+void decode_total_stats(struct decode_stats *st)
+{
+	stats_sum(num_protos, st);
+}
+
+static int report_proto(struct _proto *p, void *priv)
+{
+	const struct decode_stats *tot = priv;
+	struct decode_stats st;
+
+	decode_proto_stats(p, &st);
+	if ( !(st.ds_pkts || st.ds_trunc || st.ds_malformed) )
+		return 1;
+
+	mesg(M_INFO, "decode: %12s: %"PRIu64" pkts (%.2f%%), "
+		"%"PRIu64" bytes, %"PRIu64" truncated, %"PRIu64" malformed",
+		p->p_label, st.ds_pkts,
+		(tot->ds_pkts) ? (st.ds_pkts * 100.0) / tot->ds_pkts : 0.0,
+		st.ds_bytes, st.ds_trunc, st.ds_malformed);
+	return 1;
+}
+
+void decode_stats_report(void)
+{
+	struct decode_stats tot;
+
+	decode_total_stats(&tot);
+	mesg(M_INFO, "decode: %"PRIu64" frames, %"PRIu64" bytes",
+		tot.ds_pkts, tot.ds_bytes);
+	decode_foreach_protocol(report_proto, &tot);
+}
+
 _constfn static struct _decoder *
 ns_entry_search(const struct _ns_entry *p, unsigned int n, proto_id_t id)
 {
@@ -85,8 +200,10 @@ struct _dcb *decode_layer(pkt_t pkt, struct _proto *p)
 {
 	struct _dcb *ret;
 	ret = dcb_alloc(pkt, p->p_dcb_sz);
-	if ( ret )
+	if ( ret ) {
 		ret->dcb_proto = p;
+		stats_layer(pkt, p);
+	}
 	return ret;
 }
 
@@ -96,6 +213,7 @@ struct _dcb *decode_layer0(pkt_t pkt, struct _proto *p)
 	ret = dcb_alloc(pkt, p->p_dcb_sz);
 	if ( ret ) {
 		ret->dcb_proto = p;
+		stats_layer(pkt, p);
 		memset(&ret[1], 0, p->p_dcb_sz - sizeof(*ret));
 	}
 	return ret;
@@ -107,8 +225,10 @@ struct _dcb *decode_layerv(pkt_t pkt, struct _proto *p, size_t sz)
 	assert(NULL == p || sz >= p->p_dcb_sz);
 	assert(sz >= sizeof(struct _dcb));
 	ret = dcb_alloc(pkt, sz);
-	if ( ret )
+	if ( ret ) {
 		ret->dcb_proto = p;
+		stats_layer(pkt, p);
+	}
 	return ret;
 }
 
@@ -120,6 +240,7 @@ struct _dcb *decode_layerv0(pkt_t pkt, struct _proto *p, size_t sz)
 	ret = dcb_alloc(pkt, sz);
 	if ( ret ) {
 		ret->dcb_proto = p;
+		stats_layer(pkt, p);
 		memset(&ret[1], 0, sz - sizeof(*ret));
 	}
 	return ret;
@@ -206,10 +327,11 @@ void decode_init(void)
 		unsigned int j;
 
 		/* for binary search */
-		qsort(ns_arr[i].ns_reg,
-			ns_arr[i].ns_num_reg,
-			sizeof(*ns_arr[i].ns_reg),
-			nsentry_cmp);
+		if ( ns_arr[i].ns_num_reg )
+			qsort(ns_arr[i].ns_reg,
+				ns_arr[i].ns_num_reg,
+				sizeof(*ns_arr[i].ns_reg),
+				nsentry_cmp);
 
 		if ( ns_arr[i].ns_num_reg )
 			fprintf(f, "\t\"ns_%s\" [label=\"%s\" "
@@ -368,7 +490,17 @@ int decode_pkt_realloc(struct _pkt *p, unsigned int min_layers)
 
 void decode(struct _pkt *p, struct _decoder *d)
 {
+	struct decode_stats *st;
+
+	st = stats_get();
+	if ( st ) {
+		st[num_protos].ds_pkts++;
+		st[num_protos].ds_bytes += p->pkt_len;
+	}
+
 	p->pkt_nxthdr = p->pkt_base;
+	p->pkt_tunnel = 0;
+	p->pkt_vlan = 0;
 	p->pkt_dcb_top = p->pkt_dcb;
 	d->d_decode(p);
 }
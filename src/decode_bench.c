@@ -0,0 +1,278 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Decoder microbenchmark. Captures are loaded in to memory and decode()
+ * is run over them repeatedly, no flow tracking or analysis. Timings are
+ * reported per capture (ie. per link type) and per protocol path, where
+ * the path is the sequence of layers the decoders recorded.
+ *
+ *   usage: decode_bench [-n iterations] file.cap [file.cap ...]
+*/
+
+#include <firestorm.h>
+#include <f_capture.h>
+#include <f_packet.h>
+#include <f_decode.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_MAX_LABEL	128
+#define DEFAULT_ITER	1000
+
+struct bench_path {
+	char label[PATH_MAX_LABEL];
+	unsigned int *pkts;
+	unsigned int num_pkts;
+};
+
+struct bench_pkt {
+	size_t ofs;
+	size_t caplen;
+	size_t len;
+};
+
+struct bench {
+	const char *fn;
+	decoder_t decoder;
+	struct _source *src;
+
+	uint8_t *buf;
+	size_t buf_len;
+
+	struct bench_pkt *pkts;
+	unsigned int num_pkts;
+
+	struct bench_path *paths;
+	unsigned int num_paths;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pkt_setup(struct bench *b, struct _pkt *pkt, unsigned int i)
+{
+	pkt->pkt_base = b->buf + b->pkts[i].ofs;
+	pkt->pkt_end = pkt->pkt_base + b->pkts[i].caplen;
+	pkt->pkt_caplen = b->pkts[i].caplen;
+	pkt->pkt_len = b->pkts[i].len;
+}
+
+/* Copy a capture in to one flat buffer so the benchmark isn't measuring
+ * page faults on the mmap'd file.
+ */
+static int bench_load(struct bench *b)
+{
+	size_t buf_sz = 0, pkts_sz = 0;
+	struct _pkt *pkt;
+
+	b->src = capture_tcpdump_open(b->fn);
+	if ( NULL == b->src )
+		return 0;
+
+	b->decoder = b->src->s_decoder;
+
+	while( (pkt = b->src->s_capdev->c_dequeue(b->src, NULL)) ) {
+		if ( b->num_pkts == pkts_sz ) {
+			struct bench_pkt *new;
+			pkts_sz = (pkts_sz) ? pkts_sz << 1 : 1024;
+			new = realloc(b->pkts, pkts_sz * sizeof(*new));
+			if ( NULL == new )
+				return 0;
+			b->pkts = new;
+		}
+
+		while ( b->buf_len + pkt->pkt_caplen > buf_sz ) {
+			uint8_t *new;
+			buf_sz = (buf_sz) ? buf_sz << 1 : (1 << 20);
+			new = realloc(b->buf, buf_sz);
+			if ( NULL == new )
+				return 0;
+			b->buf = new;
+		}
+
+		memcpy(b->buf + b->buf_len, pkt->pkt_base, pkt->pkt_caplen);
+		b->pkts[b->num_pkts].ofs = b->buf_len;
+		b->pkts[b->num_pkts].caplen = pkt->pkt_caplen;
+		b->pkts[b->num_pkts].len = pkt->pkt_len;
+		b->buf_len += pkt->pkt_caplen;
+		b->num_pkts++;
+	}
+
+	return 1;
+}
+
+static struct bench_path *path_get(struct bench *b, const char *label)
+{
+	struct bench_path *new;
+	unsigned int i;
+
+	for(i = 0; i < b->num_paths; i++)
+		if ( !strcmp(b->paths[i].label, label) )
+			return &b->paths[i];
+
+	new = realloc(b->paths, (b->num_paths + 1) * sizeof(*new));
+	if ( NULL == new )
+		return NULL;
+
+	b->paths = new;
+	new = &b->paths[b->num_paths++];
+	memset(new, 0, sizeof(*new));
+	snprintf(new->label, sizeof(new->label), "%s", label);
+	return new;
+}
+
+/* Decode everything once, bucketing packets by the layers they produce */
+static int bench_classify(struct bench *b, struct _pkt *pkt)
+{
+	char label[PATH_MAX_LABEL];
+	struct bench_path *path;
+	struct _dcb *cur;
+	unsigned int i;
+	size_t len;
+
+	for(i = 0; i < b->num_pkts; i++) {
+		pkt_setup(b, pkt, i);
+		decode(pkt, b->decoder);
+
+		len = snprintf(label, sizeof(label), "%s",
+				decoder_label(b->decoder));
+		for(cur = pkt->pkt_dcb; cur < pkt->pkt_dcb_top;
+				cur = cur->dcb_next) {
+			if ( len >= sizeof(label) )
+				break;
+			len += snprintf(label + len, sizeof(label) - len,
+					"/%s", cur->dcb_proto->p_label);
+		}
+
+		path = path_get(b, label);
+		if ( NULL == path )
+			return 0;
+
+		/* worst case, every packet on the same path */
+		if ( NULL == path->pkts ) {
+			path->pkts = malloc(b->num_pkts * sizeof(*path->pkts));
+			if ( NULL == path->pkts )
+				return 0;
+		}
+		path->pkts[path->num_pkts++] = i;
+	}
+
+	return 1;
+}
+
+static uint64_t bench_run(struct bench *b, struct _pkt *pkt,
+				const unsigned int *idx, unsigned int num,
+				unsigned int iter)
+{
+	uint64_t start;
+	unsigned int i, j;
+
+	start = now_ns();
+	for(j = 0; j < iter; j++) {
+		for(i = 0; i < num; i++) {
+			pkt_setup(b, pkt, (idx) ? idx[i] : i);
+			decode(pkt, b->decoder);
+		}
+	}
+
+	return now_ns() - start;
+}
+
+static void bench_free(struct bench *b)
+{
+	unsigned int i;
+
+	for(i = 0; i < b->num_paths; i++)
+		free(b->paths[i].pkts);
+	free(b->paths);
+	free(b->pkts);
+	free(b->buf);
+	if ( b->src )
+		source_free(b->src);
+}
+
+static int bench_file(const char *fn, unsigned int iter)
+{
+	struct bench b;
+	struct _pkt pkt;
+	uint64_t ns;
+	unsigned int i;
+	int ret = 0;
+
+	memset(&b, 0, sizeof(b));
+	memset(&pkt, 0, sizeof(pkt));
+	b.fn = fn;
+
+	if ( !decode_pkt_realloc(&pkt, DECODE_DEFAULT_MIN_LAYERS) )
+		goto out;
+	if ( !bench_load(&b) )
+		goto out;
+	if ( !b.num_pkts ) {
+		mesg(M_ERR, "decode_bench: %s: no packets", fn);
+		goto out;
+	}
+	pkt.pkt_source = b.src;
+	if ( !bench_classify(&b, &pkt) )
+		goto out;
+
+	ns = bench_run(&b, &pkt, NULL, b.num_pkts, iter);
+	printf("%s: %s: %u packets, %u paths, %.1f ns/packet\n",
+		fn, decoder_label(b.decoder), b.num_pkts, b.num_paths,
+		(double)ns / ((uint64_t)b.num_pkts * iter));
+
+	for(i = 0; i < b.num_paths; i++) {
+		struct bench_path *p = &b.paths[i];
+
+		ns = bench_run(&b, &pkt, p->pkts, p->num_pkts, iter);
+		printf("  %8.1f ns/packet %8u packets  %s\n",
+			(double)ns / ((uint64_t)p->num_pkts * iter),
+			p->num_pkts, p->label);
+	}
+
+	ret = 1;
+out:
+	bench_free(&b);
+	decode_pkt_realloc(&pkt, 0);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iter = DEFAULT_ITER;
+	int i, ret = EXIT_SUCCESS;
+
+	while( (i = getopt(argc, argv, "n:")) != -1 ) {
+		switch(i) {
+		case 'n':
+			iter = strtoul(optarg, NULL, 0);
+			if ( iter )
+				break;
+			/* fall through */
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] "
+				"file.cap [file.cap ...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( optind >= argc ) {
+		fprintf(stderr, "%s: no captures specified\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	decode_init();
+
+	for(i = optind; i < argc; i++)
+		if ( !bench_file(argv[i], iter) )
+			ret = EXIT_FAILURE;
+
+	return ret;
+}
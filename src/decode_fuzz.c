@@ -0,0 +1,202 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Decoder fuzz harness. Each input is decoded as a frame of every link
+ * type registered in the DLT namespace, then the resulting layer stack is
+ * sanity checked.
+ *
+ * With libFuzzer:
+ *   make decode_fuzz CC=clang CPPFLAGS=-DHAVE_LIBFUZZER \
+ *	CFLAGS="-g -fsanitize=fuzzer-no-link,address" \
+ *	LDFLAGS=-fsanitize=fuzzer
+ *
+ * Otherwise a standalone main() replays the files given on the command
+ * line, or with no arguments throws pseudo-random frames at the decoders:
+ *   decode_fuzz [-n iterations] [-s seed] [file ...]
+*/
+
+#include <firestorm.h>
+#include <f_capture.h>
+#include <f_packet.h>
+#include <f_decode.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define FUZZ_MAX_DLT	32
+
+static decoder_t dlt[FUZZ_MAX_DLT];
+static unsigned int num_dlt;
+static struct _source src;
+static struct _pkt pkt;
+
+/* Decoders are noisy about bad input, which is all we feed them */
+void _mesg(mesg_code_t code, const char *str, size_t len);
+void _mesg(mesg_code_t code, const char *str, size_t len)
+{
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void fuzz_init(void)
+{
+	unsigned int id, i;
+	decoder_t d;
+
+	decode_init();
+
+	/* There's no way to enumerate a namespace so just probe the lot */
+	for(id = 0; id <= 0xffff && num_dlt < FUZZ_MAX_DLT; id++) {
+		d = decoder_get(NS_DLT, id);
+		if ( NULL == d )
+			continue;
+		for(i = 0; i < num_dlt; i++)
+			if ( dlt[i] == d )
+				break;
+		if ( i == num_dlt )
+			dlt[num_dlt++] = d;
+	}
+
+	pkt.pkt_source = &src;
+	if ( !decode_pkt_realloc(&pkt, DECODE_DEFAULT_MIN_LAYERS) )
+		abort();
+}
+
+static void check_layers(const struct _pkt *p)
+{
+	const struct _dcb *cur;
+
+	assert(p->pkt_dcb_top <= p->pkt_dcb_end);
+	for(cur = p->pkt_dcb; cur < p->pkt_dcb_top; cur = cur->dcb_next) {
+		assert(cur->dcb_proto != NULL);
+		assert(cur->dcb_next > cur);
+		assert(cur->dcb_next <= p->pkt_dcb_top);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	uint8_t *buf;
+	unsigned int i;
+
+	if ( !num_dlt )
+		fuzz_init();
+
+	/* Exact sized copy so that ASAN catches any over-read */
+	buf = malloc(size ? size : 1);
+	if ( NULL == buf )
+		return 0;
+	memcpy(buf, data, size);
+
+	for(i = 0; i < num_dlt; i++) {
+		/* exercise both byte orders where decoders care */
+		src.s_swab = size & 1;
+		pkt.pkt_base = buf;
+		pkt.pkt_end = buf + size;
+		pkt.pkt_caplen = pkt.pkt_len = size;
+		decode(&pkt, dlt[i]);
+		check_layers(&pkt);
+	}
+
+	free(buf);
+	return 0;
+}
+
+#ifndef HAVE_LIBFUZZER
+static int fuzz_file(const char *fn)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0, sz = 0;
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: %s\n", fn, os_err());
+		return 0;
+	}
+
+	for(;;) {
+		if ( len == sz ) {
+			uint8_t *new;
+			sz = (sz) ? sz << 1 : 4096;
+			new = realloc(buf, sz);
+			if ( NULL == new )
+				break;
+			buf = new;
+		}
+		if ( 0 == (sz - len) )
+			break;
+		len += fread(buf + len, 1, sz - len, f);
+		if ( feof(f) || ferror(f) )
+			break;
+	}
+
+	fclose(f);
+	LLVMFuzzerTestOneInput(buf, len);
+	free(buf);
+	return 1;
+}
+
+/* Random frames, mostly built from plausible header bytes so that we
+ * get past the first couple of layers at least some of the time.
+ */
+static size_t fuzz_random(uint8_t *buf, size_t max)
+{
+	static const uint8_t magic[] = {
+		0x08, 0x00, 0x86, 0xdd, 0x81, 0x00, 0x88, 0xa8,
+		0x88, 0x47, 0x45, 0x60, 0x06, 0x11, 0x2f, 0x04,
+		0x29, 0x2c, 0x00, 0xff, 0x12, 0xb5, 0x65, 0x58,
+	};
+	size_t len, i;
+
+	len = rand() % max;
+	for(i = 0; i < len; i++) {
+		if ( rand() & 1 )
+			buf[i] = magic[rand() % sizeof(magic)];
+		else
+			buf[i] = rand();
+	}
+
+	return len;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iter = 1000000, n;
+	unsigned int seed = 1;
+	uint8_t buf[256];
+	int i;
+
+	while( (i = getopt(argc, argv, "n:s:")) != -1 ) {
+		switch(i) {
+		case 'n':
+			iter = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-s seed] "
+				"[file ...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( optind < argc ) {
+		for(i = optind; i < argc; i++)
+			if ( !fuzz_file(argv[i]) )
+				return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	srand(seed);
+	for(n = 0; n < iter; n++)
+		LLVMFuzzerTestOneInput(buf, fuzz_random(buf, sizeof(buf)));
+
+	printf("decode_fuzz: %lu frames through %u link types, seed %u\n",
+		iter, num_dlt, seed);
+	return EXIT_SUCCESS;
+}
+#endif
@@ -9,6 +9,10 @@
  * it should be relatively straight forward to understand. It's
  * pretty well tested.
  *
+ * IPv4 and IPv6 fragments share the same queues, overlap handling,
+ * memory limits and timeouts. Queues are keyed on a family-tagged
+ * address pair and a 32bit identification.
+ *
  * Should CORRECTLY cope with:
  *  Overlapping fragments
  *  Oversized fragments
@@ -26,7 +30,9 @@
 #include <f_packet.h>
 #include <f_decode.h>
 #include <pkt/ip.h>
+#include <pkt/ipv6.h>
 #include <p_ipv4.h>
+#include <p_ipv6.h>
 #include <p_tcp.h> /* gah */
 
 #include "tcpip.h"
@@ -50,6 +56,41 @@ struct ipfrag {
 	unsigned int		flen;
 };
 
+#define IPQ_INET	4
+#define IPQ_INET6	6
+
+union ipq_addr {
+	uint32_t v4;
+	struct ip6_addr v6;
+};
+
+/* Identifies a datagram, zero padded so it can be compared bytewise */
+struct ipq_key {
+	union ipq_addr saddr;
+	union ipq_addr daddr;
+	uint32_t id;
+	uint32_t tunnel;
+	uint32_t vlan;
+	uint8_t family;
+	uint8_t protocol;
+	uint16_t _pad0;
+};
+
+/* A fragment as seen by the address family independent code */
+struct fraginfo {
+	/* unfragmentable part: ip header (+ ipv6 extension headers) */
+	const uint8_t *hdr;
+	/* fragment payload */
+	const uint8_t *data;
+	unsigned int hlen;
+	int offset;
+	int len;
+	int more;
+	/* ipv6: next-header field to fix up and its new value */
+	unsigned int nhoff;
+	uint8_t nxt;
+};
+
 /* This is an IP session structure */
 struct ipq {
 	struct ipq *next;
@@ -62,6 +103,7 @@ struct ipq {
 
 	/* Stuff we need for reassembly */
 	timestamp_t	time;
+	uint32_t	usec;
 
 	/* Total size of all the fragments we have */
 	int meat;
@@ -70,10 +112,12 @@ struct ipq {
 	int len;
 
 	/* Identify the packet */
-	uint32_t saddr;
-	uint32_t daddr;
-	uint16_t id;
-	uint8_t protocol;
+	struct ipq_key key;
+
+	/* Unfragmentable part, taken from the first fragment */
+	unsigned int hlen;
+	unsigned int nhoff;
+	uint8_t nxt;
 
 #define FIRST_IN 0x2
 #define LAST_IN 0x1
@@ -81,12 +125,22 @@ struct ipq {
 };
 
 #define IPHASH 127 /* Mersenne prime */
-static struct ipq *ipq_latest;
-static struct ipq *ipq_oldest;
-static struct ipq *frag_hash[IPHASH]; /* IP fragment hash table */
-static mempool_t ipf_pool;
-static objcache_t ipq_cache;
-static objcache_t frag_cache;
+
+/* One per pipeline, IPv6 fragments go through the IPv4 decoder's */
+struct ipdefrag {
+	struct ipq *ipq_latest;
+	struct ipq *ipq_oldest;
+	struct ipq *frag_hash[IPHASH]; /* IP fragment hash table */
+	mempool_t ipf_pool;
+	objcache_t ipq_cache;
+	objcache_t frag_cache;
+
+	/* Statistics */
+	unsigned int err_reasm;
+	unsigned int err_mem;
+	unsigned int err_timeout;
+	unsigned int reassembled;
+};
 
 /* config: Timeout (in seconds) */
 static const timestamp_t timeout = 60 * TIMESTAMP_HZ;
@@ -94,18 +148,19 @@ static const timestamp_t timeout = 60 * TIMESTAMP_HZ;
 /* config: Don't decode fragments with too low ttl */
 static const uint8_t minttl = 1;
 
-/* Statistics */
-static unsigned int err_reasm;
-static unsigned int err_mem;
-static unsigned int err_timeout;
-static unsigned int reassembled;
+static void fragstruct_free(struct ipdefrag *fd, struct ipfrag *x)
+{
+	objcache_free2(fd->frag_cache, x);
+}
 
-static void fragstruct_free(struct ipfrag *x)
+static void frag_free(struct ipdefrag *fd, struct ipfrag *x)
 {
-	objcache_free2(frag_cache, x);
+	if ( x->free )
+		free(x->fdata);
+	fragstruct_free(fd, x);
 }
 
-static void ipq_kill(struct ipq *qp)
+static void ipq_kill(struct ipdefrag *fd, struct ipq *qp)
 {
 	struct ipfrag *foo, *bar;
 
@@ -118,10 +173,7 @@ static void ipq_kill(struct ipq *qp)
 	for(foo = qp->fragments; foo;) {
 		bar = foo;
 		foo = foo->next;
-		if ( bar->free ) {
-			free(bar->fdata);
-		}
-		fragstruct_free(bar);
+		frag_free(fd, bar);
 	}
 
 	/* Remove from LRU queue */
@@ -129,45 +181,45 @@ static void ipq_kill(struct ipq *qp)
 		qp->next_time->prev_time = qp->prev_time;
 	if ( qp->prev_time)
 		qp->prev_time->next_time = qp->next_time;
-	if ( qp == ipq_oldest )
-		ipq_oldest = qp->prev_time;
-	if ( qp == ipq_latest )
-		ipq_latest = qp->next_time;
+	if ( qp == fd->ipq_oldest )
+		fd->ipq_oldest = qp->prev_time;
+	if ( qp == fd->ipq_latest )
+		fd->ipq_latest = qp->next_time;
 
 	/* Free the ipq itself */
-	objcache_free2(ipq_cache, qp);
+	objcache_free2(fd->ipq_cache, qp);
 }
 
 /* Trim down to low memory watermark */
-static int ip_evictor(struct ipq *cq)
+static int ip_evictor(struct ipdefrag *fd, struct ipq *cq)
 {
 	struct ipq *kill;
 
-	err_mem++;
+	fd->err_mem++;
 
-	if ( !ipq_oldest )
+	if ( !fd->ipq_oldest )
 		return 0;
-	if ( ipq_oldest == cq )
-		kill = ipq_oldest->next;
+	if ( fd->ipq_oldest == cq )
+		kill = fd->ipq_oldest->next;
 	else
-		kill = ipq_oldest;
+		kill = fd->ipq_oldest;
 
 	if ( kill ) {
-		ipq_kill(kill);
+		ipq_kill(fd, kill);
 		return 1;
 	}
 
 	return 0;
 }
 
-static struct ipfrag *fragstruct_alloc(struct ipq *qp)
+static struct ipfrag *fragstruct_alloc(struct ipdefrag *fd, struct ipq *qp)
 {
 	struct ipfrag *ret;
 
 again:
-	ret = objcache_alloc(frag_cache);
+	ret = objcache_alloc(fd->frag_cache);
 	if ( NULL == ret ) {
-		if ( ip_evictor(qp) )
+		if ( ip_evictor(fd, qp) )
 			goto again;
 	}
 
@@ -175,17 +227,25 @@ again:
 }
 
 /* Hash function for hash lookup */
-static unsigned int ipq_hashfn(uint16_t id,
-				uint32_t saddr,
-				uint32_t daddr,
-				uint8_t proto)
+static unsigned int ipq_hashfn(const struct ipq_key *k)
 {
-	unsigned int h = saddr ^ daddr;
-	h ^= (h >> 16) ^ id;
-	h ^= (h >> 8) ^ proto;
+	uint32_t a[8];
+	unsigned int h;
+
+	memcpy(a, &k->saddr, 16);
+	memcpy(a + 4, &k->daddr, 16);
+	h = a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5] ^ a[6] ^ a[7];
+	h ^= k->tunnel ^ k->vlan;
+	h ^= (h >> 16) ^ k->id ^ (k->id >> 16);
+	h ^= (h >> 8) ^ k->protocol ^ k->family;
 	return h % IPHASH;
 }
 
+static int ipq_key_cmp(const struct ipq_key *a, const struct ipq_key *b)
+{
+	return memcmp(a, b, sizeof(*a));
+}
+
 /*
  * Report ip fragmentation violations.
  */
@@ -211,59 +271,77 @@ static void alert_timedout(struct _pkt *p)
 }
 
 /* Reassemble a complete set of fragments */
-static void reassemble(struct ipq *qp,
+static void reassemble(struct ipdefrag *fd, struct ipq *qp,
 				struct _pkt *pkt)
 {
 	struct ipfrag *f;
-	struct pkt_iphdr *iph;
-	int len = 0;
+	struct _decoder *d;
+	unsigned int len, tot;
 	uint8_t *buf, *ptr;
 	struct _pkt new;
 
-	assert(qp->len <= 0xffff);
-
 	if ( !qp->fragments )
 		goto err;
 
-	iph = qp->fragments->fdata;
-	qp->len += iph->ihl << 2;
+	tot = qp->hlen + qp->len;
+	if ( (qp->key.family == IPQ_INET && tot > 0xffff) ||
+		(qp->key.family == IPQ_INET6 &&
+			tot - sizeof(struct pkt_ip6hdr) > 0xffff) ) {
+		alert_oversize(pkt);
+		goto err;
+	}
 
 	/* Allocate the frankenpacket buffer */
-	ptr = buf = malloc(qp->len);
+	ptr = buf = malloc(tot);
 	if ( buf == NULL )
 		goto err;
 
 	/* Copy all the fragments in to the new buffer */
-	dmesg(M_DEBUG, "Reassemble: %u bytes", qp->len);
+	dmesg(M_DEBUG, "Reassemble: %u bytes", tot);
 
 	/* Do the header */
-	dmesg(M_DEBUG, " * %u byte header", iph->ihl << 2);
-	memcpy(ptr, qp->fragments->fdata, iph->ihl << 2);
-	ptr += iph->ihl << 2;
-	len += iph->ihl << 2;
-
-	for(f = qp->fragments; f; f = f->next) {
-		dmesg(M_DEBUG, " * %u bytes @ %u", f->len, f->offset);
-		memcpy(ptr, f->data, f->len);
-		ptr += f->len;
-		len += f->len;
-		if ( len >= qp->len )
-			break;
+	dmesg(M_DEBUG, " * %u byte header", qp->hlen);
+	memcpy(ptr, qp->fragments->fdata, qp->hlen);
+	ptr += qp->hlen;
+	len = qp->hlen;
+
+	for(f = qp->fragments; f && len < tot; f = f->next) {
+		unsigned int flen = f->len;
+
+		if ( len + flen > tot )
+			flen = tot - len;
+
+		dmesg(M_DEBUG, " * %u bytes @ %u", flen, f->offset);
+		memcpy(ptr, f->data, flen);
+		ptr += flen;
+		len += flen;
 	}
 
 	/* Fixup the IP header */
-	iph = (void *)buf;
-	iph->frag_off = 0;
-	iph->tot_len = be16toh(len);
-	iph->csum = 0;
-	iph->csum = _ip_csum(iph);
+	if ( qp->key.family == IPQ_INET ) {
+		struct pkt_iphdr *iph = (struct pkt_iphdr *)buf;
+
+		iph->frag_off = 0;
+		iph->tot_len = htobe16(len);
+		iph->csum = 0;
+		iph->csum = _ip_csum(iph);
+		d = &_ipv4_decoder;
+	}else{
+		struct pkt_ip6hdr *iph = (struct pkt_ip6hdr *)buf;
+
+		iph->ip6_plen = htobe16(len - sizeof(*iph));
+		buf[qp->nhoff] = qp->nxt;
+		d = &_ipv6_decoder;
+	}
 
-	dhex_dump(buf, qp->len, 16);
+	dhex_dump(buf, len, 16);
 
+	memset(&new, 0, sizeof(new));
 	new.pkt_source = pkt->pkt_source;
 	new.pkt_ts = qp->time;
+	new.pkt_usec = qp->usec;
 	new.pkt_base = buf;
-	new.pkt_len = new.pkt_caplen = qp->len;
+	new.pkt_len = new.pkt_caplen = len;
 	new.pkt_end = new.pkt_base + new.pkt_len;
 
 	new.pkt_dcb = NULL;
@@ -271,9 +349,14 @@ static void reassemble(struct ipq *qp,
 	if ( !decode_pkt_realloc(&new, DECODE_DEFAULT_MIN_LAYERS) )
 		goto err_free;
 
-	reassembled++;
+	fd->reassembled++;
 
-	decode(&new, &_ipv4_decoder);
+	decode(&new, d);
+	/* a datagram reassembled inside a tunnel/VLAN stays there */
+	if ( !new.pkt_tunnel )
+		new.pkt_tunnel = qp->key.tunnel;
+	if ( !new.pkt_vlan )
+		new.pkt_vlan = qp->key.vlan;
 	pkt_inject(&new);
 
 	decode_pkt_realloc(&new, 0);
@@ -283,81 +366,76 @@ static void reassemble(struct ipq *qp,
 err_free:
 	free(buf);
 err:
-	err_reasm++;
+	fd->err_reasm++;
 }
 
-static struct ipq *ip_frag_create(unsigned int hash,
-					const struct pkt_iphdr *iph)
+static struct ipq *ip_frag_create(struct ipdefrag *fd, unsigned int hash,
+					const struct ipq_key *k)
 {
 	struct ipq *q;
 
 again:
-	q = objcache_alloc0(ipq_cache);
+	q = objcache_alloc0(fd->ipq_cache);
 	if ( q == NULL ) {
-		if ( ip_evictor(NULL) )
+		if ( ip_evictor(fd, NULL) )
 			goto again;
 		return NULL;
 	}
 
-	q->id = iph->id;
-	q->saddr = iph->saddr;
-	q->daddr = iph->daddr;
-	q->protocol = iph->protocol;
-	q->next = frag_hash[hash];
+	q->key = *k;
+	q->next = fd->frag_hash[hash];
 	if ( q->next )
 		q->next->pprev = &q->next;
-	frag_hash[hash] = q;
-	q->pprev = &frag_hash[hash];
+	fd->frag_hash[hash] = q;
+	q->pprev = &fd->frag_hash[hash];
 
 	return q;
 }
 
 /* Find (or create) the ipq for this IP fragment */
-static struct ipq *ip_find(const struct pkt_iphdr *iph,
+static struct ipq *ip_find(struct ipdefrag *fd, const struct ipq_key *k,
 				unsigned int *hash,
 				struct _pkt *pkt)
 {
 	struct ipq *qp;
 
-	*hash = ipq_hashfn(iph->id, iph->saddr,
-				iph->daddr, iph->protocol);
+	*hash = ipq_hashfn(k);
 
-	for(qp = frag_hash[*hash]; qp; qp = qp->next) {
-		if ( (qp->id == iph->id) &&
-			(qp->saddr == iph->saddr) &&
-			(qp->daddr == iph->daddr) &&
-			(qp->protocol == iph->protocol) ) {
+	for(qp = fd->frag_hash[*hash]; qp; qp = qp->next) {
+		if ( !ipq_key_cmp(&qp->key, k) )
 			return qp;
-		}
 	}
 
-	qp = ip_frag_create(*hash, iph);
-	if ( qp )
+	qp = ip_frag_create(fd, *hash, k);
+	if ( qp ) {
 		qp->time = pkt->pkt_ts;
+		qp->usec = pkt->pkt_usec;
+	}
 	return qp;
 }
 
 /* If a fragment is too old then zap it */
-static int expired(struct _pkt *pkt, struct ipq *qp)
+static int expired(struct ipdefrag *fd, struct _pkt *pkt, struct ipq *qp)
 {
 	if ( time_after(pkt->pkt_ts, qp->time + timeout) ) {
-		err_timeout++;
+		fd->err_timeout++;
 		return 0;
 	}
 
 	return 1;
 }
 
-static int check_timeouts(struct _pkt *pkt, struct ipq *qp)
+static int check_timeouts(struct ipdefrag *fd, struct _pkt *pkt,
+				struct ipq *qp)
 {
 	/* Check our timeout */
-	if ( !expired(pkt, qp) ) {
+	if ( !expired(fd, pkt, qp) ) {
 		/* We alert if we actually see a fragment
 		 * arrive after the timeout because that
 		 * is suspicious (read: evasive)
 		*/
 		alert_timedout(pkt);
-		ipq_kill(qp);
+		ipq_kill(fd, qp);
 		return 0;
 	}
 
@@ -366,26 +444,26 @@ static int check_timeouts(struct _pkt *pkt, struct ipq *qp)
 		qp->next_time->prev_time = qp->prev_time;
 	if ( qp->prev_time)
 		qp->prev_time->next_time = qp->next_time;
-	if ( qp == ipq_oldest )
-		ipq_oldest = qp->prev_time;
-	if ( qp == ipq_latest )
-		ipq_latest = qp->next_time;
-	qp->next_time = ipq_latest;
+	if ( qp == fd->ipq_oldest )
+		fd->ipq_oldest = qp->prev_time;
+	if ( qp == fd->ipq_latest )
+		fd->ipq_latest = qp->next_time;
+	qp->next_time = fd->ipq_latest;
 	qp->prev_time = NULL;
-	if ( !ipq_oldest )
-		ipq_oldest = qp;
-	if ( ipq_latest )
-		ipq_latest->prev_time = qp;
-	ipq_latest = qp;
+	if ( !fd->ipq_oldest )
+		fd->ipq_oldest = qp;
+	if ( fd->ipq_latest )
+		fd->ipq_latest->prev_time = qp;
+	fd->ipq_latest = qp;
 
 	/* Check timeouts on other fragment queues */
-	while ( ipq_oldest ){
-		if ( expired(pkt, ipq_oldest) )
+	while ( fd->ipq_oldest ){
+		if ( expired(fd, pkt, fd->ipq_oldest) )
 			break;
 
 		/* this can't kill qp from under us because
 		 * we already know we haven't timed out */
-		ipq_kill(ipq_oldest);
+		ipq_kill(fd, fd->ipq_oldest);
 		return 0;
 	}
 
@@ -395,49 +473,43 @@ static int check_timeouts(struct _pkt *pkt, struct ipq *qp)
 	 * be seen to be going backwards by the higher layers!
 	 */
 	qp->time = pkt->pkt_ts;
+	qp->usec = pkt->pkt_usec;
 
 	return 1;
 }
 
-static void hash_mtf(unsigned int hash, struct ipq *qp)
+static void hash_mtf(struct ipdefrag *fd, unsigned int hash, struct ipq *qp)
 {
 	/* Move to front heuristic */
 	if ( qp->next )
 		qp->next->pprev = qp->pprev;
 	*qp->pprev = qp->next;
-	if ( (qp->next = frag_hash[hash]) )
+	if ( (qp->next = fd->frag_hash[hash]) )
 		qp->next->pprev = &qp->next;
-	frag_hash[hash] = qp;
-	qp->pprev = &frag_hash[hash];
+	fd->frag_hash[hash] = qp;
+	qp->pprev = &fd->frag_hash[hash];
 }
 
-static int queue_fragment(unsigned int hash,
+static int queue_fragment(struct ipdefrag *fd, unsigned int hash,
 				struct ipq *qp,
 				struct _pkt *pkt,
-				const struct pkt_iphdr *iph)
+				const struct fraginfo *fi)
 {
 	struct ipfrag *prev, *next, *me;
-	int flags, offset;
-	int ihl, end, len;
-	int chop = 0;
+	const uint8_t *data;
+	int offset, end;
 
-	if ( !check_timeouts(pkt, qp) )
+	if ( !check_timeouts(fd, pkt, qp) )
 		return 0;
 
-	hash_mtf(hash, qp);
+	hash_mtf(fd, hash, qp);
 
 	/* Now we can get on with queueing the packet.. */
-	ihl = iph->ihl << 2;
-	len = be16toh(iph->tot_len);
-
-	offset = be16toh(iph->frag_off);
-	flags = offset & ~IP_OFFMASK;
-	offset &= IP_OFFMASK;
-	offset <<= 3; /* 8 byte granularity */
-
-	end = offset + len - ihl;
+	data = fi->data;
+	offset = fi->offset;
+	end = offset + fi->len;
 
-	if ( (flags & IP_MF) == 0 ) {
+	if ( !fi->more ) {
 		if ( (end < qp->len) ||
 			((qp->last_in & LAST_IN) && (end != qp->len))) {
 			alert_teardrop(pkt);
@@ -466,7 +538,7 @@ static int queue_fragment(unsigned int hash,
 		}
 	}
 
-	if ( end == offset ) {
+	if ( end <= offset ) {
 		alert_attack(pkt);
 		return 0;
 	}
@@ -478,11 +550,6 @@ static int queue_fragment(unsigned int hash,
 		return 0;
 	}
 
-	/* Insert data into fragment chain */
-	me = fragstruct_alloc(qp);
-	if ( me == NULL )
-		return 0;
-
 	/* Find out where to insert this fragment in the list */
 	for(prev = NULL, next = qp->fragments; next; next = next->next) {
 		if ( next->offset >= offset )
@@ -496,8 +563,7 @@ static int queue_fragment(unsigned int hash,
 
 		if ( i > 0 ) {
 			offset += i;
-			chop = i;
-			len -= i;
+			data += i;
 
 			if ( end <= offset ) {
 				alert_attack(pkt);
@@ -506,6 +572,11 @@ static int queue_fragment(unsigned int hash,
 		}
 	}
 
+	/* Insert data into fragment chain */
+	me = fragstruct_alloc(fd, qp);
+	if ( me == NULL )
+		return 0;
+
 	/* Make sure we don't overlap next packets */
 	while( next && (next->offset < end) ) {
 		int i = end - next->offset;
@@ -517,6 +588,7 @@ static int queue_fragment(unsigned int hash,
 			next->offset += i;
 			next->len -= i;
 			next->data += i;
+			qp->meat -= i;
 			break;
 		}else{
 			struct ipfrag *free_it = next;
@@ -531,50 +603,39 @@ static int queue_fragment(unsigned int hash,
 			}
 
 			qp->meat -= free_it->len;
-			fragstruct_free(free_it);
+			frag_free(fd, free_it);
 		}
 	}
 
-	/* Make the fragment */
-	me->len = len - chop;
-	me->offset = offset;
-	me->len -= ihl;
-	if ( offset ) {
-		chop = ihl;
-	} else {
-		chop = 0;
-	}
-
-#if 1
-	do {
-		unsigned int alen = me->len;
-
-		if ( !offset )
-			alen += ihl;
-
-		me->fdata = malloc(alen);
-		if ( me->fdata == NULL ) {
-			fragstruct_free(me);
-			return 0;
-		}
-
-		memcpy(me->fdata, ((char *)iph) + chop, alen);
-		me->free = 1;
-		me->flen = alen;
-	}while(0);
-#else
-	/* FIXME: IP defragmentation could be zerocopy for
+	/* Make the fragment, the first one also carries the
+	 * unfragmentable part which we need at reassemble time.
+	 *
+	 * FIXME: IP defragmentation could be zerocopy for
 	 * mmapped tcpdump files, but then the ip header
 	 * can't be fixed up at reassemble time...
-	*/
-	me->fdata = ((void *)iph) + chop;
-	me->free = 0;
-#endif
+	 */
+	me->len = end - offset;
+	me->offset = offset;
+	me->flen = me->len;
+	if ( !offset )
+		me->flen += fi->hlen;
 
+	me->fdata = malloc(me->flen);
+	if ( me->fdata == NULL ) {
+		fragstruct_free(fd, me);
+		return 0;
+	}
+	me->free = 1;
 	me->data = me->fdata;
 
-	if ( !offset )
-		me->data += ihl;
+	if ( !offset ) {
+		memcpy(me->fdata, fi->hdr, fi->hlen);
+		me->data += fi->hlen;
+		qp->hlen = fi->hlen;
+		qp->nhoff = fi->nhoff;
+		qp->nxt = fi->nxt;
+	}
+	memcpy(me->data, data, me->len);
 
 	/* Insert the fragment */
 	me->next = next;
@@ -589,9 +650,8 @@ static int queue_fragment(unsigned int hash,
 	if ( !offset )
 		qp->last_in |= FIRST_IN;
 
-	dmesg(M_DEBUG, "0x%x: got a fragment (%u/%u)",
-		(unsigned int)qp,
-		qp->meat, qp->len);
+	dmesg(M_DEBUG, "%p: got a fragment (%u/%u)",
+		qp, qp->meat, qp->len);
 
 	if ( qp->last_in == (FIRST_IN|LAST_IN) && qp->meat == qp->len )
 		return 1;
@@ -599,13 +659,31 @@ static int queue_fragment(unsigned int hash,
 	return 0;
 }
 
-void _ipdefrag_track(pkt_t pkt, dcb_t dcb_ptr)
+static void do_defrag(struct ipdefrag *fd, struct _pkt *pkt,
+			const struct ipq_key *k, const struct fraginfo *fi)
 {
-	const struct pkt_iphdr *iph;
-	struct ipfrag_dcb *dcb;
 	unsigned int hash;
 	struct ipq *q;
 
+	q = ip_find(fd, k, &hash, pkt);
+	if ( q == NULL )
+		return;
+
+	if ( queue_fragment(fd, hash, q, pkt, fi) ) {
+		reassemble(fd, q, pkt);
+		ipq_kill(fd, q);
+	}
+}
+
+void _ipdefrag_track(struct ipdefrag *fd, pkt_t pkt, dcb_t dcb_ptr)
+{
+	const struct pkt_iphdr *iph;
+	struct ipfrag_dcb *dcb;
+	struct fraginfo fi;
+	struct ipq_key k;
+	unsigned int ihl;
+	uint16_t off;
+
 	dcb = (struct ipfrag_dcb *)dcb_ptr;
 	iph = dcb->ip_iph;
 
@@ -613,30 +691,95 @@ void _ipdefrag_track(pkt_t pkt, dcb_t dcb_ptr)
 	if ( iph->ttl < minttl )
 		return;
 
-	q = ip_find(iph, &hash, pkt);
-	if ( q == NULL )
-		return;
+	memset(&k, 0, sizeof(k));
+	k.family = IPQ_INET;
+	k.saddr.v4 = iph->saddr;
+	k.daddr.v4 = iph->daddr;
+	k.id = iph->id;
+	k.tunnel = pkt->pkt_tunnel;
+	k.vlan = pkt->pkt_vlan;
+	k.protocol = iph->protocol;
 
-	if ( queue_fragment(hash, q, pkt, iph) ) {
-		reassemble(q, pkt);
-		ipq_kill(q);
+	ihl = iph->ihl << 2;
+	off = be16toh(iph->frag_off);
+
+	fi.hdr = (const uint8_t *)iph;
+	fi.hlen = ihl;
+	fi.data = fi.hdr + ihl;
+	fi.len = be16toh(iph->tot_len) - ihl;
+	fi.offset = (off & IP_OFFMASK) << 3; /* 8 byte granularity */
+	fi.more = !!(off & IP_MF);
+	fi.nhoff = 0;
+	fi.nxt = 0;
+
+	/* Can't reassemble from truncated captures */
+	if ( fi.len < 0 || fi.data + fi.len > pkt->pkt_end ) {
+		fd->err_reasm++;
+		return;
 	}
+
+	do_defrag(fd, pkt, &k, &fi);
+}
+
+void _ip6defrag_track(struct ipdefrag *fd, pkt_t pkt, dcb_t dcb_ptr)
+{
+	const struct pkt_ip6hdr *iph;
+	const struct pkt_ip6frag *fh;
+	struct ip6frag_dcb *dcb;
+	struct fraginfo fi;
+	struct ipq_key k;
+	uint16_t off;
+
+	dcb = (struct ip6frag_dcb *)dcb_ptr;
+	iph = dcb->ip6_iph;
+	fh = dcb->ip6_frag;
+
+	if ( iph->ip6_ttl < minttl )
+		return;
+
+	memset(&k, 0, sizeof(k));
+	k.family = IPQ_INET6;
+	k.saddr.v6 = iph->ip6_src;
+	k.daddr.v6 = iph->ip6_dst;
+	k.id = fh->ip6f_ident;
+	k.tunnel = pkt->pkt_tunnel;
+	k.vlan = pkt->pkt_vlan;
+
+	off = be16toh(fh->ip6f_offlg);
+
+	fi.hdr = (const uint8_t *)iph;
+	fi.hlen = (const uint8_t *)fh - fi.hdr;
+	fi.data = (const uint8_t *)(fh + 1);
+	fi.len = (sizeof(*iph) + be16toh(iph->ip6_plen)) -
+			(fi.hlen + sizeof(*fh));
+	fi.offset = off & IP6_OFFMASK;
+	fi.more = !!(off & IP6_MF);
+	fi.nhoff = dcb->ip6_nhoff;
+	fi.nxt = fh->ip6f_nxt;
+
+	do_defrag(fd, pkt, &k, &fi);
 }
 
-void _ipdefrag_dtor(void)
+void _ipdefrag_dtor(struct ipdefrag *fd)
 {
+	while ( fd->ipq_oldest )
+		ipq_kill(fd, fd->ipq_oldest);
+
 	mesg(M_INFO, "ipdefrag: %u reassembled packets, "
 		"%u reasm errors, %u timeouts, %u oom",
-		reassembled, err_reasm, err_timeout, err_mem);
+		fd->reassembled, fd->err_reasm, fd->err_timeout, fd->err_mem);
 
-	mempool_free(ipf_pool);
+	mempool_free(fd->ipf_pool);
+	free(fd);
 }
 
-int _ipdefrag_ctor(void)
+struct ipdefrag *_ipdefrag_ctor(void)
 {
+	struct ipdefrag *fd;
+
 	if ( minttl > 255 ) {
 		mesg(M_ERR, "ipdefrag: minttl must be < 256");
-		return 0;
+		return NULL;
 	}
 
 	mesg(M_INFO, "ipdefrag: minttl=%u timeout=%us",
@@ -648,11 +791,25 @@ int _ipdefrag_ctor(void)
 			"you will be vulnerable to evasion!");
 	}
 
-	ipf_pool = mempool_new("ipdefrag", 2);
-	ipq_cache = objcache_init(ipf_pool, "ipq", sizeof(struct ipq));
-	frag_cache = objcache_init(ipf_pool, "ipfrag", sizeof(struct ipfrag));
-	if ( ipq_cache == NULL || frag_cache == NULL )
-		return 0;
+	fd = calloc(1, sizeof(*fd));
+	if ( NULL == fd )
+		return NULL;
 
-	return 1;
+	fd->ipf_pool = mempool_new_private("ipdefrag", FLOW_DEFRAG_CHUNKS);
+	if ( NULL == fd->ipf_pool )
+		goto err;
+
+	fd->ipq_cache = objcache_init(fd->ipf_pool, "ipq",
+					sizeof(struct ipq));
+	fd->frag_cache = objcache_init(fd->ipf_pool, "ipfrag",
+					sizeof(struct ipfrag));
+	if ( fd->ipq_cache == NULL || fd->frag_cache == NULL )
+		goto err_pool;
+
+	return fd;
+err_pool:
+	mempool_free(fd->ipf_pool);
+err:
+	free(fd);
+	return NULL;
 }
@@ -0,0 +1,249 @@
+/*
+ * This file is part of Firestorm NIDS
+ * Copyright (c) Gianni Tedesco 2010
+ * This program is released under the terms of the GNU GPL version 3
+ *
+ * Flow accounting for ICMP, which has no stateful tracker of its own.
+ * There's no protocol state here at all, just the key, counters and an
+ * idle timeout, so that it shows up in flow exports alongside TCP and UDP.
+ * ICMP is keyed NetFlow style with type/code in the destination port.
+*/
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <f_flow.h>
+#include <pkt/ip.h>
+#include <pkt/icmp.h>
+#include <p_ipv4.h>
+
+#include "tcpip.h"
+
+/* configuration options */
+static const timestamp_t flow_tmo = 60 * TIMESTAMP_HZ;
+/* see ft_tcpflow.c */
+static const uint8_t tunnel_key = 1;
+static const uint8_t vlan_key = 1;
+
+struct ipflow {
+	struct ipflow **hash_pprev, *hash_next;
+	struct list_head lru;
+	struct flow_acct acct;
+	uint32_t saddr, daddr;
+	uint16_t sport, dport;
+	uint32_t tunnel, vlan;
+	uint8_t proto;
+};
+
+#define IPFLOW_HASH 1021 /* prime */
+
+/* One per pipeline, like the TCP tracker */
+struct ipflow_table {
+	struct ipflow *hash[IPFLOW_HASH];
+	struct list_head lru;
+
+	mempool_t pool;
+	objcache_t flow_cache;
+	flow_exporter_t exporter;
+
+	/* stats */
+	unsigned int num_active;
+	unsigned int max_active;
+	unsigned int num_timeouts;
+	unsigned int num_oom;
+};
+
+_constfn static uint16_t ipflow_hashfn(uint32_t saddr, uint32_t daddr,
+					uint16_t sport, uint16_t dport,
+					uint8_t proto,
+					uint32_t tunnel, uint32_t vlan)
+{
+	uint32_t h;
+	h = ((saddr ^ sport) ^ (daddr ^ dport)) ^ proto ^ tunnel ^ vlan;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return h % IPFLOW_HASH;
+}
+
+static void ipflow_hash_unlink(struct ipflow *f)
+{
+	if (f->hash_next)
+		f->hash_next->hash_pprev = f->hash_pprev;
+	*f->hash_pprev = f->hash_next;
+}
+
+static void ipflow_hash_link(struct ipflow_table *ft, struct ipflow *f,
+				uint16_t bucket)
+{
+	if ((f->hash_next = ft->hash[bucket]))
+		f->hash_next->hash_pprev = &f->hash_next;
+	ft->hash[bucket] = f;
+	f->hash_pprev = &ft->hash[bucket];
+}
+
+static void ipflow_free(struct ipflow_table *ft, struct ipflow *f,
+			uint8_t why)
+{
+	struct flow_rec fr;
+
+	fr.fr_acct = &f->acct;
+	fr.fr_saddr = f->saddr;
+	fr.fr_daddr = f->daddr;
+	fr.fr_sport = f->sport;
+	fr.fr_dport = f->dport;
+	fr.fr_vlan = f->vlan;
+	fr.fr_proto = f->proto;
+	fr.fr_end = why;
+	flow_export(ft->exporter, &fr);
+
+	ipflow_hash_unlink(f);
+	list_del(&f->lru);
+	objcache_free2(ft->flow_cache, f);
+	ft->num_active--;
+}
+
+/* LRU order is expiry order since there's only the one timeout */
+static void ipflow_tmo_check(struct ipflow_table *ft, timestamp_t now)
+{
+	struct ipflow *f;
+
+	while ( !list_empty(&ft->lru) ) {
+		f = list_entry(ft->lru.next, struct ipflow, lru);
+		if ( !time_after(now, f->acct.fa_last + flow_tmo) )
+			return;
+		ipflow_free(ft, f, FLOW_END_IDLE);
+		ft->num_timeouts++;
+	}
+}
+
+static struct ipflow *ipflow_alloc(struct ipflow_table *ft)
+{
+	struct ipflow *f;
+
+	f = objcache_alloc(ft->flow_cache);
+	if ( f )
+		return f;
+
+	if ( list_empty(&ft->lru) )
+		return NULL;
+
+	ipflow_free(ft, list_entry(ft->lru.next, struct ipflow, lru),
+			FLOW_END_OOM);
+	ft->num_oom++;
+	return objcache_alloc(ft->flow_cache);
+}
+
+static void ipflow_track(struct ipflow_table *ft, pkt_t pkt,
+				const struct pkt_iphdr *iph,
+				uint16_t sport, uint16_t dport)
+{
+	uint32_t tunnel, vlan;
+	struct ipflow *f;
+	unsigned int dir;
+	uint16_t bucket;
+
+	ipflow_tmo_check(ft, pkt->pkt_ts);
+	flow_export_tick(ft->exporter, pkt->pkt_ts);
+
+	tunnel = (tunnel_key) ? pkt->pkt_tunnel : 0;
+	vlan = (vlan_key) ? pkt->pkt_vlan : 0;
+	bucket = ipflow_hashfn(iph->saddr, iph->daddr, sport, dport,
+				iph->protocol, tunnel, vlan);
+
+	for(f = ft->hash[bucket]; f; f = f->hash_next) {
+		if ( f->proto != iph->protocol ||
+				f->tunnel != tunnel || f->vlan != vlan )
+			continue;
+		if (	f->saddr == iph->saddr &&
+			f->daddr == iph->daddr &&
+			f->sport == sport &&
+			f->dport == dport ) {
+			dir = FLOW_DIR_FWD;
+			break;
+		}
+		if (	f->saddr == iph->daddr &&
+			f->daddr == iph->saddr &&
+			f->sport == dport &&
+			f->dport == sport ) {
+			dir = FLOW_DIR_REV;
+			break;
+		}
+	}
+
+	if ( NULL == f ) {
+		f = ipflow_alloc(ft);
+		if ( NULL == f )
+			return;
+
+		f->saddr = iph->saddr;
+		f->daddr = iph->daddr;
+		f->sport = sport;
+		f->dport = dport;
+		f->tunnel = tunnel;
+		f->vlan = vlan;
+		f->proto = iph->protocol;
+		flow_acct_init(&f->acct, pkt->pkt_ts);
+		ipflow_hash_link(ft, f, bucket);
+		INIT_LIST_HEAD(&f->lru);
+		dir = FLOW_DIR_FWD;
+
+		if ( ++ft->num_active > ft->max_active )
+			ft->max_active = ft->num_active;
+	}
+
+	flow_acct_update(&f->acct, dir, be16toh(iph->tot_len), pkt->pkt_ts);
+	list_move_tail(&f->lru, &ft->lru);
+}
+
+void _ipflow_icmp_track(struct ipflow_table *ft, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct icmp_dcb *dcb = (struct icmp_dcb *)dcb_ptr;
+	const struct pkt_icmphdr *icmph = dcb->icmp_hdr;
+
+	ipflow_track(ft, pkt, dcb->icmp_iph, 0,
+			htobe16((icmph->type << 8) | icmph->code));
+}
+
+struct ipflow_table *_ipflow_ctor(void)
+{
+	struct ipflow_table *ft;
+
+	ft = calloc(1, sizeof(*ft));
+	if ( NULL == ft )
+		return NULL;
+
+	INIT_LIST_HEAD(&ft->lru);
+
+	ft->pool = mempool_new_private("ipflow", FLOW_IP_CHUNKS);
+	if ( NULL == ft->pool )
+		goto err;
+
+	ft->flow_cache = objcache_init(ft->pool, "ipflow",
+					sizeof(struct ipflow));
+	if ( NULL == ft->flow_cache )
+		goto err_pool;
+
+	ft->exporter = flow_exporter_new();
+	if ( NULL == ft->exporter )
+		goto err_pool;
+
+	return ft;
+err_pool:
+	mempool_free(ft->pool);
+err:
+	free(ft);
+	return NULL;
+}
+
+void _ipflow_dtor(struct ipflow_table *ft)
+{
+	struct ipflow *f, *tmp;
+
+	list_for_each_entry_safe(f, tmp, &ft->lru, lru)
+		ipflow_free(ft, f, FLOW_END_FORCED);
+
+	mesg(M_INFO, "ipflow: max_active=%u, %u timeouts, %u oom",
+		ft->max_active, ft->num_timeouts, ft->num_oom);
+	flow_exporter_free(ft->exporter);
+	mempool_free(ft->pool);
+	free(ft);
+}
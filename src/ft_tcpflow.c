@@ -5,82 +5,76 @@
  *
  * TODO:
  *  o Put state data in to DCB
- *  o Handle ICMP errors
  *  o check for broadcasts if possible
 */
 #include <firestorm.h>
 #include <f_packet.h>
+#include <f_capture.h>
 #include <f_decode.h>
 #include <pkt/ip.h>
 #include <pkt/tcp.h>
 #include <pkt/icmp.h>
 #include <p_ipv4.h>
+#include <p_tcp.h>
 #include <csum.h>
+#include <f_flow.h>
 
-#include "tcpip.h"
-
-#define STATE_DEBUG 1
-#define SEGMENT_DEBUG 1
-#define STREAM_DEBUG 1
+#include <f_trace.h>
 
-#if STATE_DEBUG
-#define dmesg mesg
-#define dhex_dump hex_dump
-#else
-#define dmesg(x...) do{}while(0)
-#define dhex_dump(x...) do{}while(0)
-#endif
+#include "tcpip.h"
 
-#if SEGMENT_DEBUG
+#if ENABLE_TRACE
 #include <stdio.h>
-#include <stdarg.h>
 #endif
 
 /* configuration options */
 static const uint8_t minttl = 1;
 static const uint8_t reassemble = 1;
+/* subject to the per-source policy, see source_csum_policy() */
 static const uint8_t do_tcp_csum = 1;
-
-/* flow hash */
-#define TCPHASH 509 /* prime */
-static struct tcp_session *hash[TCPHASH];
-
-/* memory caches */
-static mempool_t tcp_pool;
-static objcache_t session_cache;
-static objcache_t sstate_cache;
-
-/* timeout lists */
-static LIST_HEAD(lru);
-static LIST_HEAD(tmo_msl);
-
-/* stats */
-static unsigned int num_active;
-static unsigned int max_active;
-static unsigned int num_segments;
-static unsigned int state_errs;
-
-static unsigned int num_csum_errs;
-static unsigned int num_ttl_errs;
-static unsigned int num_timeouts;
-static unsigned int num_oom;
+/* keep flows in different tunnels (GRE key, VXLAN VNI) apart */
+static const uint8_t tunnel_key = 1;
+/* ditto for VLAN's, disable if routing between VLAN's on a span port */
+static const uint8_t vlan_key = 1;
+/* pick up sessions already established when we started, or whose
+ * handshake we missed, from the first plain ACK segment we see */
+static const uint8_t midstream = 1;
+/* flow memory budget, above the high watermark we evict sessions until
+ * we're back down to the low one */
+#define TCP_MEM_BUDGET (4U << 20)
+static const size_t mem_budget = TCP_MEM_BUDGET;
+static const size_t mem_high = TCP_MEM_BUDGET - TCP_MEM_BUDGET / 8;
+static const size_t mem_low = TCP_MEM_BUDGET - TCP_MEM_BUDGET / 4;
+/* how many sessions from the cold end of each list are considered */
+static const unsigned int evict_scan = 8;
+/* sessions listed in reports of who holds the most reassembly memory,
+ * which are made at shutdown and on going over the high watermark, but
+ * not more often than every mem_report_interval seconds */
+#define TCP_MEM_TOP 8
+static const uint32_t mem_report_interval = 60;
 
 struct tcpseg {
+	struct tcpflow *tf;
 	timestamp_t ts;
 	const struct pkt_iphdr *iph;
 	const struct pkt_tcphdr *tcph;
 	uint32_t ack, seq, win, seq_end;
 	uint16_t hash, len;
-	uint32_t tsval;
+	uint32_t tunnel, vlan;
+	uint32_t tsval, tsecr;
 	unsigned int saw_tstamp;
 	uint8_t *payload;
+	/* payload stays put for as long as the session might need it */
+	unsigned int stable;
 	struct tcp_state *snd, *rcv;
 	unsigned int to_server;
 };
 
+static void s1_processing(struct tcpseg *cur, struct tcp_session *s);
+
 static void dbg_segment(struct tcpseg *cur)
 {
-#if SEGMENT_DEBUG
+#if ENABLE_TRACE
 	static const char tcpflags[] = "FSRPAUEC";
 	uint8_t x, i;
 	char ackbuf[16];
@@ -110,13 +104,13 @@ static void dbg_segment(struct tcpseg *cur)
 
 static void dbg_stream(const char *label, struct tcp_state *s)
 {
-#if STREAM_DEBUG
+#if ENABLE_TRACE
 	if ( NULL == s )
 		return;
 	mesg(M_DEBUG, "\033[34m%s: una=%.8x nxt=%.8x "
-			"wl1=%.8x wl2=%.8x wnd=%u\033[0m",
+			"wl1=%.8x wl2=%.8x wnd=%u srtt=%uus\033[0m",
 			label, s->snd_una, s->snd_nxt,
-			s->snd_wl1, s->snd_wl2, s->snd_wnd);
+			s->snd_wl1, s->snd_wl2, s->snd_wnd, s->srtt_us);
 #endif
 }
 
@@ -143,17 +137,24 @@ static int tcp_sequence(struct tcp_state *s, uint32_t seq, uint32_t end_seq)
 /* Hash function.
  * Hashes to the same value even when source and destinations are inverted.
  */
-_constfn static uint16_t tcp_hashfn(uint32_t saddr, uint32_t daddr,
-					uint16_t sport, uint16_t dport)
+_constfn static uint32_t flow_mix(uint32_t saddr, uint32_t daddr,
+					uint16_t sport, uint16_t dport,
+					uint32_t tunnel, uint32_t vlan)
 {
 	uint32_t h;
-	h = ((saddr ^ sport) ^ (daddr ^ dport));
+	h = ((saddr ^ sport) ^ (daddr ^ dport)) ^ tunnel ^ vlan;
 	h ^= h >> 16;
 	h ^= h >> 8;
-	h %= TCPHASH;
 	return h;
 }
 
+_constfn static uint16_t tcp_hashfn(uint32_t saddr, uint32_t daddr,
+					uint16_t sport, uint16_t dport,
+					uint32_t tunnel, uint32_t vlan)
+{
+	return flow_mix(saddr, daddr, sport, dport, tunnel, vlan) % TCPHASH;
+}
+
 /* HASH: Unlink a session from the session hash */
 static void tcp_hash_unlink(struct tcp_session *s)
 {
@@ -165,10 +166,12 @@ static void tcp_hash_unlink(struct tcp_session *s)
 /* HASH: Link a session in to the TCP session hash */
 static void tcp_hash_link(struct tcp_session *s, uint16_t bucket)
 {
-	if ((s->hash_next = hash[bucket]))
+	struct tcpflow *tf = s->tf;
+
+	if ((s->hash_next = tf->hash[bucket]))
 		s->hash_next->hash_pprev = &s->hash_next;
-	hash[bucket] = s;
-	s->hash_pprev = &hash[bucket];
+	tf->hash[bucket] = s;
+	s->hash_pprev = &tf->hash[bucket];
 }
 
 /* HASH: Move to front of hash collision chain */
@@ -182,9 +185,12 @@ static void tcp_hash_mtf(struct tcp_session *s, uint16_t bucket)
 static struct tcp_session *tcp_collide(struct tcp_session *s,
 					const struct pkt_iphdr *iph,
 					const struct pkt_tcphdr *tcph,
+					uint32_t tunnel, uint32_t vlan,
 					unsigned int *to_server)
 {
 	for (; s; s = s->hash_next) {
+		if ( s->tunnel != tunnel || s->vlan != vlan )
+			continue;
 		if (	s->s_addr == iph->saddr &&
 			s->c_addr == iph->daddr &&
 			s->s_port == tcph->sport &&
@@ -204,56 +210,76 @@ static struct tcp_session *tcp_collide(struct tcp_session *s,
 	return NULL;
 }
 
-/* Parse TCP options just for timestamps */
-#if 0
-static int tcp_fast_options(struct tcpseg *cur)
+static void tcp_ts_get(struct tcpseg *cur, const uint8_t *opt)
 {
-	const struct pkt_tcphdr *t = cur->tcph;
-	char *tmp, *end;
-	size_t ofs = t->doff << 2;
+	uint32_t tmp[2];
+
+	memcpy(tmp, opt + 2, sizeof(tmp));
+	cur->tsval = be32toh(tmp[0]);
+	cur->tsecr = be32toh(tmp[1]);
+	cur->saw_tstamp = 1;
+}
+
+/* Parse TCP options just for timestamps. Nearly every stack puts them
+ * first, padded to NOP, NOP, TIMESTAMP, so try that before scanning.
+ */
+static void tcp_fast_options(struct tcpseg *cur)
+{
+	static const uint32_t aligned = const_be32((TCPOPT_NOP << 24) |
+						(TCPOPT_NOP << 16) |
+						(TCPOPT_TIMESTAMP << 8) |
+						TCPOLEN_TIMESTAMP);
+	const uint8_t *tmp, *end;
+	size_t ofs = cur->tcph->doff << 2;
+	uint32_t w;
 
 	/* Return if we don't have any */
-	if ( ofs <= sizeof(struct pkt_tcphdr))
-		return 0;
+	if ( ofs <= sizeof(struct pkt_tcphdr) )
+		return;
 
 	/* Work out where they begin and end */
-	tmp = end = (char *)t;
+	tmp = end = (const uint8_t *)cur->tcph;
 	tmp += sizeof(struct pkt_tcphdr);
 	end += ofs;
 
+	if ( tmp + 2 + TCPOLEN_TIMESTAMP <= end ) {
+		memcpy(&w, tmp, sizeof(w));
+		if ( w == aligned ) {
+			tcp_ts_get(cur, tmp + 2);
+			return;
+		}
+	}
+
 	while ( tmp < end ) {
 		size_t step;
 
-		/* XXX: We continue past an EOL. Is that right? */
 		switch ( *tmp ) {
 		case TCPOPT_EOL:
+			return;
 		case TCPOPT_NOP:
 			tmp++;
 			continue;
 		}
 
-		if ( tmp+1 >= end )
+		if ( tmp + 1 >= end )
 			break;
 
-		switch ( *tmp ) {
-		case TCPOPT_TIMESTAMP:
-			if ( tmp + 10 >= end )
-				break;
-			cur->tsval = be32toh(*((uint32_t *)(tmp + 2)));
-			return 1;
-		}
-
 		step = *(tmp + 1);
 		if ( step < 2 ) {
-			mesg(M_DEBUG, "Malformed tcp options");
-			step = 2;
+			tmesg(TRACE_TCP_STATE, "Malformed tcp options");
+			return;
 		}
+
+		if ( *tmp == TCPOPT_TIMESTAMP ) {
+			if ( step == TCPOLEN_TIMESTAMP &&
+					tmp + TCPOLEN_TIMESTAMP <= end )
+				tcp_ts_get(cur, tmp);
+			return;
+		}
+
 		tmp += step;
 	}
-
-	return 0;
 }
-#endif
 
 /* This will parse TCP options for SYN packets */
 static void tcp_syn_options(struct tcp_state *s,
@@ -325,8 +351,26 @@ static void tcp_syn_options(struct tcp_state *s,
 	}
 }
 
-static void tcp_free(struct tcp_session *s, int rst)
+static void tcp_export(struct tcp_session *s, uint8_t why)
 {
+	struct flow_rec fr;
+
+	fr.fr_acct = &s->acct;
+	fr.fr_saddr = s->c_addr;
+	fr.fr_daddr = s->s_addr;
+	fr.fr_sport = s->c_port;
+	fr.fr_dport = s->s_port;
+	fr.fr_vlan = s->vlan;
+	fr.fr_proto = IP_PROTO_TCP;
+	fr.fr_end = why;
+	flow_export(s->tf->exporter, &fr);
+}
+
+static void tcp_free(struct tcp_session *s, int rst, uint8_t why)
+{
+	struct tcpflow *tf = s->tf;
+
+	tcp_export(s, why);
 	_tcp_reasm_abort(s, rst);
 
 	tcp_hash_unlink(s);
@@ -334,14 +378,15 @@ static void tcp_free(struct tcp_session *s, int rst)
 	list_del(&s->lru);
 
 	if ( s->s_wnd )
-		objcache_free2(sstate_cache, s->s_wnd);
+		_tcp_release(tf, tf->sstate_cache, s->s_wnd);
 
-	objcache_free2(session_cache, s);
-	num_active--;
+	_tcp_release(tf, tf->session_cache, s);
+	tf->num_active--;
 }
 
 /* TMO: Check timeouts */
-static void tcp_tmo_check(struct list_head *list, timestamp_t now)
+static void tcp_tmo_check(struct tcpflow *tf, struct list_head *list,
+				timestamp_t now)
 {
 	struct tcp_session *s;
 
@@ -351,8 +396,8 @@ static void tcp_tmo_check(struct list_head *list, timestamp_t now)
 		if ( !tcp_after(now / TIMESTAMP_HZ, s->expire) )
 			return;
 
-		tcp_free(s, 0);
-		num_timeouts++;
+		tcp_free(s, 0, FLOW_END_IDLE);
+		tf->num_timeouts++;
 	}
 }
 
@@ -367,12 +412,13 @@ static void set_expire(struct list_head *list,
 
 static void timer_msl(struct tcpseg *cur, struct tcp_session *s)
 {
-	set_expire(&tmo_msl, s, cur->ts + TCP_TMO_MSL);
+	set_expire(&cur->tf->tmo_msl, s, cur->ts + TCP_TMO_MSL);
 }
 
 static void set_lru(struct tcpseg *cur, struct tcp_session *s)
 {
-	list_move_tail(&s->lru, &lru);
+	s->last_seen = cur->ts / TIMESTAMP_HZ;
+	list_move_tail(&s->lru, &cur->tf->lru);
 }
 
 static void init_wnd(struct tcpseg *cur, struct tcp_state *s)
@@ -386,115 +432,551 @@ static void init_wnd(struct tcpseg *cur, struct tcp_state *s)
 	tcp_syn_options(s, cur->tcph, cur->ts / TIMESTAMP_HZ);
 }
 
-void *_tcp_alloc(struct tcp_session *s, objcache_t o, int reasm)
+/* Eviction cost: higher scores make better victims. Sessions gain a point
+ * for every second they sit idle and every kilobyte they hold in
+ * reassembly buffers, so the longer they sit and the more they hold the
+ * more likely they are to go. Half-open sessions are the cheapest of all
+ * to lose, and they're what a SYN flood is made of, so they get a head
+ * start. So do mid-stream pickups that have only been seen from one side,
+ * which is all a flood of spoofed ACKs makes.
+ */
+static unsigned int evict_cost(struct tcp_session *s)
 {
-	struct tcp_session *ss, *tmp;
-	void *ret;
+	unsigned int cost;
 
-again:
-	ret = objcache_alloc(o);
-	if ( ret )
-		return ret;
+	cost = s->tf->tcp_now - s->last_seen;
+	cost += _tcp_reasm_buffer_size(s) >> 10;
 
-#if 0
-	/* Free stuff we're not reassembling for first */
-	list_for_each_entry_safe(ss, tmp, &lru, lru) {
-		if ( s == ss )
+	switch(s->state) {
+	case TCP_SESSION_S1:
+	case TCP_SESSION_S2:
+	case TCP_SESSION_S3:
+		cost += 60;
+		break;
+	case TCP_SESSION_E:
+		if ( s->midstream && s->mid_seen != 3 )
+			cost += 60;
+		break;
+	default:
+		/* closing down */
+		cost += 30;
+		break;
+	}
+
+	return cost;
+}
+
+/* Pick a victim from the oldest few sessions on the LRU and the oldest few
+ * half-open sessions waiting to time out. Never picks the session in hand.
+ */
+static struct tcp_session *evict_pick(struct tcpflow *tf,
+					struct tcp_session *skip)
+{
+	struct tcp_session *ss, *best = NULL;
+	unsigned int cost, best_cost = 0, n;
+
+	n = 0;
+	list_for_each_entry(ss, &tf->lru, lru) {
+		if ( n++ >= evict_scan )
+			break;
+		if ( ss == skip )
 			continue;
-		if ( reasm && _tcp_reasm_buffer_size(ss) )
+		cost = evict_cost(ss);
+		if ( NULL == best || cost > best_cost ) {
+			best = ss;
+			best_cost = cost;
+		}
+	}
+
+	n = 0;
+	list_for_each_entry(ss, &tf->tmo_msl, tmo) {
+		if ( n++ >= evict_scan )
+			break;
+		if ( ss == skip )
 			continue;
-		tcp_free(ss, 0);
-		num_oom++;
-		goto again;
+		cost = evict_cost(ss);
+		if ( NULL == best || cost > best_cost ) {
+			best = ss;
+			best_cost = cost;
+		}
 	}
-#endif
 
-	list_for_each_entry_safe(ss, tmp, &lru, lru) {
-		if ( s == ss )
+	return best;
+}
+
+static int evict_one(struct tcpflow *tf, struct tcp_session *skip)
+{
+	struct tcp_session *ss;
+	size_t before;
+
+	ss = evict_pick(tf, skip);
+	if ( NULL == ss )
+		return 0;
+
+	tmesg(TRACE_TCP_STATE, "evicting session in state %u, cost %u",
+		ss->state, evict_cost(ss));
+
+	before = tf->flow_mem;
+	tcp_free(ss, 0, FLOW_END_OOM);
+	tf->num_evict++;
+	tf->evict_bytes += before - tf->flow_mem;
+	return 1;
+}
+
+/* List the sessions holding the most in reassembly buffers, heaviest
+ * first. Everything is charged to the streams as it's allocated so this
+ * is just a walk of the LRU.
+ */
+static void mem_report(struct tcpflow *tf, const char *why)
+{
+	struct tcp_session *top[TCP_MEM_TOP], *s;
+	size_t sz[TCP_MEM_TOP], cur, c_mem, s_mem;
+	unsigned int n, i, c_objs, s_objs;
+	ipstr_t cip, sip;
+
+	n = 0;
+	list_for_each_entry(s, &tf->lru, lru) {
+		cur = _tcp_reasm_buffer_size(s);
+		if ( 0 == cur )
+			continue;
+		if ( n == TCP_MEM_TOP && cur <= sz[n - 1] )
 			continue;
-		tcp_free(ss, 0);
-		num_oom++;
-		goto again;
+		if ( n < TCP_MEM_TOP )
+			n++;
+		for(i = n - 1; i && sz[i - 1] < cur; i--) {
+			top[i] = top[i - 1];
+			sz[i] = sz[i - 1];
+		}
+		top[i] = s;
+		sz[i] = cur;
 	}
 
-	return NULL;
+	if ( 0 == n )
+		return;
+
+	mesg(M_INFO, "tcpstream: %s: %zuK flow memory, heaviest sessions:",
+		why, tf->flow_mem >> 10);
+	for(i = 0; i < n; i++) {
+		s = top[i];
+		c_mem = _tcp_reasm_stream_size(s, 1, &c_objs);
+		s_mem = _tcp_reasm_stream_size(s, 0, &s_objs);
+		iptostr(cip, s->c_addr);
+		iptostr(sip, s->s_addr);
+		mesg(M_INFO, "tcpstream:  %s:%u > %s:%u: %zu bytes in %u "
+			"objects to server, %zu bytes in %u to client",
+			cip, be16toh(s->c_port), sip, be16toh(s->s_port),
+			c_mem, c_objs, s_mem, s_objs);
+	}
 }
 
-static struct tcp_session *new_session(struct tcpseg *cur)
+/* Called before each segment is looked up, so nothing is in hand */
+static void evict_to_watermark(struct tcpflow *tf)
 {
-	struct tcp_session *s;
+	while ( tf->flow_mem > mem_low )
+		if ( !evict_one(tf, NULL) )
+			break;
+}
 
-	/* Track syn packets only for now. This could be re-jiggled for
-	 * flow accounting:
-	 *  - move this check after allocation
-	 *  - for stray packets: don't transition + keep server/client zeroed
-	 */
-	if ( (cur->tcph->flags & (TCP_SYN|TCP_ACK|TCP_FIN|TCP_RST))
-			!= TCP_SYN ) {
-		dmesg(M_DEBUG, "not a valid syn packet");
-		return NULL;
+void *_tcp_alloc(struct tcpflow *tf, struct tcp_session *s, objcache_t o)
+{
+	void *ret;
+
+	/* Pool exhausted before the budget was, evict anyway */
+	while ( NULL == (ret = objcache_alloc(o)) ) {
+		if ( !evict_one(tf, s) )
+			return NULL;
+		tf->num_oom++;
 	}
 
-	s = _tcp_alloc(NULL, session_cache, 0);
+	tf->flow_mem += objcache_size(o);
+	if ( tf->flow_mem > tf->max_flow_mem )
+		tf->max_flow_mem = tf->flow_mem;
+	return ret;
+}
+
+void _tcp_release(struct tcpflow *tf, objcache_t o, void *obj)
+{
+	objcache_free2(o, obj);
+	tf->flow_mem -= objcache_size(o);
+}
+
+/* For things too big or too variable for an objcache, like the chunk
+ * rings, charged to the budget all the same so eviction can see them.
+ */
+void *_tcp_alloc_array(struct tcpflow *tf, struct tcp_session *s,
+			size_t nmemb, size_t size)
+{
+	void *ret;
+
+	while ( NULL == (ret = calloc(nmemb, size)) ) {
+		if ( !evict_one(tf, s) )
+			return NULL;
+		tf->num_oom++;
+	}
+
+	tf->flow_mem += nmemb * size;
+	if ( tf->flow_mem > tf->max_flow_mem )
+		tf->max_flow_mem = tf->flow_mem;
+	return ret;
+}
+
+void _tcp_release_array(struct tcpflow *tf, void *ptr,
+			size_t nmemb, size_t size)
+{
+	free(ptr);
+	tf->flow_mem -= nmemb * size;
+}
+
+/* Allocate and link a session, to_server says whether the segment in
+ * hand was sent by the client.
+ */
+static struct tcp_session *session_alloc(struct tcpseg *cur,
+					unsigned int to_server)
+{
+	struct tcpflow *tf = cur->tf;
+	struct tcp_session *s;
+
+	s = _tcp_alloc(tf, NULL, tf->session_cache);
 	if ( s == NULL ) {
 		mesg(M_CRIT, "tcp OOM");
 		return NULL;
 	}
 
+	s->tf = tf;
 	INIT_LIST_HEAD(&s->tmo);
 	INIT_LIST_HEAD(&s->lru);
 
-	dmesg(M_DEBUG, "#1 - syn: half-state allocated");
+	if ( to_server ) {
+		s->c_addr = cur->iph->saddr;
+		s->s_addr = cur->iph->daddr;
+		s->c_port = cur->tcph->sport;
+		s->s_port = cur->tcph->dport;
+	}else{
+		s->c_addr = cur->iph->daddr;
+		s->s_addr = cur->iph->saddr;
+		s->c_port = cur->tcph->dport;
+		s->s_port = cur->tcph->sport;
+	}
+	s->tunnel = cur->tunnel;
+	s->vlan = cur->vlan;
+	s->midstream = 0;
+	s->mid_seen = 0;
+	s->pmtu = 0;
+	s->app = NULL;
+	s->app_priv = NULL;
+	flow_acct_init(&s->acct, cur->ts);
+
+	memset(&s->c_wnd, 0, sizeof(s->c_wnd));
+	s->s_wnd = NULL;
+
+	/* stats */
+	tf->num_active++;
+	if ( tf->num_active > tf->max_active )
+		tf->max_active = tf->num_active;
+
+	/* link it all up */
+	tcp_hash_link(s, cur->hash);
+	set_lru(cur, s);
+
+	return s;
+}
+
+/* SYN: Find the half-open entry for a segment in either direction */
+static struct tcp_syn *syn_find(struct tcpseg *cur, struct tcp_syn *set)
+{
+	const struct pkt_iphdr *iph = cur->iph;
+	const struct pkt_tcphdr *tcph = cur->tcph;
+	struct tcp_syn *syn;
+	unsigned int i;
+
+	for(i = 0; i < SYN_WAYS; i++) {
+		syn = &set[i];
+		if ( !syn->inuse )
+			continue;
+		if ( syn->tunnel != cur->tunnel || syn->vlan != cur->vlan )
+			continue;
+		if (	syn->c_addr == iph->saddr &&
+			syn->s_addr == iph->daddr &&
+			syn->c_port == tcph->sport &&
+			syn->s_port == tcph->dport )
+			return syn;
+		if (	syn->s_addr == iph->saddr &&
+			syn->c_addr == iph->daddr &&
+			syn->s_port == tcph->sport &&
+			syn->c_port == tcph->dport )
+			return syn;
+	}
+
+	return NULL;
+}
+
+static struct tcp_syn *syn_set(struct tcpseg *cur)
+{
+	uint32_t h;
+	h = flow_mix(cur->iph->saddr, cur->iph->daddr,
+			cur->tcph->sport, cur->tcph->dport,
+			cur->tunnel, cur->vlan);
+	return cur->tf->syn_tab[h % SYNHASH];
+}
+
+static int syn_expired(struct tcp_syn *syn, timestamp_t now)
+{
+	return tcp_after(now / TIMESTAMP_HZ,
+			syn->stamp + TCP_TMO_MSL / TIMESTAMP_HZ);
+}
+
+/* SYN: Record a connection attempt. Retransmits update the entry in place,
+ * otherwise take a free or expired way, or failing that the oldest one.
+ */
+static void syn_insert(struct tcpseg *cur)
+{
+	struct tcpflow *tf = cur->tf;
+	struct tcp_syn *set, *syn;
+	struct tcp_state tmp;
+	unsigned int i;
+
+	set = syn_set(cur);
+	syn = syn_find(cur, set);
+	if ( NULL == syn ) {
+		for(i = 0; i < SYN_WAYS; i++) {
+			if ( !set[i].inuse || syn_expired(&set[i], cur->ts) ) {
+				syn = &set[i];
+				break;
+			}
+			if ( NULL == syn || tcp_before(set[i].stamp, syn->stamp) )
+				syn = &set[i];
+		}
+		if ( syn->inuse && !syn_expired(syn, cur->ts) )
+			tf->num_syn_overwritten++;
+		tf->num_syn++;
+		tmesg(TRACE_TCP_STATE, "#1 - syn: half-open entry");
+	}else{
+		tmesg(TRACE_TCP_STATE, "syn resend?");
+	}
+
+	memset(&tmp, 0, sizeof(tmp));
+	tcp_syn_options(&tmp, cur->tcph, cur->ts / TIMESTAMP_HZ);
+
+	syn->c_addr = cur->iph->saddr;
+	syn->s_addr = cur->iph->daddr;
+	syn->c_port = cur->tcph->sport;
+	syn->s_port = cur->tcph->dport;
+	syn->tunnel = cur->tunnel;
+	syn->vlan = cur->vlan;
+	syn->isn = cur->seq;
+	syn->ts_recent = tmp.ts_recent;
+	syn->stamp = cur->ts / TIMESTAMP_HZ;
+	syn->win = cur->win;
+	syn->len = be16toh(cur->iph->tot_len);
+	syn->flags = tmp.flags;
+	syn->scale = tmp.scale;
+	syn->inuse = 1;
+}
+
+/* SYN: A SYN+ACK arrived, promote the half-open entry to a full session
+ * and process the SYN+ACK against it.
+ */
+static struct tcp_session *syn_promote(struct tcpseg *cur)
+{
+	struct tcpflow *tf = cur->tf;
+	struct tcp_session *s;
+	struct tcp_syn *syn;
 
-	s->c_addr = cur->iph->saddr;
-	s->s_addr = cur->iph->daddr;
-	s->c_port = cur->tcph->sport;
-	s->s_port = cur->tcph->dport;
+	syn = syn_find(cur, syn_set(cur));
+	if ( NULL == syn || syn->c_addr != cur->iph->daddr ||
+			syn_expired(syn, cur->ts) ) {
+		tmesg(TRACE_TCP_STATE, "syn+ack without syn");
+		return NULL;
+	}
+
+	/* Authenticate before allocating anything */
+	if ( cur->ack != syn->isn + 1 ) {
+		tmesg(TRACE_TCP_STATE, "bad ack on syn+ack");
+		tf->state_errs++;
+		return NULL;
+	}
+
+	s = session_alloc(cur, 0);
+	if ( s == NULL )
+		return NULL;
 
 	s->state = TCP_SESSION_S1;
 
-	/* stats */
-	num_active++;
-	if ( num_active > max_active )
-		max_active = num_active;
+	memset(&s->c_wnd, 0, sizeof(s->c_wnd));
+	s->c_wnd.snd_una = syn->isn;
+	s->c_wnd.snd_nxt = syn->isn + 1;
+	s->c_wnd.snd_wnd = syn->win;
+	s->c_wnd.snd_wl1 = syn->isn;
+	s->c_wnd.ts_recent = syn->ts_recent;
+	s->c_wnd.ts_recent_stamp = syn->stamp;
+	s->c_wnd.flags = syn->flags;
+	s->c_wnd.scale = syn->scale;
+
+	/* account for the SYN */
+	flow_acct_init(&s->acct, syn->stamp * TIMESTAMP_HZ);
+	flow_acct_update(&s->acct, FLOW_DIR_FWD, syn->len,
+				syn->stamp * TIMESTAMP_HZ);
+	s->acct.fa_tcp_flags = TCP_SYN;
+
+	syn->inuse = 0;
+	tf->num_syn_promoted++;
+
+	cur->to_server = 0;
+	cur->rcv = &s->c_wnd;
+	s1_processing(cur, s);
+	return s;
+}
 
-	/* Setup initial window tracking state machine */
-	init_wnd(cur, &s->c_wnd);
-	s->s_wnd = NULL;
+/* SYN: Connection refused, or reset before the handshake completed */
+static void syn_reset(struct tcpseg *cur)
+{
+	struct tcp_syn *syn;
 
-	/* link it all up and set up timeouts*/
-	tcp_hash_link(s, cur->hash);
-	timer_msl(cur, s);
+	syn = syn_find(cur, syn_set(cur));
+	if ( syn ) {
+		tmesg(TRACE_TCP_STATE, "connection refused");
+		syn->inuse = 0;
+	}
+}
 
-	INIT_LIST_HEAD(&s->lru);
-	set_lru(cur, s);
+/* Guess whether a segment from a session we didn't see the start of is
+ * headed for the server. Well known ports beat registered ports beat
+ * ephemeral ones, failing that the lower port is taken to be the server.
+ */
+static unsigned int port_rank(uint16_t port)
+{
+	port = be16toh(port);
+	if ( port < 1024 )
+		return 0;
+	if ( port < 49152 )
+		return 1;
+	return 2;
+}
 
-	/* XXX: init */
+static unsigned int midstream_to_server(struct tcpseg *cur)
+{
+	unsigned int sr, dr;
+
+	sr = port_rank(cur->tcph->sport);
+	dr = port_rank(cur->tcph->dport);
+	if ( sr != dr )
+		return dr < sr;
+	return be16toh(cur->tcph->dport) <= be16toh(cur->tcph->sport);
+}
+
+/* Start tracking an established connection from the middle. The sender's
+ * window comes from the segment and the ACK field tells us where the peer
+ * is up to in its own sequence space, so both reassembly buffers can
+ * start from the first byte we see in either direction. Window scaling
+ * was negotiated out of sight so window checks are relaxed for the life
+ * of the session, see sequence_check().
+ */
+static struct tcp_session *pickup_session(struct tcpseg *cur)
+{
+	struct tcpflow *tf = cur->tf;
+	struct tcp_session *s;
+	struct tcp_state *peer;
+
+	cur->to_server = midstream_to_server(cur);
+
+	s = session_alloc(cur, cur->to_server);
+	if ( s == NULL )
+		return NULL;
+
+	s->s_wnd = _tcp_alloc(tf, s, tf->sstate_cache);
+	if ( s->s_wnd == NULL ) {
+		tcp_free(s, 0, FLOW_END_OOM);
+		return NULL;
+	}
+
+	if ( cur->to_server ) {
+		cur->snd = &s->c_wnd;
+		cur->rcv = s->s_wnd;
+	}else{
+		cur->snd = s->s_wnd;
+		cur->rcv = &s->c_wnd;
+	}
+
+	tmesg(TRACE_TCP_STATE, "#0 - mid-stream pickup, sender is %s",
+		(cur->to_server) ? "client" : "server");
+
+	memset(cur->snd, 0, sizeof(*cur->snd));
+	cur->snd->snd_una = cur->seq;
+	cur->snd->snd_nxt = cur->seq;
+	cur->snd->snd_wnd = cur->win;
+	cur->snd->snd_wl1 = cur->seq;
+	cur->snd->snd_wl2 = cur->ack;
+
+	peer = cur->rcv;
+	memset(peer, 0, sizeof(*peer));
+	peer->snd_una = cur->ack;
+	peer->snd_nxt = cur->ack;
+	peer->snd_wl1 = cur->ack;
+	peer->snd_wl2 = cur->seq;
+
+	s->midstream = 1;
+	s->mid_seen = 1 << cur->to_server;
+	s->state = TCP_SESSION_E;
+	timer_msl(cur, s);
+	tf->num_midstream++;
+
+	_tcp_reasm_init(s, cur->to_server, cur->seq, cur->len, cur->payload);
+	if ( cur->len ) {
+		if ( tcp_after(cur->seq_end, cur->snd->snd_nxt) )
+			cur->snd->snd_nxt = cur->seq_end;
+		thex_dump(TRACE_TCP_SEGMENT, cur->payload, cur->len, 16);
+		_tcp_reasm_data(s, cur->to_server, cur->seq,
+				cur->len, cur->payload, cur->stable);
+	}
 
 	return s;
 }
 
+static struct tcp_session *stray_segment(struct tcpseg *cur)
+{
+	switch(cur->tcph->flags & (TCP_SYN|TCP_ACK|TCP_FIN|TCP_RST)) {
+	case TCP_SYN:
+		syn_insert(cur);
+		return NULL;
+	case TCP_SYN|TCP_ACK:
+		return syn_promote(cur);
+	case TCP_RST:
+	case TCP_RST|TCP_ACK:
+		syn_reset(cur);
+		return NULL;
+	case TCP_ACK:
+		if ( midstream )
+			return pickup_session(cur);
+		/* fall through */
+	default:
+		tmesg(TRACE_TCP_STATE, "not a valid syn packet");
+		return NULL;
+	}
+}
+
 static void s1_processing(struct tcpseg *cur, struct tcp_session *s)
 {
+	struct tcpflow *tf = cur->tf;
+
 	assert(!cur->to_server);
 
 	/* Authenticate packet by checking ACK */
 	if ( cur->tcph->flags & TCP_ACK ) {
 		if ( !(between(cur->ack,
 				cur->rcv->snd_una, cur->rcv->snd_nxt)) ) {
-			dmesg(M_DEBUG, "bad ack on syn+ack");
-			state_errs++;
+			tmesg(TRACE_TCP_STATE, "bad ack on syn+ack");
+			tf->state_errs++;
 			return;
 		}
 	}else{
-		dmesg(M_DEBUG, "missing ack on syn+ack");
-		state_errs++;
+		tmesg(TRACE_TCP_STATE, "missing ack on syn+ack");
+		tf->state_errs++;
 		return;
 	}
 
 	/* Technically FIN is invalid here */
 	if ( cur->tcph->flags & (TCP_FIN|TCP_RST) ) {
-		dmesg(M_DEBUG, "connection refused");
+		tmesg(TRACE_TCP_STATE, "connection refused");
 		s->state = TCP_SESSION_C;
 		return;
 	}
@@ -502,18 +984,25 @@ static void s1_processing(struct tcpseg *cur, struct tcp_session *s)
 	if ( cur->tcph->flags & TCP_SYN ) {
 		cur->seq_end++;
 
-		dmesg(M_DEBUG, "#2 - syn+ack");
-		s->s_wnd = _tcp_alloc(s, sstate_cache, 0);
+		tmesg(TRACE_TCP_STATE, "#2 - syn+ack");
+		s->s_wnd = _tcp_alloc(tf, s, tf->sstate_cache);
 		assert(NULL != s->s_wnd);
 		cur->snd = s->s_wnd;
 		init_wnd(cur, s->s_wnd);
 
+		/* timestamps are only used if both ends offer them */
+		if ( !(s->s_wnd->flags & TF_TSTAMP_OK) ||
+			!(s->c_wnd.flags & TF_TSTAMP_OK) ) {
+			s->s_wnd->flags &= ~TF_TSTAMP_OK;
+			s->c_wnd.flags &= ~TF_TSTAMP_OK;
+		}
+
 		if ( !(s->s_wnd->flags & TF_WSCALE_OK) ||
 			!(s->c_wnd.flags & TF_WSCALE_OK) ) {
 			s->s_wnd->scale = 0;
 			s->c_wnd.scale = 0;
 		}else{
-			dmesg(M_DEBUG, "wscale in use c=%u s=%u",
+			tmesg(TRACE_TCP_STATE, "wscale in use c=%u s=%u",
 				s->c_wnd.scale, s->s_wnd->scale);
 		}
 
@@ -522,7 +1011,7 @@ static void s1_processing(struct tcpseg *cur, struct tcp_session *s)
 		s->s_wnd->snd_wl2 = cur->ack;
 
 		s->state = TCP_SESSION_S2;
-		list_del(&s->tmo);
+		timer_msl(cur, s);
 	}
 }
 
@@ -530,31 +1019,36 @@ static int sequence_check(struct tcpseg *cur, struct tcp_session *s)
 {
 	if ( s->state == TCP_SESSION_S2 )
 		return (cur->seq == cur->snd->snd_nxt);
+	if ( s->midstream )
+		return !tcp_before(cur->seq_end, cur->rcv->snd_wl2);
 	return tcp_sequence(cur->rcv, cur->seq, cur->seq_end);
 }
 
 static int ack_processing(struct tcpseg *cur, struct tcp_session *s)
 {
+	struct tcpflow *tf = cur->tf;
+
 	assert(cur->tcph->flags & TCP_ACK);
 
 	if ( s->state == TCP_SESSION_S2 ) {
 		if ( !cur->to_server ) {
-			dmesg(M_DEBUG, "syn+ack resend?");
-			state_errs++;
+			tmesg(TRACE_TCP_STATE, "syn+ack resend?");
+			tf->state_errs++;
 			return 0;
 		}
 
 		/* If SND.UNA =< SEG.ACK =< SND.NXT  */
 		if ( !tcp_after(s->s_wnd->snd_una, cur->ack) &&
 			!tcp_after(cur->ack, s->s_wnd->snd_nxt) ) {
-			dmesg(M_DEBUG, "#3 - ack");
+			tmesg(TRACE_TCP_STATE, "#3 - ack");
 			s->c_wnd.snd_wnd = cur->win;
 			s->c_wnd.snd_wl1 = cur->seq;
 			s->c_wnd.snd_wl2 = cur->ack;
 			s->state = TCP_SESSION_S3;
+			list_del(&s->tmo);
 		}else{
-			dmesg(M_DEBUG, "bad ACK on 3whs");
-			state_errs++;
+			tmesg(TRACE_TCP_STATE, "bad ACK on 3whs");
+			tf->state_errs++;
 		}
 
 		return 1;
@@ -565,7 +1059,7 @@ static int ack_processing(struct tcpseg *cur, struct tcp_session *s)
 		!tcp_after(cur->ack, cur->rcv->snd_nxt) ) {
 
 		/* set SND.UNA <- SEG.ACK. */
-		dmesg(M_DEBUG, "ack to %.8x", cur->ack);
+		tmesg(TRACE_TCP_STATE, "ack to %.8x", cur->ack);
 		cur->rcv->snd_una = cur->ack;
 
 		switch(s->state) {
@@ -574,28 +1068,28 @@ static int ack_processing(struct tcpseg *cur, struct tcp_session *s)
 			break;
 		case TCP_SESSION_CF1:
 			if ( !cur->to_server ) {
-				dmesg(M_DEBUG, "fin+ack for client");
+				tmesg(TRACE_TCP_STATE, "fin+ack for client");
 				_tcp_reasm_shutdown(s, !cur->to_server);
 				s->state = TCP_SESSION_CF2;
 			}
 			break;
 		case TCP_SESSION_SF1:
 			if ( cur->to_server ) {
-				dmesg(M_DEBUG, "fin+ack for server");
+				tmesg(TRACE_TCP_STATE, "fin+ack for server");
 				_tcp_reasm_shutdown(s, !cur->to_server);
 				s->state = TCP_SESSION_SF2;
 			}
 			break;
 		case TCP_SESSION_CF3:
 			if ( cur->to_server ) {
-				dmesg(M_DEBUG, "fin+ack for server");
+				tmesg(TRACE_TCP_STATE, "fin+ack for server");
 				_tcp_reasm_shutdown(s, !cur->to_server);
 				s->state = TCP_SESSION_C;
 			}
 			break;
 		case TCP_SESSION_SF3:
 			if ( !cur->to_server ) {
-				dmesg(M_DEBUG, "fin+ack for client");
+				tmesg(TRACE_TCP_STATE, "fin+ack for client");
 				_tcp_reasm_shutdown(s, !cur->to_server);
 				s->state = TCP_SESSION_C;
 			}
@@ -609,7 +1103,7 @@ static int ack_processing(struct tcpseg *cur, struct tcp_session *s)
 		if ( tcp_before(cur->snd->snd_wl1, cur->seq) ||
 			(cur->snd->snd_wl1 == cur->seq &&
 				!tcp_after(cur->snd->snd_wl2, cur->ack)) ) {
-			dmesg(M_DEBUG, "window update");
+			tmesg(TRACE_TCP_STATE, "window update");
 			cur->snd->snd_wnd = cur->win;
 			cur->snd->snd_wl1 = cur->seq;
 			cur->snd->snd_wl2 = cur->ack;
@@ -628,54 +1122,176 @@ static void fin_processing(struct tcpseg *cur, struct tcp_session *s)
 	case TCP_SESSION_E:
 		if ( cur->to_server ) {
 			s->state = TCP_SESSION_CF1;
-			dmesg(M_DEBUG, "client close first");
+			tmesg(TRACE_TCP_STATE, "client close first");
 		}else{
 			s->state = TCP_SESSION_SF1;
-			dmesg(M_DEBUG, "server close first");
+			tmesg(TRACE_TCP_STATE, "server close first");
 		}
 		break;
 	case TCP_SESSION_CF1:
 	case TCP_SESSION_CF2:
 		if ( cur->to_server ) {
-			dmesg(M_DEBUG, "fin resend?");
+			tmesg(TRACE_TCP_STATE, "fin resend?");
 			return;
 		}
-		dmesg(M_DEBUG, "server %sclose",
+		tmesg(TRACE_TCP_STATE, "server %sclose",
 			(s->state == TCP_SESSION_CF1) ? "simultaneous " : "");
 		s->state = TCP_SESSION_CF3;
 		break;
 	case TCP_SESSION_SF1:
 	case TCP_SESSION_SF2:
 		if ( !cur->to_server ) {
-			dmesg(M_DEBUG, "fin resend?");
+			tmesg(TRACE_TCP_STATE, "fin resend?");
 			return;
 		}
-		dmesg(M_DEBUG, "client %sclose",
+		tmesg(TRACE_TCP_STATE, "client %sclose",
 			(s->state == TCP_SESSION_SF1) ? "simultaneous " : "");
 		s->state = TCP_SESSION_SF3;
 		break;
 	default:
-		dmesg(M_DEBUG, "FIN in wrong state");
+		tmesg(TRACE_TCP_STATE, "FIN in wrong state");
 		return;
 	}
 	_tcp_reasm_fin_sent(s, cur->to_server);
 	cur->snd->snd_nxt++;
 }
 
+/* PAWS: Reject old duplicates, RFC 7323 section 5.3. RST's are exempt
+ * since they're not supposed to carry timestamps, and TS.Recent is only
+ * good for 24 days without an update.
+ */
 static int paws_check(struct tcpseg *cur, struct tcp_session *s)
 {
-	return 1;
+	struct tcpflow *tf = cur->tf;
+
+	if ( !cur->saw_tstamp || !(cur->snd->flags & TF_TSTAMP_OK) )
+		return 1;
+	if ( cur->tcph->flags & TCP_RST )
+		return 1;
+	if ( !tcp_before(cur->tsval, cur->snd->ts_recent) )
+		return 1;
+	if ( tcp_after(tf->tcp_now,
+			cur->snd->ts_recent_stamp + TCP_PAWS_24DAYS) )
+		return 1;
+
+	tmesg(TRACE_TCP_STATE, "PAWS: tsval %u before ts_recent %u",
+		cur->tsval, cur->snd->ts_recent);
+	tf->num_paws++;
+	return 0;
+}
+
+static void rtt_sample(struct tcp_state *s, uint32_t rtt)
+{
+	if ( s->srtt_us ) {
+		/* srtt = 7/8 srtt + 1/8 rtt, as in RFC 6298 */
+		s->srtt_us = ((uint64_t)s->srtt_us * 7 + rtt) >> 3;
+		if ( rtt < s->min_rtt_us )
+			s->min_rtt_us = rtt;
+	}else{
+		s->srtt_us = s->min_rtt_us = rtt;
+	}
+	if ( !s->srtt_us )
+		s->srtt_us = 1;
+}
+
+/* RTT: Time the first few distinct TSvals in each direction, from seeing
+ * them go past until the receiver echoes one back. That's the round trip
+ * between the sensor and the receiver, the two directions of a session add
+ * up to the end-to-end RTT. Echoes are in order, so any probe older than
+ * the one echoed never will be and gets dropped along with it.
+ */
+static void ts_rtt(struct tcpseg *cur)
+{
+	struct tcpflow *tf = cur->tf;
+	struct tcp_state *snd = cur->snd, *peer = cur->rcv;
+	unsigned int i, idx, keep;
+	uint32_t rtt;
+
+	if ( cur->tcph->flags & TCP_ACK ) {
+		for(keep = 0; keep < peer->ts_probe_cnt; keep++) {
+			idx = (peer->ts_probe_head + TS_PROBES - 1 - keep) %
+				TS_PROBES;
+			if ( tcp_after(peer->ts_probe[idx], cur->tsecr) )
+				continue;
+			if ( peer->ts_probe[idx] != cur->tsecr )
+				break;
+			/* capture time can step backwards, keep that out of
+			 * srtt and min_rtt
+			 */
+			rtt = tf->tcp_now_us - peer->ts_probe_us[idx];
+			if ( (int32_t)rtt <= 0 ) {
+				tmesg(TRACE_TCP_STATE, "RTT sample %dus dropped",
+					(int32_t)rtt);
+				break;
+			}
+			rtt_sample(peer, rtt);
+			tf->num_rtt_samples++;
+			tmesg(TRACE_TCP_STATE, "RTT sample %uus srtt %uus",
+				rtt, peer->srtt_us);
+			break;
+		}
+		peer->ts_probe_cnt = keep;
+	}
+
+	i = (snd->ts_probe_head + TS_PROBES - 1) % TS_PROBES;
+	if ( snd->ts_probe_cnt && !tcp_after(cur->tsval, snd->ts_probe[i]) )
+		return;
+
+	i = snd->ts_probe_head;
+	snd->ts_probe[i] = cur->tsval;
+	snd->ts_probe_us[i] = tf->tcp_now_us;
+	snd->ts_probe_head = (i + 1) % TS_PROBES;
+	if ( snd->ts_probe_cnt < TS_PROBES )
+		snd->ts_probe_cnt++;
 }
 
+/* PAWS: Remember the latest timestamp from the segment covering the left
+ * edge of the window, RFC 7323 section 4.3. Mid-stream pickups never saw
+ * the options on the SYN so they just start from the first one.
+ */
 static void paws_update(struct tcpseg *cur, struct tcp_session *s)
 {
+	struct tcpflow *tf = cur->tf;
+	struct tcp_state *snd = cur->snd;
+
+	if ( !cur->saw_tstamp )
+		return;
+
+	if ( !(snd->flags & TF_TSTAMP_OK) ) {
+		if ( !s->midstream )
+			return;
+		snd->flags |= TF_TSTAMP_OK;
+		snd->ts_recent = cur->tsval;
+		snd->ts_recent_stamp = tf->tcp_now;
+	}else if ( !tcp_after(cur->seq, snd->snd_una) &&
+			!tcp_before(cur->tsval, snd->ts_recent) ) {
+		snd->ts_recent = cur->tsval;
+		snd->ts_recent_stamp = tf->tcp_now;
+	}
+
+	if ( cur->rcv->flags & TF_TSTAMP_OK )
+		ts_rtt(cur);
+}
+
+int tcp_sesh_rtt(tcp_sesh_t s, tcp_chan_t chan,
+			uint32_t *srtt, uint32_t *min_rtt)
+{
+	struct tcp_state *snd;
+
+	snd = (chan & TCP_CHAN_TO_SERVER) ? &s->c_wnd : s->s_wnd;
+	if ( NULL == snd || !snd->srtt_us )
+		return 0;
+
+	*srtt = snd->srtt_us;
+	*min_rtt = snd->min_rtt_us;
+	return 1;
 }
 
 static void state_track(struct tcpseg *cur, struct tcp_session *s)
 {
 	if ( s->state == TCP_SESSION_S1 ) {
 		if ( cur->to_server ) {
-			dmesg(M_DEBUG, "syn resend?");
+			tmesg(TRACE_TCP_STATE, "syn resend?");
 			timer_msl(cur, s);
 		}else{
 			s1_processing(cur, s);
@@ -687,17 +1303,29 @@ static void state_track(struct tcpseg *cur, struct tcp_session *s)
 
 	/* First, check the sequence number */
 	if ( !sequence_check(cur, s) ) {
-		state_errs++;
-		dmesg(M_DEBUG, "Failed sequence check");
+		cur->tf->state_errs++;
+		tmesg(TRACE_TCP_STATE, "Failed sequence check");
 		return;
 	}
 
 	if ( !paws_check(cur, s) )
 		return;
 
+	/* One-sided pickups sit on the MSL list with the half-open sessions
+	 * so they're within reach of the evictor, and drop off it once the
+	 * peer shows up. Closing sessions keep the timer they've got.
+	 */
+	if ( s->midstream && s->mid_seen != 3 ) {
+		s->mid_seen |= 1 << cur->to_server;
+		if ( s->state == TCP_SESSION_E && s->mid_seen == 3 )
+			list_del(&s->tmo);
+		else if ( s->state == TCP_SESSION_E )
+			timer_msl(cur, s);
+	}
+
 	/* Second, check the RST bit */
 	if ( cur->tcph->flags & TCP_RST ) {
-		dmesg(M_DEBUG, "connection reset by peer");
+		tmesg(TRACE_TCP_STATE, "connection reset by peer");
 		s->state = TCP_SESSION_R;
 		return;
 	}
@@ -709,9 +1337,9 @@ static void state_track(struct tcpseg *cur, struct tcp_session *s)
 	/* Fourth, check the SYN bit */
 	if ( cur->tcph->flags & TCP_SYN ) {
 		if ( cur->tcph->flags & TCP_FIN ) {
-			dmesg(M_DEBUG, "XMAS attack");
+			tmesg(TRACE_TCP_STATE, "XMAS attack");
 		}
-		dmesg(M_DEBUG, "In window SYN");
+		tmesg(TRACE_TCP_STATE, "In window SYN");
 	}
 
 	cur->win <<= cur->snd->scale;
@@ -725,27 +1353,32 @@ static void state_track(struct tcpseg *cur, struct tcp_session *s)
 
 	/* Sixth Check URG field */
 	if ( cur->tcph->flags & TCP_URG ) {
-		mesg(M_DEBUG, "URG urgp=%u", be16toh(cur->tcph->urp));
+		tmesg(TRACE_TCP_STATE, "URG urgp=%u", be16toh(cur->tcph->urp));
 	}
 
 	/* seventh process the segment text */
 	if ( cur->len ) {
 		if ( s->state == TCP_SESSION_S3 ) {
-			dmesg(M_DEBUG, "%s sent first data",
+			tmesg(TRACE_TCP_STATE, "%s sent first data",
 				cur->to_server ? "client" : "server");
 			s->state = TCP_SESSION_E;
 			_tcp_reasm_init(s, cur->to_server,
 					cur->seq, cur->len, cur->payload);
 		}
 
-		cur->snd->snd_una = cur->seq;
-		cur->snd->snd_nxt = cur->seq_end;
-		dmesg(M_DEBUG, "%u bytes data %.8x - %.8x",
+		/* SND.UNA is only moved by the peer's ACKs. A reordered
+		 * segment must not pull SND.NXT back or the peer's ACKs for
+		 * the later data look like they're from the future and
+		 * never get processed.
+		 */
+		if ( tcp_after(cur->seq_end, cur->snd->snd_nxt) )
+			cur->snd->snd_nxt = cur->seq_end;
+		tmesg(TRACE_TCP_STATE, "%u bytes data %.8x - %.8x",
 			cur->len, cur->seq, cur->seq_end);
-		//dhex_dump(cur->payload, cur->len, 16);
+		thex_dump(TRACE_TCP_SEGMENT, cur->payload, cur->len, 16);
 		/* FIXME: Truncate to transmit window */
 		_tcp_reasm_data(s, cur->to_server, cur->seq,
-				cur->len, cur->payload);
+				cur->len, cur->payload, cur->stable);
 	}
 
 	/* eighth, check the FIN bit */
@@ -753,6 +1386,14 @@ static void state_track(struct tcpseg *cur, struct tcp_session *s)
 		fin_processing(cur, s);
 }
 
+static void tcp_acct(struct tcpseg *cur, struct tcp_session *s)
+{
+	flow_acct_update(&s->acct,
+			(cur->to_server) ? FLOW_DIR_FWD : FLOW_DIR_REV,
+			be16toh(cur->iph->tot_len), cur->ts);
+	s->acct.fa_tcp_flags |= cur->tcph->flags;
+}
+
 static int do_csum(struct tcpseg *cur)
 {
 	uint16_t len;
@@ -762,58 +1403,86 @@ static int do_csum(struct tcpseg *cur)
 				(uint8_t *)cur->tcph);
 }
 
-static void seg_init(struct tcpseg *cur, pkt_t pkt, struct tcp_dcb *dcb)
+static void seg_init(struct tcpflow *tf, struct tcpseg *cur,
+			pkt_t pkt, struct tcp_dcb *dcb)
 {
+	cur->tf = tf;
 	cur->ts = pkt->pkt_ts;
 	cur->iph = dcb->tcp_iph;
 	cur->tcph = dcb->tcp_hdr;
 	cur->ack = be32toh(cur->tcph->ack);
 	cur->seq = be32toh(cur->tcph->seq);
 	cur->win = be16toh(cur->tcph->win);
+	cur->tunnel = (tunnel_key) ? pkt->pkt_tunnel : 0;
+	cur->vlan = (vlan_key) ? pkt->pkt_vlan : 0;
 	cur->hash = tcp_hashfn(cur->iph->saddr, cur->iph->daddr,
-				cur->tcph->sport, cur->tcph->dport);
+				cur->tcph->sport, cur->tcph->dport,
+				cur->tunnel, cur->vlan);
 	cur->len = be16toh(cur->iph->tot_len) -
 			(cur->iph->ihl << 2) -
 			(cur->tcph->doff << 2);
 	cur->seq_end = cur->seq + cur->len;
 	cur->tsval = 0;
+	cur->tsecr = 0;
 	cur->saw_tstamp = 0;
 	cur->payload = (uint8_t *)cur->tcph + (cur->tcph->doff << 2);
+	cur->stable = (pkt->pkt_flags & PKT_STABLE) &&
+			cur->payload + cur->len <= pkt->pkt_end;
+	tcp_fast_options(cur);
+
+	tf->num_segments++;
+
+	tf->tcp_now = cur->ts / TIMESTAMP_HZ;
+	tf->tcp_now_us = tf->tcp_now * 1000000U + pkt->pkt_usec;
+	tcp_tmo_check(tf, &tf->tmo_msl, cur->ts);
+	flow_export_tick(tf->exporter, cur->ts);
+	if ( unlikely(tf->flow_mem > mem_high) ) {
+		if ( tf->tcp_now >= tf->mem_report_next ) {
+			mem_report(tf, "over high watermark");
+			tf->mem_report_next = tf->tcp_now + mem_report_interval;
+		}
+		evict_to_watermark(tf);
+	}
 
-	num_segments++;
-
-	tcp_tmo_check(&tmo_msl, cur->ts);
-
-	dbg_segment(cur);
+	trace_flow4(cur->iph->saddr, cur->tcph->sport,
+			cur->iph->daddr, cur->tcph->dport);
+	if ( trace_on(TRACE_TCP_SEGMENT) )
+		dbg_segment(cur);
 }
 
-void _tcpflow_track(pkt_t pkt, dcb_t dcb_ptr)
+void _tcpflow_track(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr)
 {
 	struct tcp_session *s;
 	struct tcpseg cur;
 	unsigned int do_free = 0, rst;
 
-	seg_init(&cur, pkt, (struct tcp_dcb *)dcb_ptr);
+	seg_init(tf, &cur, pkt, (struct tcp_dcb *)dcb_ptr);
 
 	if ( cur.iph->ttl < minttl ) {
-		num_ttl_errs++;
-		dmesg(M_DEBUG, "TTL evasion");
+		tf->num_ttl_errs++;
+		tmesg(TRACE_TCP_STATE, "TTL evasion");
 		return;
 	}
 
-	if ( do_tcp_csum && !do_csum(&cur) ) {
-		num_csum_errs++;
-		mesg(M_DEBUG, "bad checksum");
-		dhex_dump(cur.payload, cur.len, 16);
-		return;
+	if ( do_tcp_csum ) {
+		if ( !source_csum_verify(pkt->pkt_source, pkt) ) {
+			tf->num_csum_trusted++;
+		}else if ( !do_csum(&cur) ) {
+			tf->num_csum_errs++;
+			tmesg(TRACE_TCP_STATE, "bad checksum");
+			thex_dump(TRACE_TCP_STATE, cur.payload, cur.len, 16);
+			return;
+		}
 	}
 
-	s = tcp_collide(hash[cur.hash],
-			cur.iph, cur.tcph, &cur.to_server);
+	s = tcp_collide(tf->hash[cur.hash],
+			cur.iph, cur.tcph, cur.tunnel, cur.vlan,
+			&cur.to_server);
 	if ( s == NULL ) {
-		s = new_session(&cur);
+		s = stray_segment(&cur);
 		if ( s == NULL )
 			return;
+		tcp_acct(&cur, s);
 	}else{
 		/* Figure out which side is which */
 		if ( cur.to_server ) {
@@ -825,6 +1494,7 @@ void _tcpflow_track(pkt_t pkt, dcb_t dcb_ptr)
 		}
 
 		tcp_hash_mtf(s, cur.hash);
+		tcp_acct(&cur, s);
 
 		state_track(&cur, s);
 		if ( s->state == TCP_SESSION_C ) {
@@ -836,49 +1506,221 @@ void _tcpflow_track(pkt_t pkt, dcb_t dcb_ptr)
 		}
 	}
 
-	dbg_stream("client", &s->c_wnd);
-	dbg_stream("server", s->s_wnd);
+	if ( trace_on(TRACE_TCP_STREAM) ) {
+		dbg_stream("client", &s->c_wnd);
+		dbg_stream("server", s->s_wnd);
+	}
 	if ( do_free ) {
-		tcp_free(s, rst);
-		dmesg(M_DEBUG, "freed session state");
+		tcp_free(s, rst, FLOW_END_EOF);
+		tmesg(TRACE_TCP_STATE, "freed session state");
+	}
+}
+
+/* Burst mode: Get the hash slot, then the session at the head of its
+ * chain, in to cache ahead of _tcpflow_track(). SYN's go to the half-open
+ * table instead. Nothing is looked up for real because earlier packets in
+ * the burst may yet change what's there.
+ */
+void _tcpflow_prefetch(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr,
+			unsigned int pass)
+{
+	struct tcp_dcb *dcb = (struct tcp_dcb *)dcb_ptr;
+	const struct pkt_tcphdr *tcph = dcb->tcp_hdr;
+	struct tcp_session *s;
+	uint32_t h;
 
+	h = flow_mix(dcb->tcp_iph->saddr, dcb->tcp_iph->daddr,
+			tcph->sport, tcph->dport,
+			(tunnel_key) ? pkt->pkt_tunnel : 0,
+			(vlan_key) ? pkt->pkt_vlan : 0);
+
+	switch(pass) {
+	case FLOW_PREFETCH_BUCKET:
+		prefetch(&tf->hash[h % TCPHASH]);
+		if ( tcph->flags & TCP_SYN ) {
+			prefetch(&tf->syn_tab[h % SYNHASH][0]);
+			prefetch(&tf->syn_tab[h % SYNHASH][SYN_WAYS - 1]);
+		}
+		break;
+	case FLOW_PREFETCH_ENTRY:
+		s = tf->hash[h % TCPHASH];
+		if ( s ) {
+			prefetch(s);
+			prefetch(&s->c_addr);
+		}
+		break;
+	}
+}
+
+/* ICMP: An error quoting one of our segments. Hosts only give up on a
+ * synchronised connection for hard errors, RFC 1122 section 4.2.3.9, but
+ * anything that stops the handshake getting through is fatal to it. The
+ * quoted sequence number has to be in flight or anyone could tear down
+ * sessions from under us with a blind guess, RFC 5927.
+ */
+void _tcpflow_icmp_error(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct icmp_dcb *dcb = (struct icmp_dcb *)dcb_ptr;
+	const struct pkt_icmphdr *icmph = dcb->icmp_hdr;
+	struct tcp_session *s;
+	struct tcp_state *snd;
+	struct tcp_syn *syn;
+	struct tcpseg cur;
+	unsigned int hard, fatal;
+	uint16_t mtu;
+
+	memset(&cur, 0, sizeof(cur));
+	cur.tf = tf;
+	cur.ts = pkt->pkt_ts;
+	cur.iph = dcb->icmp_inner;
+	cur.tcph = (const struct pkt_tcphdr *)((const uint8_t *)cur.iph +
+						(cur.iph->ihl << 2));
+	cur.seq = be32toh(cur.tcph->seq);
+	cur.tunnel = (tunnel_key) ? pkt->pkt_tunnel : 0;
+	cur.vlan = (vlan_key) ? pkt->pkt_vlan : 0;
+	cur.hash = tcp_hashfn(cur.iph->saddr, cur.iph->daddr,
+				cur.tcph->sport, cur.tcph->dport,
+				cur.tunnel, cur.vlan);
+
+	trace_flow4(cur.iph->saddr, cur.tcph->sport,
+			cur.iph->daddr, cur.tcph->dport);
+
+	switch(icmph->type) {
+	case ICMP_DEST_UNREACH:
+		hard = (icmph->code == ICMP_PROT_UNREACH ||
+			icmph->code == ICMP_PORT_UNREACH);
+		fatal = (icmph->code != ICMP_FRAG_NEEDED);
+		break;
+	case ICMP_TIME_EXCEEDED:
+		hard = 0;
+		fatal = 1;
+		break;
+	default:
+		return;
+	}
+
+	s = tcp_collide(tf->hash[cur.hash], cur.iph, cur.tcph,
+			cur.tunnel, cur.vlan, &cur.to_server);
+	if ( NULL == s ) {
+		syn = syn_find(&cur, syn_set(&cur));
+		if ( NULL == syn || !fatal )
+			return;
+		if ( syn->c_addr != cur.iph->saddr || syn->isn != cur.seq ) {
+			tf->num_icmp_bad++;
+			return;
+		}
+		tmesg(TRACE_TCP_STATE, "ICMP %u/%u: syn failed",
+			icmph->type, icmph->code);
+		syn->inuse = 0;
+		tf->num_icmp_abort++;
+		return;
+	}
+
+	snd = (cur.to_server) ? &s->c_wnd : s->s_wnd;
+	if ( NULL == snd ||
+			!between(cur.seq, snd->snd_una, snd->snd_nxt) ) {
+		tmesg(TRACE_TCP_STATE, "ICMP %u/%u: seq %.8x not in flight",
+			icmph->type, icmph->code, cur.seq);
+		tf->num_icmp_bad++;
+		return;
+	}
+
+	if ( icmph->type == ICMP_DEST_UNREACH &&
+			icmph->code == ICMP_FRAG_NEEDED ) {
+		mtu = be16toh(icmph->un.frag.mtu);
+		if ( mtu && (!s->pmtu || mtu < s->pmtu) ) {
+			tmesg(TRACE_TCP_STATE, "ICMP: path MTU %u", mtu);
+			s->pmtu = mtu;
+			tf->num_icmp_pmtu++;
+		}
+		return;
+	}
+
+	if ( hard || (fatal && s->state < TCP_SESSION_S3) ) {
+		tmesg(TRACE_TCP_STATE, "ICMP %u/%u: connection aborted",
+			icmph->type, icmph->code);
+		tcp_free(s, 1, FLOW_END_EOF);
+		tf->num_icmp_abort++;
 	}
-	dmesg(M_INFO, "\n");
 }
 
-void _tcpflow_dtor(void)
+void _tcpflow_dtor(struct tcpflow *tf)
 {
 	struct tcp_session *s, *tmp;
 
-	list_for_each_entry_safe(s, tmp, &lru, lru)
-		tcp_free(s, 0);
+	mem_report(tf, "shutdown");
+	list_for_each_entry_safe(s, tmp, &tf->lru, lru)
+		tcp_free(s, 0, FLOW_END_FORCED);
 
 	mesg(M_INFO,"tcpstream: errors: %u csum, %u ttl, %u oom, %u timeout",
-		num_csum_errs, num_ttl_errs,
-		num_oom, num_timeouts);
-	mesg(M_INFO,"tcpstream: max_active=%u num_active=%u",
-		max_active, num_active);
+		tf->num_csum_errs, tf->num_ttl_errs,
+		tf->num_oom, tf->num_timeouts);
+	mesg(M_INFO,"tcpstream: max_active=%u num_active=%u midstream=%u",
+		tf->max_active, tf->num_active, tf->num_midstream);
 	mesg(M_INFO,"tcpstream: %u segments processed, %u state errors",
-		num_segments, state_errs);
-	_tcp_reasm_dtor();
-	mempool_free(tcp_pool);
+		tf->num_segments, tf->state_errs);
+	mesg(M_INFO,"tcpstream: %u checksums trusted, %s checksum kernel",
+		tf->num_csum_trusted, csum_kernel());
+	mesg(M_INFO,"tcpstream: %u PAWS rejects, %u RTT samples",
+		tf->num_paws, tf->num_rtt_samples);
+	mesg(M_INFO,"tcpstream: ICMP: %u aborted, %u path MTU, %u bogus",
+		tf->num_icmp_abort, tf->num_icmp_pmtu, tf->num_icmp_bad);
+	mesg(M_INFO,"tcpstream: %u evicted, %llu bytes reclaimed, "
+		"peak memory %zuK of %zuK",
+		tf->num_evict, (unsigned long long)tf->evict_bytes,
+		tf->max_flow_mem >> 10, mem_budget >> 10);
+	mesg(M_INFO,"tcpstream: half-open: %u syn, %u promoted, %u overwritten",
+		tf->num_syn, tf->num_syn_promoted, tf->num_syn_overwritten);
+	if ( tf->reasm )
+		_tcp_reasm_dtor(tf->reasm);
+	flow_exporter_free(tf->exporter);
+	mempool_free(tf->pool);
+	free(tf);
 }
 
-int _tcpflow_ctor(void)
+struct tcpflow *_tcpflow_ctor(void)
 {
-	tcp_pool = mempool_new("tcpflow", 1024);
+	struct tcpflow *tf;
+
+	tf = calloc(1, sizeof(*tf));
+	if ( NULL == tf )
+		return NULL;
+
+	INIT_LIST_HEAD(&tf->lru);
+	INIT_LIST_HEAD(&tf->tmo_msl);
+
+	/* private, so trackers in other pipelines never share chunks */
+	tf->pool = mempool_new_private("tcpflow", FLOW_TCP_CHUNKS);
+	if ( NULL == tf->pool )
+		goto err;
 
-	session_cache = objcache_init(tcp_pool, "tcp_session",
+	tf->session_cache = objcache_init(tf->pool, "tcp_session",
 					sizeof(struct tcp_session));
-	if ( session_cache == NULL )
-		return 0;
+	if ( tf->session_cache == NULL )
+		goto err_pool;
 
-	sstate_cache = objcache_init(tcp_pool, "tcp_state",
+	tf->sstate_cache = objcache_init(tf->pool, "tcp_state",
 					sizeof(struct tcp_state));
-	if ( sstate_cache == NULL )
-		return 0;
+	if ( tf->sstate_cache == NULL )
+		goto err_pool;
 
-	if ( reassemble && !_tcp_reasm_ctor(tcp_pool) )
-		return 0;
-	return 1;
+	if ( reassemble ) {
+		tf->reasm = _tcp_reasm_ctor(tf, tf->pool);
+		if ( NULL == tf->reasm )
+			goto err_pool;
+	}
+
+	tf->exporter = flow_exporter_new();
+	if ( NULL == tf->exporter )
+		goto err_reasm;
+
+	return tf;
+err_reasm:
+	if ( tf->reasm )
+		_tcp_reasm_dtor(tf->reasm);
+err_pool:
+	mempool_free(tf->pool);
+err:
+	free(tf);
+	return NULL;
 }
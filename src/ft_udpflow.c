@@ -0,0 +1,408 @@
+/*
+ * This file is part of Firestorm NIDS
+ * Copyright (c) Gianni Tedesco 2010
+ * This program is released under the terms of the GNU GPL version 3
+ *
+ * UDP pseudo-sessions. A session is created by the first datagram of a
+ * flow and goes away after it has been idle for udp_tmo. The sender of
+ * that datagram is the client unless it was sent from a port that a
+ * udp_app is registered on, and the other end wasn't, in which case we
+ * came in on a response. Datagrams are handed to the app bound to the
+ * server port, if any.
+*/
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <f_flow.h>
+#include <pkt/ip.h>
+#include <pkt/udp.h>
+#include <pkt/icmp.h>
+#include <p_ipv4.h>
+#include <p_udp.h>
+
+#include "tcpip.h"
+
+/* configuration options */
+static const timestamp_t udp_tmo = 60 * TIMESTAMP_HZ;
+/* see ft_tcpflow.c */
+static const uint8_t tunnel_key = 1;
+static const uint8_t vlan_key = 1;
+
+/* flow hash */
+#define UDPHASH 1021 /* prime */
+
+/* One per pipeline, like the TCP tracker */
+struct udpflow {
+	struct udp_session *hash[UDPHASH];
+
+	/* memory caches */
+	mempool_t pool;
+	objcache_t session_cache;
+	struct udp_app_inst *apps;
+	flow_exporter_t exporter;
+
+	/* timeout list, in expiry order since there's only the one timeout */
+	struct list_head tmo;
+
+	/* stats */
+	unsigned int num_active;
+	unsigned int max_active;
+	unsigned int num_datagrams;
+	unsigned int num_timeouts;
+	unsigned int num_oom;
+	unsigned int num_app;
+	unsigned int num_icmp;
+};
+
+_constfn static uint16_t udp_hashfn(uint32_t saddr, uint32_t daddr,
+					uint16_t sport, uint16_t dport,
+					uint32_t tunnel, uint32_t vlan)
+{
+	uint32_t h;
+	h = ((saddr ^ sport) ^ (daddr ^ dport)) ^ tunnel ^ vlan;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return h % UDPHASH;
+}
+
+static void udp_hash_unlink(struct udp_session *s)
+{
+	if (s->hash_next)
+		s->hash_next->hash_pprev = s->hash_pprev;
+	*s->hash_pprev = s->hash_next;
+}
+
+static void udp_hash_link(struct udpflow *uf, struct udp_session *s,
+				uint16_t bucket)
+{
+	if ((s->hash_next = uf->hash[bucket]))
+		s->hash_next->hash_pprev = &s->hash_next;
+	uf->hash[bucket] = s;
+	s->hash_pprev = &uf->hash[bucket];
+}
+
+static struct udp_session *udp_collide(struct udp_session *s,
+					const struct pkt_iphdr *iph,
+					const struct pkt_udphdr *udph,
+					uint32_t tunnel, uint32_t vlan,
+					unsigned int *to_server)
+{
+	for (; s; s = s->hash_next) {
+		if ( s->tunnel != tunnel || s->vlan != vlan )
+			continue;
+		if (	s->s_addr == iph->saddr &&
+			s->c_addr == iph->daddr &&
+			s->s_port == udph->sport &&
+			s->c_port == udph->dport ) {
+			*to_server = 0;
+			return s;
+		}
+		if (	s->c_addr == iph->saddr &&
+			s->s_addr == iph->daddr &&
+			s->c_port == udph->sport &&
+			s->s_port == udph->dport ) {
+			*to_server = 1;
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+void *udp_sesh_priv(udp_sesh_t s)
+{
+	return s->app_priv;
+}
+
+static void udp_free(struct udpflow *uf, struct udp_session *s, uint8_t why)
+{
+	struct flow_rec fr;
+
+	if ( s->app ) {
+		if ( s->app->a_fini )
+			s->app->a_fini(s);
+		if ( s->app_priv )
+			objcache_free2(uf->apps[s->app->a_idx].cache,
+					s->app_priv);
+	}
+
+	fr.fr_acct = &s->acct;
+	fr.fr_saddr = s->c_addr;
+	fr.fr_daddr = s->s_addr;
+	fr.fr_sport = s->c_port;
+	fr.fr_dport = s->s_port;
+	fr.fr_vlan = s->vlan;
+	fr.fr_proto = IP_PROTO_UDP;
+	fr.fr_end = why;
+	flow_export(uf->exporter, &fr);
+
+	udp_hash_unlink(s);
+	list_del(&s->tmo);
+	objcache_free2(uf->session_cache, s);
+	uf->num_active--;
+}
+
+/* TMO: Check timeouts */
+static void udp_tmo_check(struct udpflow *uf, timestamp_t now)
+{
+	struct udp_session *s;
+
+	while ( !list_empty(&uf->tmo) ) {
+		s = list_entry(uf->tmo.next, struct udp_session, tmo);
+		if ( !time_after(now / TIMESTAMP_HZ, s->expire) )
+			return;
+
+		udp_free(uf, s, FLOW_END_IDLE);
+		uf->num_timeouts++;
+	}
+}
+
+/* TMO: Set expiry */
+static void set_expire(struct udpflow *uf, struct udp_session *s,
+			timestamp_t t)
+{
+	s->expire = (t + udp_tmo) / TIMESTAMP_HZ;
+	list_move_tail(&s->tmo, &uf->tmo);
+}
+
+static struct udp_session *udp_alloc(struct udpflow *uf)
+{
+	struct udp_session *s;
+
+	s = objcache_alloc(uf->session_cache);
+	if ( s )
+		return s;
+
+	/* Drop the session closest to timing out anyway */
+	if ( list_empty(&uf->tmo) )
+		return NULL;
+
+	udp_free(uf, list_entry(uf->tmo.next, struct udp_session, tmo),
+		FLOW_END_OOM);
+	uf->num_oom++;
+	return objcache_alloc(uf->session_cache);
+}
+
+static void app_bind(struct udpflow *uf, struct udp_session *s)
+{
+	struct udp_app *app;
+	objcache_t cache;
+
+	app = _udp_app_find_by_dport(s->s_port);
+	if ( NULL == app )
+		return;
+
+	cache = uf->apps[app->a_idx].cache;
+	if ( app->a_state_sz ) {
+		s->app_priv = objcache_alloc(cache);
+		if ( NULL == s->app_priv )
+			return;
+	}
+
+	s->app = app;
+	if ( app->a_init && !app->a_init(s) ) {
+		if ( s->app_priv )
+			objcache_free2(cache, s->app_priv);
+		s->app_priv = NULL;
+		s->app = NULL;
+		return;
+	}
+
+	uf->num_app++;
+}
+
+static struct udp_session *new_session(struct udpflow *uf, pkt_t pkt,
+					const struct pkt_iphdr *iph,
+					const struct pkt_udphdr *udph,
+					uint32_t tunnel, uint32_t vlan,
+					uint16_t bucket,
+					unsigned int *to_server)
+{
+	struct udp_session *s;
+
+	s = udp_alloc(uf);
+	if ( NULL == s ) {
+		mesg(M_CRIT, "udp OOM");
+		return NULL;
+	}
+
+	/* Did we come in on a response? */
+	*to_server = !(_udp_app_find_by_dport(udph->sport) &&
+			!_udp_app_find_by_dport(udph->dport));
+
+	if ( *to_server ) {
+		s->c_addr = iph->saddr;
+		s->s_addr = iph->daddr;
+		s->c_port = udph->sport;
+		s->s_port = udph->dport;
+	}else{
+		s->c_addr = iph->daddr;
+		s->s_addr = iph->saddr;
+		s->c_port = udph->dport;
+		s->s_port = udph->sport;
+	}
+	s->tunnel = tunnel;
+	s->vlan = vlan;
+	s->app = NULL;
+	s->app_priv = NULL;
+	flow_acct_init(&s->acct, pkt->pkt_ts);
+
+	INIT_LIST_HEAD(&s->tmo);
+	udp_hash_link(uf, s, bucket);
+
+	if ( ++uf->num_active > uf->max_active )
+		uf->max_active = uf->num_active;
+
+	app_bind(uf, s);
+	return s;
+}
+
+void _udpflow_track(struct udpflow *uf, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct udp_dcb *dcb = (struct udp_dcb *)dcb_ptr;
+	const struct pkt_iphdr *iph = dcb->udp_iph;
+	const struct pkt_udphdr *udph = dcb->udp_hdr;
+	const uint8_t *buf, *end;
+	struct udp_session *s;
+	unsigned int to_server;
+	uint32_t tunnel, vlan;
+	uint16_t bucket;
+
+	uf->num_datagrams++;
+
+	udp_tmo_check(uf, pkt->pkt_ts);
+	flow_export_tick(uf->exporter, pkt->pkt_ts);
+
+	tunnel = (tunnel_key) ? pkt->pkt_tunnel : 0;
+	vlan = (vlan_key) ? pkt->pkt_vlan : 0;
+	bucket = udp_hashfn(iph->saddr, iph->daddr,
+				udph->sport, udph->dport,
+				tunnel, vlan);
+
+	s = udp_collide(uf->hash[bucket], iph, udph, tunnel, vlan,
+			&to_server);
+	if ( NULL == s ) {
+		s = new_session(uf, pkt, iph, udph, tunnel, vlan,
+				bucket, &to_server);
+		if ( NULL == s )
+			return;
+	}
+
+	flow_acct_update(&s->acct,
+			(to_server) ? FLOW_DIR_FWD : FLOW_DIR_REV,
+			be16toh(iph->tot_len), pkt->pkt_ts);
+	set_expire(uf, s, pkt->pkt_ts);
+
+	if ( NULL == s->app )
+		return;
+
+	/* UDP length may claim less than the IP datagram, never trust more */
+	buf = (const uint8_t *)(udph + 1);
+	end = (const uint8_t *)udph + be16toh(udph->len);
+	if ( end > pkt->pkt_end )
+		end = pkt->pkt_end;
+	if ( end < buf )
+		end = buf;
+
+	s->app->a_datagram(s,
+			(to_server) ? UDP_CHAN_TO_SERVER : UDP_CHAN_TO_CLIENT,
+			pkt, buf, end - buf);
+}
+
+/* ICMP: Unreachables and TTL expiry in reply to a datagram end the flow,
+ * it's either closed or a traceroute probe. There's no sequence number to
+ * check so the quoted addresses and ports have to do.
+ */
+void _udpflow_icmp_error(struct udpflow *uf, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct icmp_dcb *dcb = (struct icmp_dcb *)dcb_ptr;
+	const struct pkt_icmphdr *icmph = dcb->icmp_hdr;
+	const struct pkt_iphdr *iph = dcb->icmp_inner;
+	const struct pkt_udphdr *udph;
+	struct udp_session *s;
+	unsigned int to_server;
+	uint32_t tunnel, vlan;
+	uint16_t bucket;
+
+	switch(icmph->type) {
+	case ICMP_DEST_UNREACH:
+		if ( icmph->code == ICMP_FRAG_NEEDED )
+			return;
+		break;
+	case ICMP_TIME_EXCEEDED:
+		break;
+	default:
+		return;
+	}
+
+	udph = (const struct pkt_udphdr *)((const uint8_t *)iph +
+						(iph->ihl << 2));
+	tunnel = (tunnel_key) ? pkt->pkt_tunnel : 0;
+	vlan = (vlan_key) ? pkt->pkt_vlan : 0;
+	bucket = udp_hashfn(iph->saddr, iph->daddr,
+				udph->sport, udph->dport,
+				tunnel, vlan);
+
+	s = udp_collide(uf->hash[bucket], iph, udph, tunnel, vlan,
+			&to_server);
+	if ( NULL == s )
+		return;
+
+	udp_free(uf, s, FLOW_END_EOF);
+	uf->num_icmp++;
+}
+
+struct udpflow *_udpflow_ctor(void)
+{
+	struct udpflow *uf;
+
+	uf = calloc(1, sizeof(*uf));
+	if ( NULL == uf )
+		return NULL;
+
+	INIT_LIST_HEAD(&uf->tmo);
+
+	uf->pool = mempool_new_private("udpflow", FLOW_UDP_CHUNKS);
+	if ( NULL == uf->pool )
+		goto err;
+
+	uf->session_cache = objcache_init(uf->pool, "udp_session",
+					sizeof(struct udp_session));
+	if ( NULL == uf->session_cache )
+		goto err_pool;
+
+	uf->apps = _udp_app_ctor(uf->pool);
+	if ( NULL == uf->apps )
+		goto err_pool;
+
+	uf->exporter = flow_exporter_new();
+	if ( NULL == uf->exporter )
+		goto err_apps;
+
+	return uf;
+err_apps:
+	_udp_app_dtor(uf->apps);
+err_pool:
+	mempool_free(uf->pool);
+err:
+	free(uf);
+	return NULL;
+}
+
+void _udpflow_dtor(struct udpflow *uf)
+{
+	struct udp_session *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, &uf->tmo, tmo)
+		udp_free(uf, s, FLOW_END_FORCED);
+
+	mesg(M_INFO, "udpflow: max_active=%u num_active=%u, %u app sessions",
+		uf->max_active, uf->num_active, uf->num_app);
+	mesg(M_INFO, "udpflow: %u datagrams, %u timeouts, %u oom, "
+		"%u ended by ICMP", uf->num_datagrams, uf->num_timeouts,
+		uf->num_oom, uf->num_icmp);
+	_udp_app_dtor(uf->apps);
+	flow_exporter_free(uf->exporter);
+	mempool_free(uf->pool);
+	free(uf);
+}
@@ -0,0 +1,321 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * IPFIX file writer for flow records (RFC 7011 message format, as per the
+ * RFC 5655 file format). Each message carries its own template set so
+ * that a truncated file is still readable up to the last whole message.
+ * Records are biflows (RFC 5103), forward counters are from the flow
+ * initiator. Messages are batched and written out when full, when the
+ * oldest record in them is flush_interval old by the capture clock, or at
+ * shutdown.
+ *
+ * Every flow tracker instance has an exporter of its own, with its own
+ * message buffer and sequence number, so pipelines never share one. Each
+ * exporter is a separate observation domain, which is what the sequence
+ * numbers count within. They all write to the one file and only the
+ * write of a finished message is done under a lock.
+*/
+
+#include <firestorm.h>
+#include <f_flow.h>
+#include <f_fdctl.h>
+#include <pkt/ipfix.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* configuration options */
+static const size_t batch_size = 16384;
+static const timestamp_t flush_interval = 10 * TIMESTAMP_HZ;
+static const uint32_t domain_id = 0;
+
+#define IPFIX_TEMPLATE_ID	IPFIX_SET_DATA_MIN
+
+static const struct {
+	uint16_t ie;
+	uint16_t len;
+	uint32_t pen;
+}tmpl[] = {
+	{IPFIX_IE_SRC_IPV4, 4, 0},
+	{IPFIX_IE_DST_IPV4, 4, 0},
+	{IPFIX_IE_SRC_PORT, 2, 0},
+	{IPFIX_IE_DST_PORT, 2, 0},
+	{IPFIX_IE_PROTOCOL, 1, 0},
+	{IPFIX_IE_TCP_FLAGS, 1, 0},
+	{IPFIX_IE_FLOW_END_REASON, 1, 0},
+	{IPFIX_IE_VLAN_ID, 2, 0},
+	{IPFIX_IE_FLOW_START_SECONDS, 4, 0},
+	{IPFIX_IE_FLOW_END_SECONDS, 4, 0},
+	{IPFIX_IE_OCTET_DELTA, 8, 0},
+	{IPFIX_IE_PACKET_DELTA, 4, 0},
+	{IPFIX_IE_OCTET_DELTA, 8, IPFIX_PEN_REVERSE},
+	{IPFIX_IE_PACKET_DELTA, 4, IPFIX_PEN_REVERSE},
+};
+#define NUM_FIELDS (sizeof(tmpl)/sizeof(*tmpl))
+
+struct _flow_exporter {
+	uint8_t *msg;
+	size_t msg_len;
+	size_t data_ofs;
+	unsigned int msg_recs;
+	uint32_t seq;
+	uint32_t domain;
+	timestamp_t msg_start;
+	timestamp_t export_time;
+
+	/* stats */
+	unsigned int num_flows;
+	unsigned int num_msgs;
+	uint64_t num_bytes;
+};
+
+static const char *fn;
+static int fd = -1;
+static int fd_lock;
+static size_t rec_len;
+static uint32_t next_domain = domain_id;
+
+/* totals from exporters that have been freed, under fd_lock */
+static unsigned int num_flows;
+static unsigned int num_msgs;
+static uint64_t num_bytes;
+
+static void lock(void)
+{
+	while ( __sync_lock_test_and_set(&fd_lock, 1) )
+		/* spin */;
+}
+
+static void unlock(void)
+{
+	__sync_lock_release(&fd_lock);
+}
+
+static uint8_t *put8(uint8_t *p, uint8_t v)
+{
+	*p = v;
+	return p + 1;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+	v = htobe16(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+/* Message header and template set, then open the data set */
+static void msg_begin(flow_exporter_t fx)
+{
+	uint8_t *p, *set;
+	unsigned int i;
+
+	p = fx->msg + sizeof(struct pkt_ipfixhdr);
+
+	set = p;
+	p += sizeof(struct pkt_ipfixset);
+	p = put16(p, IPFIX_TEMPLATE_ID);
+	p = put16(p, NUM_FIELDS);
+	for(i = 0; i < NUM_FIELDS; i++) {
+		if ( tmpl[i].pen ) {
+			p = put16(p, tmpl[i].ie | IPFIX_IE_ENTERPRISE);
+			p = put16(p, tmpl[i].len);
+			p = put32(p, tmpl[i].pen);
+		}else{
+			p = put16(p, tmpl[i].ie);
+			p = put16(p, tmpl[i].len);
+		}
+	}
+	put16(set, IPFIX_SET_TEMPLATE);
+	put16(set + 2, p - set);
+
+	fx->data_ofs = p - fx->msg;
+	fx->msg_len = fx->data_ofs + sizeof(struct pkt_ipfixset);
+	fx->msg_recs = 0;
+}
+
+static void msg_flush(flow_exporter_t fx)
+{
+	uint8_t *p;
+	int ok;
+
+	if ( 0 == fx->msg_recs )
+		return;
+
+	p = fx->msg;
+	p = put16(p, IPFIX_VERSION);
+	p = put16(p, fx->msg_len);
+	p = put32(p, fx->export_time);
+	p = put32(p, fx->seq);
+	p = put32(p, fx->domain);
+
+	p = fx->msg + fx->data_ofs;
+	p = put16(p, IPFIX_TEMPLATE_ID);
+	p = put16(p, fx->msg_len - fx->data_ofs);
+
+	lock();
+	ok = (fd >= 0 && fd_write(fd, fx->msg, fx->msg_len));
+	if ( !ok && fd >= 0 ) {
+		mesg(M_ERR, "ipfix: %s: write: %s", fn, os_err());
+		fd_close(fd);
+		fd = -1;
+	}
+	unlock();
+
+	if ( ok ) {
+		fx->seq += fx->msg_recs;
+		fx->num_msgs++;
+		fx->num_bytes += fx->msg_len;
+	}
+	msg_begin(fx);
+}
+
+void flow_export(flow_exporter_t fx, const struct flow_rec *fr)
+{
+	const struct flow_acct *fa = fr->fr_acct;
+	uint8_t *p;
+
+	if ( NULL == fx->msg )
+		return;
+
+	p = fx->msg + fx->msg_len;
+	p = put32(p, be32toh(fr->fr_saddr));
+	p = put32(p, be32toh(fr->fr_daddr));
+	p = put16(p, be16toh(fr->fr_sport));
+	p = put16(p, be16toh(fr->fr_dport));
+	p = put8(p, fr->fr_proto);
+	p = put8(p, fa->fa_tcp_flags);
+	p = put8(p, fr->fr_end);
+	p = put16(p, fr->fr_vlan & 0xfff);
+	p = put32(p, fa->fa_first / TIMESTAMP_HZ);
+	p = put32(p, fa->fa_last / TIMESTAMP_HZ);
+	p = put64(p, fa->fa_bytes[FLOW_DIR_FWD]);
+	p = put32(p, fa->fa_pkts[FLOW_DIR_FWD]);
+	p = put64(p, fa->fa_bytes[FLOW_DIR_REV]);
+	p = put32(p, fa->fa_pkts[FLOW_DIR_REV]);
+	assert((size_t)(p - (fx->msg + fx->msg_len)) == rec_len);
+
+	if ( time_after(fa->fa_last, fx->export_time) )
+		fx->export_time = fa->fa_last;
+	if ( 0 == fx->msg_recs )
+		fx->msg_start = fx->export_time;
+
+	fx->msg_len += rec_len;
+	fx->msg_recs++;
+	fx->num_flows++;
+
+	if ( fx->msg_len + rec_len > batch_size )
+		msg_flush(fx);
+}
+
+void flow_export_tick(flow_exporter_t fx, timestamp_t now)
+{
+	if ( likely(!fx->msg_recs) )
+		return;
+	if ( time_before(now, fx->msg_start + flush_interval) )
+		return;
+	if ( time_after(now, fx->export_time) )
+		fx->export_time = now;
+	msg_flush(fx);
+}
+
+/* With export turned off this still hands back an exporter, one that
+ * drops everything, so that NULL only ever means out of memory.
+ */
+flow_exporter_t flow_exporter_new(void)
+{
+	struct _flow_exporter *fx;
+
+	fx = calloc(1, sizeof(*fx));
+	if ( NULL == fx )
+		return NULL;
+
+	if ( fd < 0 )
+		return fx;
+
+	fx->msg = malloc(batch_size);
+	if ( NULL == fx->msg ) {
+		free(fx);
+		return NULL;
+	}
+
+	fx->domain = __sync_fetch_and_add(&next_domain, 1);
+	msg_begin(fx);
+	return fx;
+}
+
+void flow_exporter_free(flow_exporter_t fx)
+{
+	if ( NULL == fx )
+		return;
+
+	if ( fx->msg ) {
+		msg_flush(fx);
+		free(fx->msg);
+	}
+
+	lock();
+	num_flows += fx->num_flows;
+	num_msgs += fx->num_msgs;
+	num_bytes += fx->num_bytes;
+	unlock();
+
+	free(fx);
+}
+
+int _flow_export_ctor(void)
+{
+	unsigned int i;
+
+	fn = getenv("FIRESTORM_IPFIX");
+	if ( NULL == fn || '\0' == *fn )
+		return 1;
+
+	for(rec_len = i = 0; i < NUM_FIELDS; i++)
+		rec_len += tmpl[i].len;
+	next_domain = domain_id;
+	num_flows = num_msgs = 0;
+	num_bytes = 0;
+
+	assert(batch_size <= IPFIX_MAX_MSG);
+	fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if ( fd < 0 ) {
+		mesg(M_ERR, "ipfix: %s: open: %s", fn, os_err());
+		return 0;
+	}
+
+	mesg(M_INFO, "ipfix: exporting flows to %s", fn);
+	return 1;
+}
+
+/* All the exporters must have been freed by now */
+void _flow_export_dtor(void)
+{
+	if ( NULL == fn || '\0' == *fn )
+		return;
+
+	if ( fd >= 0 ) {
+		fd_close(fd);
+		fd = -1;
+	}
+
+	mesg(M_INFO, "ipfix: %u flows in %u messages, %"PRIu64" bytes",
+		num_flows, num_msgs, num_bytes);
+}
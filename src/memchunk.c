@@ -10,6 +10,11 @@
  *  - buffer headers (eg: ip_fragment / tcp_rbuf)
  *  - buffer data: blocks of raw data, some fixed power of 2 size
  *
+ * Pools borrow from the global pool once their reserve runs out. Nothing
+ * here is locked, so pools and caches must be set up and torn down by one
+ * thread at a time, and a pool that's used by one thread while others
+ * run should be private so that it keeps to its reserve.
+ *
  * TODO:
  *  o Analysis printout with fragmentation stats
 */
@@ -163,6 +168,7 @@ int memchunk_init(size_t numchunks)
 	m->m_gpool.p_free = m->m_hdr;
 	m->m_gpool.p_numfree = numchunks;
 	m->m_gpool.p_reserve = numchunks;
+	m->m_gpool.p_private = 0;
 	m->m_gpool.p_label = "_global";
 
 	do_cache_init(&m->m_gpool, &m->m_self_cache, "_objcache",
@@ -195,7 +201,7 @@ static struct chunk_hdr *memchunk_get(mempool_t p)
 {
 	struct chunk_hdr *hdr;
 
-	if ( NULL == p->p_free )
+	if ( NULL == p->p_free && !p->p_private )
 		p = &mc.m_gpool;
 
 	if ( NULL == p->p_free )
@@ -226,7 +232,8 @@ static void memchunk_put(mempool_t p, struct chunk_hdr *hdr)
 	p->p_numfree++;
 }
 
-mempool_t mempool_new(const char *label, size_t numchunks)
+static mempool_t do_mempool_new(const char *label, size_t numchunks,
+					unsigned int private)
 {
 	struct _mempool *p;
 	size_t n = numchunks;
@@ -245,6 +252,7 @@ mempool_t mempool_new(const char *label, size_t numchunks)
 	list_add_tail(&p->p_list, &mc.m_pools);
 	p->p_numfree = numchunks;
 	p->p_reserve = numchunks;
+	p->p_private = private;
 	p->p_free = NULL;
 	p->p_label = label;
 	for(n = 0; n < numchunks; n++) {
@@ -258,6 +266,19 @@ mempool_t mempool_new(const char *label, size_t numchunks)
 	return p;
 }
 
+mempool_t mempool_new(const char *label, size_t numchunks)
+{
+	return do_mempool_new(label, numchunks, 0);
+}
+
+/* Allocations fail once the reserve is used up rather than taking from
+ * the global pool.
+ */
+mempool_t mempool_new_private(const char *label, size_t numchunks)
+{
+	return do_mempool_new(label, numchunks, 1);
+}
+
 void mempool_free(mempool_t p)
 {
 	struct _objcache *o, *tmp;
@@ -476,3 +497,8 @@ void objcache_free2(objcache_t o, void *obj)
 	assert(c->c_o.cache == o);
 	do_cache_free(c->c_o.cache, c, obj);
 }
+
+size_t objcache_size(objcache_t o)
+{
+	return o->o_sz;
+}
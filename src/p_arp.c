@@ -50,8 +50,10 @@ static void arp_decode(struct _pkt *p)
 
 	arp = (const struct pkt_arphdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*arp);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_arp);
 		return;
+	}
 
 	sha = p->pkt_nxthdr;
 	p->pkt_nxthdr += arp->hlen;
@@ -61,8 +63,10 @@ static void arp_decode(struct _pkt *p)
 	p->pkt_nxthdr += arp->hlen;
 	tpa = p->pkt_nxthdr;
 	p->pkt_nxthdr += arp->plen;
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_arp);
 		return;
+	}
 
 	switch(be16toh(arp->op)) {
 	case ARP_OP_REQUEST:
@@ -8,6 +8,7 @@
 #include <f_packet.h>
 #include <f_decode.h>
 #include <pkt/eth.h>
+#include <p_ether.h>
 
 #define DLT_EN10MB 1
 
@@ -17,21 +18,33 @@
 #define dmesg(x...) do{}while(0);
 #endif
 
+static void vlan_decode(struct _pkt *p);
+
 static struct _decoder eth_decoder = {
 	.d_label = "Ethernet",
 	.d_decode = _eth_decode,
 };
 
+static struct _decoder vlan_decoder = {
+	.d_label = "802.1Q",
+	.d_decode = vlan_decode,
+};
+
 static struct _proto p_eth = {
 	.p_label = "ether",
 };
 
 static struct _proto p_llc = {
-	.p_label = "snap",
+	.p_label = "llc",
 };
 
 static struct _proto p_snap = {
-	.p_label = "llc",
+	.p_label = "snap",
+};
+
+static struct _proto p_vlan = {
+	.p_label = "vlan",
+	.p_dcb_sz = sizeof(struct vlan_dcb),
 };
 
 __attribute__((constructor)) static void _ctor(void)
@@ -41,6 +54,12 @@ __attribute__((constructor)) static void _ctor(void)
 	proto_add(&eth_decoder, &p_eth);
 	proto_add(&eth_decoder, &p_llc);
 	proto_add(&eth_decoder, &p_snap);
+
+	decoder_add(&vlan_decoder);
+	decoder_register(&vlan_decoder, NS_ETHER, const_be16(VLAN_TPID_8021Q));
+	decoder_register(&vlan_decoder, NS_ETHER, const_be16(VLAN_TPID_8021AD));
+	decoder_register(&vlan_decoder, NS_ETHER, const_be16(VLAN_TPID_QINQ));
+	proto_add(&vlan_decoder, &p_vlan);
 }
 
 static void snap_decode(struct _pkt *p, const struct pkt_ethhdr *eth,
@@ -52,8 +71,10 @@ static void snap_decode(struct _pkt *p, const struct pkt_ethhdr *eth,
 
 	snap = (const struct pkt_snaphdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*snap);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_snap);
 		return;
+	}
 
 	org = (snap->org[0] << 12) | (snap->org[1] << 8) | snap->org[2];
 	decode_layer(p, &p_snap);
@@ -89,8 +110,10 @@ static void llc_decode(struct _pkt *p, const struct pkt_ethhdr *eth,
 
 	llc = (const struct pkt_llchdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*llc);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_llc);
 		return;
+	}
 
 	if ( llc->dsap == 0xaa &&
 		llc->lsap == 0xaa && llc->ctrl == 0x3 ) {
@@ -110,25 +133,67 @@ static void llc_decode(struct _pkt *p, const struct pkt_ethhdr *eth,
 	}
 }
 
-static void vlan_decode(struct _pkt *p, const struct pkt_ethhdr *eth)
+/* Rotate rather than shift so that outer tags are never pushed out of the
+ * key, every bit of every tag stays folded in somewhere.
+ */
+static uint32_t vlan_fold(uint32_t key, unsigned int bits, uint32_t vid)
 {
-	const struct pkt_vlanhdr *vlan;
+	return ((key << bits) | (key >> (32 - bits))) ^ vid;
+}
+
+/* 802.1ad service tags and 802.1Q customer tags, stacked arbitrarily deep */
+static void vlan_decode(struct _pkt *p)
+{
+	const struct pkt_vlanhdr *outer, *vlan;
+	uint16_t vid[VLAN_MAX_TAGS];
+	unsigned int i, num = 0;
+	struct vlan_dcb *dcb;
+	uint32_t stack = 0;
 	uint16_t proto;
 
-	vlan = (const struct pkt_vlanhdr *)p->pkt_nxthdr;
-	p->pkt_nxthdr += sizeof(*vlan);
-	if ( p->pkt_nxthdr > p->pkt_end )
-		return;
+	outer = (const struct pkt_vlanhdr *)p->pkt_nxthdr;
+
+	do {
+		vlan = (const struct pkt_vlanhdr *)p->pkt_nxthdr;
+		p->pkt_nxthdr += sizeof(*vlan);
+		if ( p->pkt_nxthdr > p->pkt_end ) {
+			decode_truncated(p, &p_vlan);
+			return;
+		}
+
+		if ( num < VLAN_MAX_TAGS )
+			vid[num] = be16toh(vlan->vlan) & VLAN_ID;
+		stack = vlan_fold(stack, 12, be16toh(vlan->vlan) & VLAN_ID);
+		num++;
+
+		proto = be16toh(vlan->proto);
+	}while( proto == VLAN_TPID_8021Q ||
+		proto == VLAN_TPID_8021AD ||
+		proto == VLAN_TPID_QINQ );
+
+	dmesg(M_DEBUG, "802.1q %u tags, proto = 0x%.4x", num, proto);
+
+	dcb = (struct vlan_dcb *)decode_layer(p, &p_vlan);
+	if ( dcb ) {
+		dcb->vlan_hdr = outer;
+		dcb->vlan_num = (num < VLAN_MAX_TAGS) ? num : VLAN_MAX_TAGS;
+		for(i = 0; i < dcb->vlan_num; i++)
+			dcb->vlan_id[i] = vid[i];
+	}
+
+	/* The innermost two tags are kept exactly, each one further out is
+	 * rotated in on top, so stacks that differ only in their outer tags
+	 * still get different keys. Tunnelled frames fold in on top of the
+	 * outer frame's tags the same way.
+	 */
+	p->pkt_vlan = vlan_fold(p->pkt_vlan, 24, stack);
 
-	proto = be16toh(vlan->proto);
 	/* protocols can still be lengths with 802.1q */
 	switch(proto) {
 	case 0 ... 1500:
-		llc_decode(p, eth, vlan);
+		llc_decode(p, NULL, vlan);
 		return;
 	default:
-		dmesg(M_DEBUG, "802.1q proto = 0x%.4x", proto);
-		decode_layer(p, &p_eth);
 		decode_next(p, NS_ETHER, vlan->proto);
 		break;
 	}
@@ -141,8 +206,10 @@ void _eth_decode(struct _pkt *p)
 
 	eth = (const struct pkt_ethhdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*eth);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_eth);
 		return;
+	}
 
 	proto = be16toh(eth->proto);
 
@@ -151,9 +218,6 @@ void _eth_decode(struct _pkt *p)
 	case 0 ... 1500:
 		llc_decode(p, eth, NULL);
 		break;
-	case 0x8100:
-		vlan_decode(p, eth);
-		break;
 	default:
 		dmesg(M_DEBUG, "ethernet II - 0x%.4x", proto);
 		decode_layer(p, &p_eth);
@@ -14,6 +14,8 @@
 #include <pkt/udp.h>
 #include <p_ipv4.h>
 #include <p_tcp.h>
+#include <csum.h>
+#include <f_flow.h>
 
 #include "tcpip.h"
 
@@ -33,31 +35,178 @@ static void ipv4_decode(struct _pkt *p);
 static void ah_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 			const struct pkt_ahhdr *bogus);
 
-static int flow_track_ctor(void)
+/* Every tracker is per-pipeline, with its own private chunk pool and flow
+ * exporter, see struct ipv4_flow. All that's shared between pipelines is
+ * the IPFIX output file and the TCP policy table, set up along with the
+ * first pipeline. Pipelines can come and go from any thread, so setup and
+ * teardown are done under a lock, which also keeps the memchunk global
+ * pool to one thread at a time while the caches are made.
+ */
+static int shared_lock;
+static unsigned int shared_refs;
+
+static void lock(void)
 {
-	if ( !_ipdefrag_ctor() )
+	while ( __sync_lock_test_and_set(&shared_lock, 1) )
+		/* spin */;
+}
+
+static void unlock(void)
+{
+	__sync_lock_release(&shared_lock);
+}
+
+static int shared_ctor(void)
+{
+	if ( shared_refs++ )
+		return 1;
+
+	if ( !_flow_export_ctor() )
 		goto err;
-	if ( !_tcpflow_ctor() )
-		goto err_free_ipfrag;
+	if ( !_tcp_policy_ctor() )
+		goto err_free_export;
 
 	return 1;
 
-err_free_ipfrag:
-	_ipdefrag_dtor();
+err_free_export:
+	_flow_export_dtor();
 err:
+	shared_refs--;
 	return 0;
 }
 
-static void flow_track_dtor(void)
+static void shared_dtor(void)
+{
+	if ( --shared_refs )
+		return;
+
+	_tcp_policy_dtor();
+	_flow_export_dtor();
+}
+
+/* Tears down whichever trackers got made */
+static void trackers_dtor(struct ipv4_flow *f)
 {
-	_ipdefrag_dtor();
-	_tcpflow_dtor();
+	if ( f->tcp )
+		_tcpflow_dtor(f->tcp);
+	if ( f->frag )
+		_ipdefrag_dtor(f->frag);
+	if ( f->udp )
+		_udpflow_dtor(f->udp);
+	if ( f->ip )
+		_ipflow_dtor(f->ip);
+}
+
+static void *flow_track_ctor(void)
+{
+	struct ipv4_flow *f;
+
+	f = calloc(1, sizeof(*f));
+	if ( NULL == f )
+		return NULL;
+
+	lock();
+	if ( !shared_ctor() )
+		goto err;
+
+	f->frag = _ipdefrag_ctor();
+	if ( NULL == f->frag )
+		goto err_trackers;
+	f->udp = _udpflow_ctor();
+	if ( NULL == f->udp )
+		goto err_trackers;
+	f->ip = _ipflow_ctor();
+	if ( NULL == f->ip )
+		goto err_trackers;
+	f->tcp = _tcpflow_ctor();
+	if ( NULL == f->tcp )
+		goto err_trackers;
+
+	unlock();
+	return f;
+
+err_trackers:
+	trackers_dtor(f);
+	shared_dtor();
+err:
+	unlock();
+	free(f);
+	return NULL;
+}
+
+static void flow_track_dtor(void *flow)
+{
+	lock();
+	trackers_dtor(flow);
+	shared_dtor();
+	unlock();
+	free(flow);
+}
+
+static void frag_flowtrack(void *flow, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct ipv4_flow *f = flow;
+	_ipdefrag_track(f->frag, pkt, dcb_ptr);
+}
+
+static void tcp_flowtrack(void *flow, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct ipv4_flow *f = flow;
+	_tcpflow_track(f->tcp, pkt, dcb_ptr);
+}
+
+static void tcp_flowprefetch(void *flow, pkt_t pkt, dcb_t dcb_ptr,
+				unsigned int pass)
+{
+	struct ipv4_flow *f = flow;
+	_tcpflow_prefetch(f->tcp, pkt, dcb_ptr, pass);
+}
+
+static void udp_flowtrack(void *flow, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct ipv4_flow *f = flow;
+	_udpflow_track(f->udp, pkt, dcb_ptr);
+}
+
+/* ICMP gets flow accounting of its own, and errors are passed on to the
+ * tracker for the session they quote. Only if it's all there though, and
+ * the error is going back to whoever sent the datagram.
+ */
+static void icmp_flowtrack(void *flow, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct icmp_dcb *dcb = (struct icmp_dcb *)dcb_ptr;
+	const struct pkt_iphdr *inner = dcb->icmp_inner;
+	struct ipv4_flow *f = flow;
+	const uint8_t *l4;
+
+	_ipflow_icmp_track(f->ip, pkt, dcb_ptr);
+
+	if ( NULL == inner )
+		return;
+	if ( inner->saddr != dcb->icmp_iph->daddr )
+		return;
+	if ( inner->frag_off & const_be16(IP_OFFMASK) )
+		return;
+
+	/* every error quotes at least 8 bytes past the IP header */
+	l4 = (const uint8_t *)inner + (inner->ihl << 2);
+	if ( l4 + 8 > pkt->pkt_end )
+		return;
+
+	switch(inner->protocol) {
+	case IP_PROTO_TCP:
+		_tcpflow_icmp_error(f->tcp, pkt, dcb_ptr);
+		break;
+	case IP_PROTO_UDP:
+		_udpflow_icmp_error(f->udp, pkt, dcb_ptr);
+		break;
+	}
 }
 
 static struct _proto p_fragment = {
 	.p_label = "ipfrag",
 	.p_dcb_sz = sizeof(struct ipfrag_dcb),
-	.p_flowtrack = _ipdefrag_track,
+	.p_flowtrack = frag_flowtrack,
 };
 
 static struct _proto p_ipraw = {
@@ -73,6 +222,7 @@ static struct _proto p_tunnel = {
 static struct _proto p_icmp = {
 	.p_label = "icmp",
 	.p_dcb_sz = sizeof(struct icmp_dcb),
+	.p_flowtrack = icmp_flowtrack,
 };
 
 static struct _proto p_igmp = {
@@ -94,7 +244,8 @@ static struct _proto p_esp = {
 static struct _proto p_tcp = {
 	.p_label = "tcp",
 	.p_dcb_sz = sizeof(struct tcp_dcb),
-	.p_flowtrack = _tcpflow_track,
+	.p_flowtrack = tcp_flowtrack,
+	.p_flowprefetch = tcp_flowprefetch,
 };
 
 struct _proto _p_tcpstream = {
@@ -105,6 +256,7 @@ struct _proto _p_tcpstream = {
 static struct _proto p_udp = {
 	.p_label = "udp",
 	.p_dcb_sz = sizeof(struct udp_dcb),
+	.p_flowtrack = udp_flowtrack,
 };
 
 struct _decoder _ipv4_decoder = {
@@ -119,6 +271,8 @@ static void __attribute__((constructor)) _ctor(void)
 	decoder_add(&_ipv4_decoder);
 	decoder_register(&_ipv4_decoder, NS_ETHER, const_be16(0x0800));
 	decoder_register(&_ipv4_decoder, NS_UNIXPF, 2);
+	decoder_register(&_ipv4_decoder, NS_INET, IP_PROTO_IPIP);
+	decoder_register(&_ipv4_decoder, NS_INET6, IP_PROTO_IPIP);
 	proto_add(&_ipv4_decoder, &p_fragment);
 	proto_add(&_ipv4_decoder, &p_tunnel);
 	proto_add(&_ipv4_decoder, &p_ipraw);
@@ -141,20 +295,7 @@ void iptostr(ipstr_t str, uint32_t ip)
 
 uint16_t _ip_csum(const struct pkt_iphdr *iph)
 {
-	uint16_t *tmp = (uint16_t *)iph;
-	uint32_t sum = 0;
-	int i;
-
-	for(i=0; i < (iph->ihl << 1); i++) {
-		sum += tmp[i];
-		if(sum & 0x80000000)
-			sum = (sum & 0xffff) + (sum >> 16);
-	}
-
-	while(sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
-
-	return ~sum & 0xffff;
+	return csum_fold(csum_block((const uint8_t *)iph, iph->ihl << 2));
 }
 
 static void raw_decode(struct _pkt *p, const struct pkt_iphdr *iph,
@@ -174,6 +315,9 @@ static void tunnel_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 			const struct pkt_ahhdr *ah)
 {
 	struct ip_dcb *dcb;
+	uint8_t proto;
+
+	proto = (ah) ? ah->protocol : iph->protocol;
 
 	dcb = (struct ip_dcb *)decode_layer(p, &p_tunnel);
 	if ( dcb ) {
@@ -181,8 +325,11 @@ static void tunnel_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 		dcb->ip_ah = ah;
 	}
 
-	dmesg(M_INFO, "ipv4: tunnel");
-	ipv4_decode(p);
+	/* IPIP, IPv6-in-IPv4 and GRE payloads are all decoded by whoever
+	 * registered for the protocol in the INET namespace
+	 */
+	dmesg(M_INFO, "ipv4: tunnel proto=%u", proto);
+	decode_next(p, NS_INET, proto);
 }
 
 static const struct pkt_iphdr *icmp_try_inner(struct _pkt *p,
@@ -221,8 +368,10 @@ static void icmp_decode(struct _pkt *p, const struct pkt_iphdr *outer,
 
 	icmph = (const struct pkt_icmphdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*icmph);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_icmp);
 		return;
+	}
 
 	dmesg(M_DEBUG, "ipv4: tcp type=%u code=%u",
 		icmph->type, icmph->code);
@@ -242,7 +391,7 @@ static void icmp_decode(struct _pkt *p, const struct pkt_iphdr *outer,
 	if ( dcb == NULL )
 		return;
 
-	dcb->icmp_iph = iph;
+	dcb->icmp_iph = outer;
 	dcb->icmp_ah = ah;
 	dcb->icmp_hdr = icmph;
 	dcb->icmp_inner = iph;
@@ -254,13 +403,24 @@ static void tcp_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 	const struct pkt_tcphdr *tcph;
 	struct tcp_dcb *dcb;
 
-	if ( p->pkt_nxthdr + sizeof(*tcph) > p->pkt_end )
+	if ( p->pkt_nxthdr + sizeof(*tcph) > p->pkt_end ) {
+		decode_truncated(p, &p_tcp);
 		return;
+	}
 
 	tcph = (const struct pkt_tcphdr *)p->pkt_nxthdr;
+	if ( tcph->doff < 5 ) {
+		decode_malformed(p, &p_tcp);
+		mesg(M_WARN, "ipv4: tcp header length %u < %zu",
+			tcph->doff << 2, sizeof(*tcph));
+		return;
+	}
+
 	p->pkt_nxthdr += tcph->doff << 2;
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_tcp);
 		return;
+	}
 
 	dmesg(M_DEBUG, "ipv4: tcp %u -> %u",
 		be16toh(tcph->sport), be16toh(tcph->dport));
@@ -281,8 +441,10 @@ static void udp_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 
 	udph = (const struct pkt_udphdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*udph);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_udp);
 		return;
+	}
 
 	dmesg(M_DEBUG, "ipv4: udp %u -> %u",
 		be16toh(udph->sport), be16toh(udph->dport));
@@ -291,8 +453,10 @@ static void udp_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 	if ( dcb ) {
 		dcb->udp_iph = iph;
 		dcb->udp_ah = ah;
-		dcb->udp_hdr = (void *)p->pkt_nxthdr;
+		dcb->udp_hdr = udph;
 	}
+
+	decode_next(p, NS_UDP, udph->dport);
 }
 
 static void esp_decode(struct _pkt *p, const struct pkt_iphdr *iph,
@@ -302,8 +466,10 @@ static void esp_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 
 	esp = (const struct pkt_esphdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*esp);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_esp);
 		return;
+	}
 
 	dmesg(M_DEBUG, "ipv4: ESP spi=0x%.8x", be32toh(esp->spi));
 	decode_layer(p, &p_esp);
@@ -329,6 +495,8 @@ static const uint8_t pmap[0x100] = {
 	[IP_PROTO_ICMP] 1,
 	[IP_PROTO_IGMP] 0,
 	[IP_PROTO_IPIP] 3,
+	[IP_PROTO_IPV6] 3,
+	[IP_PROTO_GRE] 3,
 	[IP_PROTO_TCP] 4,
 	[IP_PROTO_UDP] 5,
 	[IP_PROTO_DCCP] 0,
@@ -349,10 +517,13 @@ static void ah_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 
 	ah = (struct pkt_ahhdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*ah);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_ipraw);
 		return;
+	}
 
 	if ( ah->ahl < 4 ) {
+		decode_malformed(p, &p_ipraw);
 		mesg(M_WARN, "ipv4(ah): header length %u < %zu",
 			ah->ahl << 2, sizeof(*ah));
 		return;
@@ -360,6 +531,7 @@ static void ah_decode(struct _pkt *p, const struct pkt_iphdr *iph,
 
 	p->pkt_nxthdr += (ah->ahl << 2) - 2;
 	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_ipraw);
 		mesg(M_WARN, "ipv4(ah): Truncated AH packet");
 		return;
 	}
@@ -376,31 +548,46 @@ static void ipv4_decode(struct _pkt *p)
 
 	iph = (struct pkt_iphdr *)p->pkt_nxthdr;
 
-	if ( p->pkt_nxthdr + sizeof(*iph) > p->pkt_end )
+	if ( p->pkt_nxthdr + sizeof(*iph) > p->pkt_end ) {
+		decode_truncated(p, &p_ipraw);
 		return;
+	}
 
 	if ( iph->ihl < 5 ) {
+		decode_malformed(p, &p_ipraw);
 		mesg(M_WARN, "ipv4: header length %u < %zu",
 			iph->ihl << 2, sizeof(*iph));
 		return;
 	}
 
 	if ( iph->version != 4 ) {
+		decode_malformed(p, &p_ipraw);
 		mesg(M_WARN, "ipv4: bad version %u != 4", iph->version);
 		return;
 	}
 
 	p->pkt_nxthdr += (iph->ihl << 2);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_ipraw);
 		return;
+	}
 
 	len = be16toh(iph->tot_len);
-	if ( p->pkt_nxthdr > p->pkt_end ) {
+	if ( len < (iph->ihl << 2) ) {
+		decode_malformed(p, &p_ipraw);
+		mesg(M_WARN, "ipv4: total length %u < header length %u",
+			len, iph->ihl << 2);
+		return;
+	}
+
+	if ( (const uint8_t *)iph + len > p->pkt_end ) {
+		decode_truncated(p, &p_ipraw);
 		mesg(M_WARN, "ipv4: truncated IP packet");
 		return;
 	}
 
 	if ( _ip_csum(iph) ) {
+		decode_malformed(p, &p_ipraw);
 		mesg(M_WARN, "ipv4: bad checksum");
 		return;
 	}
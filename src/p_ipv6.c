@@ -9,52 +9,174 @@
 #include <f_packet.h>
 #include <f_decode.h>
 #include <pkt/ipv6.h>
+#include <p_ipv6.h>
+
+#include "tcpip.h"
+
+#if 0
+#define dmesg mesg
+#else
+#define dmesg(x...) do{}while(0);
+#endif
 
 static void ipv6_decode(struct _pkt *p);
 
-static struct _decoder decoder = {
-	.d_label = "IPv4",
+static struct _proto p_ipv6 = {
+	.p_label = "ipv6",
+	.p_dcb_sz = sizeof(struct ip6_dcb),
+};
+
+/* Fragments share the IPv4 defragmentation engine, and each pipeline's
+ * instance of it lives in the IPv4 decoder's flow state. So this proto
+ * belongs to that decoder, for flow tracking at least.
+ */
+static void frag_flowtrack(void *flow, pkt_t pkt, dcb_t dcb_ptr)
+{
+	struct ipv4_flow *f = flow;
+	_ip6defrag_track(f->frag, pkt, dcb_ptr);
+}
+
+static struct _proto p_fragment = {
+	.p_label = "ip6frag",
+	.p_dcb_sz = sizeof(struct ip6frag_dcb),
+	.p_flowtrack = frag_flowtrack,
+};
+
+struct _decoder _ipv6_decoder = {
+	.d_label = "IPv6",
 	.d_decode = ipv6_decode,
 };
 
 static void __attribute__((constructor)) _ctor(void)
 {
-	decoder_add(&decoder);
-	decoder_register(&decoder, NS_ETHER, const_be16(0x86dd));
-	decoder_register(&decoder, NS_UNIXPF, 28);
+	decoder_add(&_ipv6_decoder);
+	decoder_register(&_ipv6_decoder, NS_ETHER, const_be16(0x86dd));
+	decoder_register(&_ipv6_decoder, NS_UNIXPF, 28);
+	decoder_register(&_ipv6_decoder, NS_INET, IP6_PROTO_IPV6);
+	decoder_register(&_ipv6_decoder, NS_INET6, IP6_PROTO_IPV6);
+	proto_add(&_ipv6_decoder, &p_ipv6);
+	proto_add(&_ipv4_decoder, &p_fragment);
+}
+
+/* Returns 1 if the fragment header was atomic and decoding should carry on
+ * with the next header, 0 if the packet was queued for reassembly.
+ */
+static int frag_decode(struct _pkt *p, const struct pkt_ip6hdr *iph,
+			unsigned int nhoff, const uint8_t *end)
+{
+	const struct pkt_ip6frag *fh;
+	struct ip6frag_dcb *dcb;
+
+	fh = (const struct pkt_ip6frag *)p->pkt_nxthdr;
+	p->pkt_nxthdr += sizeof(*fh);
+	if ( p->pkt_nxthdr > end ) {
+		decode_malformed(p, &p_fragment);
+		mesg(M_WARN, "ipv6: truncated fragment header");
+		return 0;
+	}
+
+	/* RFC6946: atomic fragments are processed in isolation */
+	if ( 0 == (fh->ip6f_offlg & const_be16(IP6_OFFMASK|IP6_MF)) ) {
+		dmesg(M_DEBUG, "ipv6: atomic fragment id=0x%.8x",
+			be32toh(fh->ip6f_ident));
+		return 1;
+	}
+
+	dmesg(M_DEBUG, "ipv6: fragment id=0x%.8x off=%u%s",
+		be32toh(fh->ip6f_ident),
+		be16toh(fh->ip6f_offlg) & IP6_OFFMASK,
+		(fh->ip6f_offlg & const_be16(IP6_MF)) ? " MF" : "");
+
+	dcb = (struct ip6frag_dcb *)decode_layer(p, &p_fragment);
+	if ( dcb ) {
+		dcb->ip6_iph = iph;
+		dcb->ip6_frag = fh;
+		dcb->ip6_nhoff = nhoff;
+	}
+
+	return 0;
 }
 
 static void ipv6_decode(struct _pkt *p)
 {
-	struct pkt_ip6hdr *iph;
-	uint16_t len;
+	const struct pkt_ip6hdr *iph;
+	const struct pkt_ip6ext *ext;
+	const uint8_t *end;
+	struct ip6_dcb *dcb;
+	unsigned int nhoff;
+	uint8_t nxt;
 
-	iph = (struct pkt_ip6hdr *)p->pkt_nxthdr;
+	iph = (const struct pkt_ip6hdr *)p->pkt_nxthdr;
+	if ( p->pkt_nxthdr + sizeof(*iph) > p->pkt_end ) {
+		decode_truncated(p, &p_ipv6);
+		return;
+	}
 
-	p->pkt_nxthdr += sizeof(*iph);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( (be32toh(iph->ip6_flowlabel) >> 28) != 6 ) {
+		decode_malformed(p, &p_ipv6);
+		mesg(M_WARN, "ipv6: bad version %u != 6",
+			be32toh(iph->ip6_flowlabel) >> 28);
 		return;
+	}
 
-	len = be16toh(iph->ip6_plen);
-	p->pkt_nxthdr += len;
-	if ( p->pkt_nxthdr > p->pkt_end ) {
-		mesg(M_WARN, "truncated IP packet");
+	end = p->pkt_nxthdr + sizeof(*iph) + be16toh(iph->ip6_plen);
+	if ( end > p->pkt_end ) {
+		decode_truncated(p, &p_ipv6);
+		mesg(M_WARN, "ipv6: truncated IP packet");
 		return;
 	}
 
-	switch(iph->ip6_proto) {
-	case IP6_PROTO_HOPBYHOP:
-		break;
-	case IP6_PROTO_TCP:
-		break;
-	case IP6_PROTO_UDP:
-		break;
-	case IP6_PROTO_ICMP:
-		break;
-	case IP6_PROTO_PIM:
+	p->pkt_nxthdr += sizeof(*iph);
+	nhoff = offsetof(struct pkt_ip6hdr, ip6_proto);
+	nxt = iph->ip6_proto;
+
+	/* Walk the extension header chain */
+	for(;;) {
+		switch(nxt) {
+		case IP6_PROTO_HOPBYHOP:
+		case IP6_PROTO_ROUTING:
+		case IP6_PROTO_DSTOPTS:
+			ext = (const struct pkt_ip6ext *)p->pkt_nxthdr;
+			if ( p->pkt_nxthdr + sizeof(*ext) > end ) {
+				decode_malformed(p, &p_ipv6);
+				mesg(M_WARN, "ipv6: truncated extension header");
+				return;
+			}
+			nhoff = p->pkt_nxthdr - (const uint8_t *)iph;
+			nxt = ext->ip6e_nxt;
+			p->pkt_nxthdr += (ext->ip6e_len + 1) << 3;
+			if ( p->pkt_nxthdr > end ) {
+				decode_malformed(p, &p_ipv6);
+				mesg(M_WARN, "ipv6: truncated extension header");
+				return;
+			}
+			continue;
+		case IP6_PROTO_FRAGMENT:
+			if ( !frag_decode(p, iph, nhoff, end) ) {
+				p->pkt_nxthdr = end;
+				return;
+			}
+			ext = (const struct pkt_ip6ext *)(p->pkt_nxthdr -
+					sizeof(struct pkt_ip6frag));
+			nhoff = (const uint8_t *)ext - (const uint8_t *)iph;
+			nxt = ext->ip6e_nxt;
+			continue;
+		default:
+			break;
+		}
 		break;
-	default:
-		mesg(M_DEBUG, "IPv6 proto = 0x%.2x, len = %u",
-			iph->ip6_proto, len);
 	}
+
+	dmesg(M_DEBUG, "ipv6: proto = 0x%.2x, len = %u",
+		nxt, be16toh(iph->ip6_plen));
+
+	dcb = (struct ip6_dcb *)decode_layer(p, &p_ipv6);
+	if ( dcb ) {
+		dcb->ip6_iph = iph;
+		dcb->ip6_proto = nxt;
+	}
+
+	/* tunnelled payloads go to whoever registered for the protocol */
+	decode_next(p, NS_INET6, nxt);
+	p->pkt_nxthdr = end;
 }
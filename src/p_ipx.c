@@ -31,8 +31,10 @@ void _ipx_decode(struct _pkt *p)
 
 	ipxh = (const struct pkt_ipxhdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*ipxh);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_ipx);
 		return;
+	}
 
 	decode_layer(p, &p_ipx);
 	decode_next(p, NS_IPX, ipxh->type);
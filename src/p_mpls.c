@@ -0,0 +1,109 @@
+/*
+ * This file is part of Firestorm NIDS
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * This program is released under the terms of the GNU GPL version 3
+*/
+
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <pkt/eth.h>
+#include <pkt/mpls.h>
+#include <p_ether.h>
+
+#if 0
+#define dmesg mesg
+#else
+#define dmesg(x...) do{}while(0);
+#endif
+
+static void mpls_decode(struct _pkt *p);
+
+static struct _decoder mpls_decoder = {
+	.d_label = "MPLS",
+	.d_decode = mpls_decode,
+};
+
+static struct _proto p_mpls = {
+	.p_label = "mpls",
+	.p_dcb_sz = sizeof(struct mpls_dcb),
+};
+
+static void __attribute__((constructor)) _ctor(void)
+{
+	decoder_add(&mpls_decoder);
+	decoder_register(&mpls_decoder, NS_ETHER, const_be16(ETHER_MPLS_UC));
+	decoder_register(&mpls_decoder, NS_ETHER, const_be16(ETHER_MPLS_MC));
+	proto_add(&mpls_decoder, &p_mpls);
+}
+
+static void mpls_decode(struct _pkt *p)
+{
+	const struct pkt_mplshdr *top, *mpls;
+	uint32_t label[MPLS_MAX_LABELS];
+	unsigned int i, num = 0;
+	struct mpls_dcb *dcb;
+	uint32_t lse;
+
+	top = (const struct pkt_mplshdr *)p->pkt_nxthdr;
+
+	do {
+		mpls = (const struct pkt_mplshdr *)p->pkt_nxthdr;
+		p->pkt_nxthdr += sizeof(*mpls);
+		if ( p->pkt_nxthdr > p->pkt_end ) {
+			decode_truncated(p, &p_mpls);
+			return;
+		}
+
+		lse = be32toh(mpls->lbl_tc_s_ttl);
+		if ( num < MPLS_MAX_LABELS )
+			label[num] = MPLS_LABEL(lse);
+		num++;
+	}while( !(lse & MPLS_BOS) );
+
+	dmesg(M_DEBUG, "mpls: %u labels, bottom = %u", num, MPLS_LABEL(lse));
+
+	dcb = (struct mpls_dcb *)decode_layer(p, &p_mpls);
+	if ( dcb ) {
+		dcb->mpls_hdr = top;
+		dcb->mpls_num = (num < MPLS_MAX_LABELS) ? num : MPLS_MAX_LABELS;
+		for(i = 0; i < dcb->mpls_num; i++)
+			dcb->mpls_label[i] = label[i];
+	}
+
+	/* explicit null labels say what's underneath */
+	switch(MPLS_LABEL(lse)) {
+	case MPLS_LABEL_IPV4_NULL:
+		decode_next(p, NS_ETHER, const_be16(0x0800));
+		return;
+	case MPLS_LABEL_IPV6_NULL:
+		decode_next(p, NS_ETHER, const_be16(0x86dd));
+		return;
+	default:
+		break;
+	}
+
+	if ( p->pkt_nxthdr >= p->pkt_end ) {
+		decode_truncated(p, &p_mpls);
+		return;
+	}
+
+	/* Otherwise the payload type is implied by the LSP, so guess from
+	 * the first nibble. Ethernet pseudowires (RFC4448) should carry a
+	 * control word, which starts with a zero nibble.
+	 */
+	switch(*p->pkt_nxthdr >> 4) {
+	case 4:
+		decode_next(p, NS_ETHER, const_be16(0x0800));
+		break;
+	case 6:
+		decode_next(p, NS_ETHER, const_be16(0x86dd));
+		break;
+	case 0:
+		p->pkt_nxthdr += sizeof(uint32_t);
+		/* fall through */
+	default:
+		_eth_decode(p);
+		break;
+	}
+}
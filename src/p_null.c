@@ -36,8 +36,10 @@ static void null_decode(struct _pkt *p)
 	null = (uint32_t *)p->pkt_nxthdr;
 
 	p->pkt_nxthdr += sizeof(*null);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_null);
 		return;
+	}
 
 	proto = source_h32(p->pkt_source, *null);
 	decode_layer(p, &p_null);
@@ -38,8 +38,10 @@ static void sll_decode(struct _pkt *p)
 
 	sll = (const struct pkt_sllhdr *)p->pkt_nxthdr;
 	p->pkt_nxthdr += sizeof(*sll);
-	if ( p->pkt_nxthdr > p->pkt_end )
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_sll);
 		return;
+	}
 
 	proto = sll->sll_protocol;
 
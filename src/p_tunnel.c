@@ -0,0 +1,228 @@
+/*
+ * This file is part of Firestorm NIDS
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * This program is released under the terms of the GNU GPL version 3
+ *
+ * Encapsulation protocols: GRE (incl. transparent ethernet bridging and
+ * ERSPAN) and VXLAN. Inner frames are handed back to the regular decoders
+ * so that inner-layer DCBs follow the outer ones on the layer stack. The
+ * tunnel id is stashed in pkt_tunnel so flow trackers can keep overlapping
+ * tenant address spaces apart.
+*/
+
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <pkt/eth.h>
+#include <pkt/ip.h>
+#include <pkt/gre.h>
+#include <pkt/vxlan.h>
+#include <p_tunnel.h>
+
+#if 0
+#define dmesg mesg
+#else
+#define dmesg(x...) do{}while(0);
+#endif
+
+static void gre_decode(struct _pkt *p);
+static void vxlan_decode(struct _pkt *p);
+
+static struct _decoder gre_decoder = {
+	.d_label = "GRE",
+	.d_decode = gre_decode,
+};
+
+static struct _decoder vxlan_decoder = {
+	.d_label = "VXLAN",
+	.d_decode = vxlan_decode,
+};
+
+static struct _proto p_gre = {
+	.p_label = "gre",
+	.p_dcb_sz = sizeof(struct gre_dcb),
+};
+
+static struct _proto p_erspan = {
+	.p_label = "erspan",
+	.p_dcb_sz = sizeof(struct erspan_dcb),
+};
+
+static struct _proto p_vxlan = {
+	.p_label = "vxlan",
+	.p_dcb_sz = sizeof(struct vxlan_dcb),
+};
+
+static void __attribute__((constructor)) _ctor(void)
+{
+	decoder_add(&gre_decoder);
+	decoder_register(&gre_decoder, NS_INET, IP_PROTO_GRE);
+	decoder_register(&gre_decoder, NS_INET6, IP_PROTO_GRE);
+	proto_add(&gre_decoder, &p_gre);
+	proto_add(&gre_decoder, &p_erspan);
+
+	decoder_add(&vxlan_decoder);
+	decoder_register(&vxlan_decoder, NS_UDP, const_be16(VXLAN_PORT));
+	proto_add(&vxlan_decoder, &p_vxlan);
+}
+
+static void erspan_decode(struct _pkt *p, uint16_t proto)
+{
+	const uint8_t *hdr = p->pkt_nxthdr;
+	struct erspan_dcb *dcb;
+	uint16_t session;
+	uint8_t ver;
+
+	if ( proto == GRE_PROTO_ERSPAN2 ) {
+		const struct pkt_erspan2hdr *e2;
+
+		e2 = (const struct pkt_erspan2hdr *)p->pkt_nxthdr;
+		p->pkt_nxthdr += sizeof(*e2);
+		if ( p->pkt_nxthdr > p->pkt_end ) {
+			decode_truncated(p, &p_erspan);
+			return;
+		}
+		ver = be16toh(e2->ver_vlan) >> 12;
+		session = be16toh(e2->cos_en_t_session) & ERSPAN_SESSION;
+	}else{
+		const struct pkt_erspan3hdr *e3;
+
+		e3 = (const struct pkt_erspan3hdr *)p->pkt_nxthdr;
+		p->pkt_nxthdr += sizeof(*e3);
+		if ( p->pkt_nxthdr > p->pkt_end ) {
+			decode_truncated(p, &p_erspan);
+			return;
+		}
+		ver = be16toh(e3->ver_vlan) >> 12;
+		session = be16toh(e3->cos_bso_t_session) & ERSPAN_SESSION;
+
+		/* platform specific sub-header */
+		if ( e3->p_ft_hwid_d_gra_o & const_be16(ERSPAN3_O) ) {
+			p->pkt_nxthdr += 8;
+			if ( p->pkt_nxthdr > p->pkt_end ) {
+				decode_truncated(p, &p_erspan);
+				return;
+			}
+		}
+	}
+
+	dmesg(M_DEBUG, "erspan: ver=%u session=%u", ver, session);
+
+	dcb = (struct erspan_dcb *)decode_layer(p, &p_erspan);
+	if ( dcb ) {
+		dcb->erspan_hdr = hdr;
+		dcb->erspan_session = session;
+		dcb->erspan_ver = ver;
+	}
+
+	p->pkt_tunnel = session;
+	_eth_decode(p);
+}
+
+static void gre_decode(struct _pkt *p)
+{
+	const struct pkt_grehdr *gre;
+	struct gre_dcb *dcb;
+	uint16_t flags, proto;
+	uint32_t key = 0;
+
+	gre = (const struct pkt_grehdr *)p->pkt_nxthdr;
+	p->pkt_nxthdr += sizeof(*gre);
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_gre);
+		return;
+	}
+
+	flags = be16toh(gre->c_res_ver);
+	proto = be16toh(gre->proto);
+
+	/* Version 1 is the PPTP enhanced GRE, there's nothing much
+	 * interesting in there that we could decode.
+	 */
+	if ( flags & GRE_VERSION ) {
+		dmesg(M_DEBUG, "gre: version %u", flags & GRE_VERSION);
+		decode_layer(p, &p_gre);
+		return;
+	}
+
+	/* RFC1701 source routing is long deprecated */
+	if ( flags & GRE_ROUTING ) {
+		decode_malformed(p, &p_gre);
+		mesg(M_WARN, "gre: source routed packet");
+		return;
+	}
+
+	if ( flags & GRE_CSUM )
+		p->pkt_nxthdr += sizeof(uint32_t);
+	if ( flags & GRE_KEY ) {
+		if ( p->pkt_nxthdr + sizeof(uint32_t) > p->pkt_end ) {
+			decode_truncated(p, &p_gre);
+			return;
+		}
+		key = be32toh(*(const uint32_t *)p->pkt_nxthdr);
+		p->pkt_nxthdr += sizeof(uint32_t);
+	}
+	if ( flags & GRE_SEQ )
+		p->pkt_nxthdr += sizeof(uint32_t);
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_gre);
+		mesg(M_WARN, "gre: truncated header");
+		return;
+	}
+
+	dmesg(M_DEBUG, "gre: proto=0x%.4x key=0x%.8x", proto, key);
+
+	dcb = (struct gre_dcb *)decode_layer(p, &p_gre);
+	if ( dcb ) {
+		dcb->gre_hdr = gre;
+		dcb->gre_key = key;
+	}
+
+	if ( flags & GRE_KEY )
+		p->pkt_tunnel = key;
+
+	switch(proto) {
+	case GRE_PROTO_TEB:
+		_eth_decode(p);
+		break;
+	case GRE_PROTO_ERSPAN2:
+	case GRE_PROTO_ERSPAN3:
+		erspan_decode(p, proto);
+		break;
+	default:
+		decode_next(p, NS_ETHER, gre->proto);
+		break;
+	}
+}
+
+static void vxlan_decode(struct _pkt *p)
+{
+	const struct pkt_vxlanhdr *vx;
+	struct vxlan_dcb *dcb;
+	uint32_t vni;
+
+	vx = (const struct pkt_vxlanhdr *)p->pkt_nxthdr;
+	p->pkt_nxthdr += sizeof(*vx);
+	if ( p->pkt_nxthdr > p->pkt_end ) {
+		decode_truncated(p, &p_vxlan);
+		return;
+	}
+
+	/* Don't go mis-decoding whatever else happens to use the port */
+	if ( !(vx->flags & VXLAN_FLAG_VNI) ) {
+		dmesg(M_DEBUG, "vxlan: no VNI, flags=0x%.2x", vx->flags);
+		return;
+	}
+
+	vni = be32toh(vx->vni_res) >> 8;
+	dmesg(M_DEBUG, "vxlan: vni=%u", vni);
+
+	dcb = (struct vxlan_dcb *)decode_layer(p, &p_vxlan);
+	if ( dcb ) {
+		dcb->vxlan_hdr = vx;
+		dcb->vxlan_vni = vni;
+	}
+
+	p->pkt_tunnel = vni;
+	_eth_decode(p);
+}
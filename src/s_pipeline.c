@@ -18,11 +18,16 @@
 #define dhex_dump(x...) do{}while(0);
 #endif
 
+#define PIPELINE_BURST 16
+
 struct _pipeline {
 	struct iothread p_io;
 	struct list_head p_sources;
 	unsigned int p_async;
 	uint64_t p_num_pkt;
+	struct _pkt p_burst[PIPELINE_BURST];
+	/* flow tracking state of each decoder, by d_idx */
+	void **p_flow;
 };
 
 static void analyze_packet(struct _pkt *pkt)
@@ -35,7 +40,12 @@ static void analyze_packet(struct _pkt *pkt)
 	}
 }
 
-static void flowtrack_packet(struct _pkt *pkt)
+static void *proto_flow(struct _pipeline *p, struct _proto *proto)
+{
+	return p->p_flow[proto->p_owner->d_idx];
+}
+
+static void flowtrack_packet(struct _pipeline *p, struct _pkt *pkt)
 {
 	struct _dcb *cur;
 
@@ -43,16 +53,36 @@ static void flowtrack_packet(struct _pkt *pkt)
 		if ( cur->dcb_proto->p_flowtrack ) {
 			dmesg(M_DEBUG, "FLOW TRACK: %s",
 				cur->dcb_proto->p_label);
-			cur->dcb_proto->p_flowtrack(pkt, cur);
+			cur->dcb_proto->p_flowtrack(
+					proto_flow(p, cur->dcb_proto),
+					pkt, cur);
 		}
 	}
 }
 
-static void do_pkt_inject(pkt_t pkt)
+static void flowprefetch_burst(struct _pipeline *p, struct _pkt *burst,
+				unsigned int n, unsigned int pass)
+{
+	struct _dcb *cur;
+	unsigned int i;
+
+	for(i = 0; i < n; i++) {
+		struct _pkt *pkt = &burst[i];
+		for(cur = pkt->pkt_dcb; cur < pkt->pkt_dcb_top;
+				cur = cur->dcb_next) {
+			if ( cur->dcb_proto->p_flowprefetch )
+				cur->dcb_proto->p_flowprefetch(
+					proto_flow(p, cur->dcb_proto),
+					pkt, cur, pass);
+		}
+	}
+}
+
+static void do_pkt_inject(struct _pipeline *p, pkt_t pkt)
 {
 	dmesg(M_DEBUG, "pkt: len=%u/%u", pkt->pkt_caplen, pkt->pkt_len);
 	analyze_packet(pkt);
-	flowtrack_packet(pkt);
+	flowtrack_packet(p, pkt);
 	if ( pkt->pkt_nxthdr < pkt->pkt_end ) {
 		dhex_dump(pkt->pkt_nxthdr,
 			pkt->pkt_end - pkt->pkt_nxthdr, 16);
@@ -63,25 +93,37 @@ static void do_pkt_inject(pkt_t pkt)
 
 void pkt_inject(pkt_t pkt)
 {
-	do_pkt_inject(pkt);
+	do_pkt_inject(pkt->pkt_source->s_pipeline, pkt);
 }
 
 static int pd_init(struct _decoder *d, void *priv)
 {
-	//struct _pipeline *p = priv;
+	struct _pipeline *p = priv;
 
 	if ( d->d_flow_ctor ) {
-		if ( !d->d_flow_ctor() )
+		p->p_flow[d->d_idx] = d->d_flow_ctor();
+		if ( NULL == p->p_flow[d->d_idx] )
 			return 0;
 	}
 
 	return 1;
 }
 
+static int pd_fini(struct _decoder *d, void *priv)
+{
+	struct _pipeline *p = priv;
+
+	if ( d->d_flow_dtor && p->p_flow[d->d_idx] )
+		d->d_flow_dtor(p->p_flow[d->d_idx]);
+	p->p_flow[d->d_idx] = NULL;
+
+	return 1;
+}
+
 pipeline_t pipeline_new(void)
 {
 	struct _pipeline *p = NULL;
-	unsigned int num;
+	unsigned int num, i;
 
 	p = calloc(1, sizeof(*p));
 	if ( NULL == p )
@@ -90,31 +132,37 @@ pipeline_t pipeline_new(void)
 
 	INIT_LIST_HEAD(&p->p_sources);
 
-	if ( !decode_foreach_decoder(pd_init, p) )
+	p->p_flow = calloc(decode_num_decoders(), sizeof(*p->p_flow));
+	if ( NULL == p->p_flow )
 		goto out_free;
 
+	for(i = 0; i < PIPELINE_BURST; i++) {
+		if ( !decode_pkt_realloc(&p->p_burst[i],
+					DECODE_DEFAULT_MIN_LAYERS) )
+			goto out_free;
+	}
+
+	if ( !decode_foreach_decoder(pd_init, p) )
+		goto out_fini;
+
 	goto out;
 
+out_fini:
+	decode_foreach_decoder(pd_fini, p);
 out_free:
+	for(i = 0; i < PIPELINE_BURST; i++)
+		decode_pkt_realloc(&p->p_burst[i], 0);
+	free(p->p_flow);
 	free(p);
 	p = NULL;
 out:
 	return p;
 }
 
-static int pd_fini(struct _decoder *d, void *priv)
-{
-	//struct _pipeline *p = priv;
-
-	if ( d->d_flow_dtor )
-		d->d_flow_dtor();
-
-	return 1;
-}
-
 void pipeline_free(pipeline_t p)
 {
 	struct _source *s, *tmp;
+	unsigned int i;
 
 	if ( p == NULL )
 		return;
@@ -124,6 +172,10 @@ void pipeline_free(pipeline_t p)
 	list_for_each_entry_safe(s, tmp, &p->p_sources, s_list)
 		source_free(s);
 
+	for(i = 0; i < PIPELINE_BURST; i++)
+		decode_pkt_realloc(&p->p_burst[i], 0);
+
+	free(p->p_flow);
 	free(p);
 }
 
@@ -146,6 +198,7 @@ int pipeline_add_source(pipeline_t p, source_t s)
 	}
 
 	list_add_tail(&s->s_list, &p->p_sources);
+	s->s_pipeline = p;
 	return 1;
 }
 
@@ -164,11 +217,49 @@ static unsigned int do_dequeue(struct _pipeline *p, struct _source *s,
 		p->p_num_pkt);
 
 	decode(pkt, s->s_decoder);
-	do_pkt_inject(pkt);
+	do_pkt_inject(p, pkt);
 
 	return 1;
 }
 
+/* Packets from sources whose data stays put are decoded a burst at a time,
+ * then the flow trackers get to prefetch for the whole burst so that the
+ * cache misses overlap. Flow tracking itself still goes strictly in order.
+ */
+static unsigned int do_dequeue_burst(struct _pipeline *p, struct _source *s,
+					struct iothread *io)
+{
+	struct _dcb *dcb, *dcb_end;
+	struct _pkt *pkt;
+	unsigned int n, i;
+	pkt_t in;
+
+	for(n = 0; n < PIPELINE_BURST; n++) {
+		in = s->s_capdev->c_dequeue(s, io);
+		if ( NULL == in )
+			break;
+
+		pkt = &p->p_burst[n];
+		dcb = pkt->pkt_dcb;
+		dcb_end = pkt->pkt_dcb_end;
+		*pkt = *in;
+		pkt->pkt_dcb = dcb;
+		pkt->pkt_dcb_end = dcb_end;
+
+		p->p_num_pkt++;
+		dmesg(M_DEBUG, "Frame %llu:", p->p_num_pkt);
+		decode(pkt, s->s_decoder);
+	}
+
+	for(i = 0; i < FLOW_PREFETCH_PASSES; i++)
+		flowprefetch_burst(p, p->p_burst, n, i);
+
+	for(i = 0; i < n; i++)
+		do_pkt_inject(p, &p->p_burst[i]);
+
+	return n;
+}
+
 static int go_sync(struct _pipeline *p)
 {
 	struct _source *s, *tmp;
@@ -177,12 +268,22 @@ static int go_sync(struct _pipeline *p)
 		mesg(M_INFO, "pipeline: starting: %s[%s]",
 			s->s_capdev->c_name, s->s_name);
 
-		while(do_dequeue(p, s, NULL))
-			/* do nothing */;
+		if ( s->s_capdev->c_flags & CAPDEV_STABLE ) {
+			while(do_dequeue_burst(p, s, NULL))
+				/* do nothing */;
+		}else{
+			while(do_dequeue(p, s, NULL))
+				/* do nothing */;
+		}
 
 		mesg(M_INFO, "pipeline: finishing: %s[%s]",
 			s->s_capdev->c_name, s->s_name);
-		source_free(s);
+
+		/* flow state may still point in to a stable source's packet
+		 * data, so it stays around until pipeline_free()
+		 */
+		if ( !(s->s_capdev->c_flags & CAPDEV_STABLE) )
+			source_free(s);
 	}
 
 	return 1;
@@ -239,5 +340,6 @@ int pipeline_go(pipeline_t p)
 	}
 
 	mesg(M_INFO, "pipeline: %"PRIu64" packets in total", p->p_num_pkt);
+	decode_stats_report();
 	return ret;
 }
@@ -6,6 +6,27 @@
 
 #include <firestorm.h>
 #include <f_capture.h>
+#include <f_flow.h>
+
+/* FIRESTORM_CSUM=trust|verify|off, see source_csum_policy() */
+static void csum_policy(source_t src)
+{
+	const char *str;
+
+	str = getenv("FIRESTORM_CSUM");
+	if ( NULL == str || '\0' == *str )
+		return;
+
+	if ( !strcmp(str, "trust") ) {
+		source_csum_policy(src, SOURCE_CSUM_TRUST);
+	}else if ( !strcmp(str, "verify") ) {
+		source_csum_policy(src, SOURCE_CSUM_VERIFY);
+	}else if ( !strcmp(str, "off") ) {
+		source_csum_policy(src, SOURCE_CSUM_OFF);
+	}else{
+		mesg(M_WARN, "FIRESTORM_CSUM: unknown policy: %s", str);
+	}
+}
 
 int main(int argc, char **argv)
 {
@@ -17,7 +38,8 @@ int main(int argc, char **argv)
 	mesg(M_INFO,"This program is free software; released under "
 		"the GNU GPL v3 (see: COPYING)");
 
-	if ( !memchunk_init(4096) )
+	/* one pipeline, and a little over for the allocator's own use */
+	if ( !memchunk_init(FLOW_PIPELINE_CHUNKS + 64) )
 		return EXIT_FAILURE;
 
 	decode_init();
@@ -32,6 +54,8 @@ int main(int argc, char **argv)
 	if ( src == NULL )
 		return EXIT_FAILURE;
 
+	csum_policy(src);
+
 	p = pipeline_new();
 	assert(p != NULL);
 
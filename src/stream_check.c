@@ -0,0 +1,633 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Stream reassembly check. Each case synthesises a TCP session in memory,
+ * runs it through a pipeline of its own like any other capture, and a
+ * tcp_app on the far end hashes what gets pushed to it. A case passes if
+ * what the server should have seen of the client's stream is delivered
+ * whole and byte-exact, in at least as many pushes as the case asks for.
+ * Cases that send conflicting copies of some bytes name the overlap
+ * policy they run under, which is set through FIRESTORM_TCP_POLICY.
+ * Every case is run from a stable source, so segments are held by
+ * reference, and from one that isn't, so they're copied in to chunks.
+ *
+ *   usage: stream_check [-v]
+*/
+
+#include <firestorm.h>
+#include <f_capture.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <p_tcp.h>
+#include <pkt/eth.h>
+#include <pkt/ip.h>
+#include <pkt/tcp.h>
+#include <csum.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define CHECK_PORT	9999
+#define CHECK_MSS	1000
+#define CHECK_WIN	65535
+
+/* the same app with a depth limit, somewhere inside a segment */
+#define CHECK_DEPTH_PORT	9998
+#define CHECK_DEPTH		(10 * CHECK_MSS + 123)
+
+#define FNV_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+struct synth_frame {
+	uint8_t *buf;
+	size_t len;
+	timestamp_t ts;
+	unsigned int usec;
+};
+
+/* An in-memory capture of one session, built up by a case */
+struct synth {
+	struct _source src;
+	struct _pkt pkt;
+
+	struct synth_frame *frames;
+	unsigned int num_frames;
+	unsigned int max_frames;
+	unsigned int cur;
+	unsigned int err;
+
+	/* what the client sends, and a conflicting copy of it */
+	uint8_t *data;
+	uint8_t *alt;
+	size_t data_len;
+
+	/* what the server's app should see of it */
+	uint8_t *want;
+	size_t want_len;
+
+	uint32_t c_isn, s_isn;
+	uint16_t c_port, s_port;
+	uint64_t clock;
+};
+
+struct check_case {
+	const char *name;
+	size_t len;
+	int (*build)(struct synth *sy);
+	unsigned int min_pushes;
+	const char *policy;
+};
+
+/* What the app saw of the client's stream */
+static struct {
+	unsigned int sessions;
+	unsigned int pushes;
+	uint64_t bytes;
+	uint64_t hash;
+}result;
+
+static int verbose;
+
+void _mesg(mesg_code_t code, const char *str, size_t len);
+void _mesg(mesg_code_t code, const char *str, size_t len)
+{
+	if ( code >= M_WARN || verbose )
+		fprintf(stderr, "%s\n", str);
+}
+
+static uint64_t fnv(uint64_t h, const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+struct chk_sesh {
+	uint64_t bytes;
+	uint64_t hash;
+	unsigned int pushes;
+};
+
+static size_t chk_push(tcp_sesh_t sesh, tcp_chan_t chan,
+			const struct ro_vec *vec, size_t numv, size_t bytes)
+{
+	struct chk_sesh *c = tcp_sesh_priv(sesh);
+	size_t i, tot = 0;
+
+	if ( chan != TCP_CHAN_TO_SERVER )
+		return bytes;
+
+	for(i = 0; i < numv; i++) {
+		c->hash = fnv(c->hash, vec[i].v_ptr, vec[i].v_len);
+		tot += vec[i].v_len;
+	}
+	assert(tot == bytes);
+	c->bytes += bytes;
+	c->pushes++;
+	return bytes;
+}
+
+static int chk_init(tcp_sesh_t sesh)
+{
+	struct chk_sesh *c = tcp_sesh_priv(sesh);
+	c->bytes = 0;
+	c->hash = FNV_BASIS;
+	c->pushes = 0;
+	return 1;
+}
+
+static void chk_fini(tcp_sesh_t sesh)
+{
+	struct chk_sesh *c = tcp_sesh_priv(sesh);
+	result.sessions++;
+	result.bytes = c->bytes;
+	result.hash = c->hash;
+	result.pushes = c->pushes;
+}
+
+static struct tcp_app chk_app = {
+	.a_push = chk_push,
+	.a_init = chk_init,
+	.a_fini = chk_fini,
+	.a_state_sz = sizeof(struct chk_sesh),
+	.a_label = "stream_check",
+};
+
+static struct tcp_app chk_depth_app = {
+	.a_push = chk_push,
+	.a_init = chk_init,
+	.a_fini = chk_fini,
+	.a_state_sz = sizeof(struct chk_sesh),
+	.a_depth = CHECK_DEPTH,
+	.a_label = "stream_check_depth",
+};
+
+static void __attribute__((constructor)) _ctor(void)
+{
+	tcp_app_register(&chk_app);
+	tcp_app_register_dport(&chk_app, CHECK_PORT);
+	tcp_app_register(&chk_depth_app);
+	tcp_app_register_dport(&chk_depth_app, CHECK_DEPTH_PORT);
+}
+
+static void synth_free(struct _source *s)
+{
+	struct synth *sy = (struct synth *)s;
+	unsigned int i;
+
+	for(i = 0; i < sy->num_frames; i++)
+		free(sy->frames[i].buf);
+	free(sy->frames);
+	free(sy->data);
+	free(sy->alt);
+	free(sy->want);
+	decode_pkt_realloc(&sy->pkt, 0);
+	free(sy);
+}
+
+static pkt_t synth_dequeue(struct _source *s, struct iothread *io)
+{
+	struct synth *sy = (struct synth *)s;
+	struct synth_frame *f;
+
+	if ( sy->cur >= sy->num_frames )
+		return NULL;
+
+	f = &sy->frames[sy->cur++];
+	sy->pkt.pkt_ts = f->ts;
+	sy->pkt.pkt_usec = f->usec;
+	sy->pkt.pkt_len = sy->pkt.pkt_caplen = f->len;
+	sy->pkt.pkt_base = f->buf;
+	sy->pkt.pkt_end = f->buf + f->len;
+	return &sy->pkt;
+}
+
+static const struct _capdev synth_stable = {
+	.c_flags = CAPDEV_STABLE,
+	.c_name = "synth",
+	.c_dtor = synth_free,
+	.c_dequeue = synth_dequeue,
+};
+
+static const struct _capdev synth_copy = {
+	.c_name = "synth",
+	.c_dtor = synth_free,
+	.c_dequeue = synth_dequeue,
+};
+
+static struct synth *synth_new(int stable, size_t data_len, unsigned int seed)
+{
+	struct synth *sy;
+	size_t i;
+
+	sy = calloc(1, sizeof(*sy));
+	if ( NULL == sy )
+		return NULL;
+
+	_source_new(&sy->src, (stable) ? &synth_stable : &synth_copy, "check");
+	sy->src.s_decoder = decoder_get(NS_DLT, 1);
+	sy->pkt.pkt_source = &sy->src;
+	sy->pkt.pkt_flags = (stable) ? PKT_STABLE : 0;
+	if ( !decode_pkt_realloc(&sy->pkt, DECODE_DEFAULT_MIN_LAYERS) )
+		goto err;
+
+	sy->data = malloc(data_len ? data_len : 1);
+	sy->alt = malloc(data_len ? data_len : 1);
+	sy->want = malloc(data_len ? data_len : 1);
+	if ( NULL == sy->data || NULL == sy->alt || NULL == sy->want )
+		goto err;
+	srand(seed);
+	for(i = 0; i < data_len; i++) {
+		sy->data[i] = rand();
+		sy->alt[i] = ~sy->data[i];
+	}
+	sy->data_len = data_len;
+	memcpy(sy->want, sy->data, data_len);
+	sy->want_len = data_len;
+
+	sy->c_isn = rand();
+	sy->s_isn = rand();
+	sy->c_port = 1024 + rand() % 60000;
+	sy->s_port = CHECK_PORT;
+	sy->clock = 1262304000ULL * 1000000;
+	return sy;
+err:
+	synth_free(&sy->src);
+	return NULL;
+}
+
+/* One segment carrying len bytes of buf */
+static void synth_seg(struct synth *sy, int to_server, uint8_t flags,
+			uint32_t seq, uint32_t ack,
+			const uint8_t *buf, size_t len)
+{
+	struct synth_frame *f;
+	struct pkt_ethhdr *eth;
+	struct pkt_iphdr *iph;
+	struct pkt_tcphdr *tcph;
+	uint16_t tot_len;
+
+	if ( sy->num_frames == sy->max_frames ) {
+		struct synth_frame *new;
+		unsigned int sz;
+
+		sz = (sy->max_frames) ? sy->max_frames << 1 : 64;
+		new = realloc(sy->frames, sz * sizeof(*new));
+		if ( NULL == new ) {
+			sy->err = 1;
+			return;
+		}
+		sy->frames = new;
+		sy->max_frames = sz;
+	}
+
+	tot_len = sizeof(*iph) + sizeof(*tcph) + len;
+
+	f = &sy->frames[sy->num_frames];
+	f->len = sizeof(*eth) + tot_len;
+	f->buf = calloc(1, f->len);
+	if ( NULL == f->buf ) {
+		sy->err = 1;
+		return;
+	}
+	f->ts = sy->clock / 1000000;
+	f->usec = sy->clock % 1000000;
+	sy->clock += 1000;
+	sy->num_frames++;
+
+	eth = (struct pkt_ethhdr *)f->buf;
+	eth->proto = const_be16(0x0800);
+
+	iph = (struct pkt_iphdr *)(eth + 1);
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) >> 2;
+	iph->tot_len = htobe16(tot_len);
+	iph->ttl = 64;
+	iph->protocol = IP_PROTO_TCP;
+	iph->saddr = htobe32((to_server) ? 0x0a000001 : 0x0a000002);
+	iph->daddr = htobe32((to_server) ? 0x0a000002 : 0x0a000001);
+	iph->csum = csum_fold(csum_block((const uint8_t *)iph,
+					sizeof(*iph)));
+
+	tcph = (struct pkt_tcphdr *)(iph + 1);
+	tcph->sport = htobe16((to_server) ? sy->c_port : sy->s_port);
+	tcph->dport = htobe16((to_server) ? sy->s_port : sy->c_port);
+	tcph->seq = htobe32(seq);
+	tcph->ack = htobe32(ack);
+	tcph->doff = sizeof(*tcph) >> 2;
+	tcph->flags = flags;
+	tcph->win = htobe16(CHECK_WIN);
+	memcpy(tcph + 1, buf, len);
+	tcph->csum = csum_tcpudp_magic(iph->saddr, iph->daddr,
+					tot_len - sizeof(*iph), IP_PROTO_TCP,
+					csum_block((const uint8_t *)tcph,
+						tot_len - sizeof(*iph)));
+}
+
+static void synth_open(struct synth *sy)
+{
+	synth_seg(sy, 1, TCP_SYN, sy->c_isn, 0, NULL, 0);
+	synth_seg(sy, 0, TCP_SYN|TCP_ACK, sy->s_isn, sy->c_isn + 1, NULL, 0);
+	synth_seg(sy, 1, TCP_ACK, sy->c_isn + 1, sy->s_isn + 1, NULL, 0);
+}
+
+/* Client data from ofs */
+static void synth_data(struct synth *sy, size_t ofs, size_t len)
+{
+	assert(ofs + len <= sy->data_len);
+	synth_seg(sy, 1, TCP_PSH|TCP_ACK, sy->c_isn + 1 + ofs,
+			sy->s_isn + 1, sy->data + ofs, len);
+}
+
+/* Client data from ofs, but the conflicting copy */
+static void synth_alt(struct synth *sy, size_t ofs, size_t len)
+{
+	assert(ofs + len <= sy->data_len);
+	synth_seg(sy, 1, TCP_PSH|TCP_ACK, sy->c_isn + 1 + ofs,
+			sy->s_isn + 1, sy->alt + ofs, len);
+}
+
+/* Server acknowledges client data up to ofs */
+static void synth_ack(struct synth *sy, size_t ofs)
+{
+	synth_seg(sy, 0, TCP_ACK, sy->s_isn + 1, sy->c_isn + 1 + ofs,
+			NULL, 0);
+}
+
+static void synth_close(struct synth *sy)
+{
+	uint32_t c_fin = sy->c_isn + 1 + sy->data_len;
+
+	synth_seg(sy, 1, TCP_FIN|TCP_ACK, c_fin, sy->s_isn + 1, NULL, 0);
+	synth_seg(sy, 0, TCP_FIN|TCP_ACK, sy->s_isn + 1, c_fin + 1, NULL, 0);
+	synth_seg(sy, 1, TCP_ACK, c_fin + 1, sy->s_isn + 2, NULL, 0);
+}
+
+static int case_in_order(struct synth *sy)
+{
+	size_t ofs;
+
+	synth_open(sy);
+	for(ofs = 0; ofs < sy->data_len; ofs += CHECK_MSS) {
+		synth_data(sy, ofs, CHECK_MSS);
+		if ( (ofs / CHECK_MSS) % 8 == 7 )
+			synth_ack(sy, ofs + CHECK_MSS);
+	}
+	synth_ack(sy, sy->data_len);
+	synth_close(sy);
+	return 1;
+}
+
+/* Swap each pair of segments so the later one arrives first */
+static int case_reordered(struct synth *sy)
+{
+	size_t ofs;
+
+	synth_open(sy);
+	for(ofs = 0; ofs < sy->data_len; ofs += 2 * CHECK_MSS) {
+		synth_data(sy, ofs + CHECK_MSS, CHECK_MSS);
+		synth_data(sy, ofs, CHECK_MSS);
+		if ( (ofs / CHECK_MSS) % 8 == 6 )
+			synth_ack(sy, ofs + 2 * CHECK_MSS);
+	}
+	synth_ack(sy, sy->data_len);
+	synth_close(sy);
+	return 1;
+}
+
+/* Send the last segment of each block first, then fill the hole from
+ * the middle outwards so most segments split a gap in two.
+ */
+#define CHECK_BLOCK	32
+static int case_split_gaps(struct synth *sy)
+{
+	size_t ofs, i;
+
+	synth_open(sy);
+	for(ofs = 0; ofs < sy->data_len; ofs += CHECK_BLOCK * CHECK_MSS) {
+		synth_data(sy, ofs + (CHECK_BLOCK - 1) * CHECK_MSS, CHECK_MSS);
+		for(i = 1; i < CHECK_BLOCK - 1; i += 2)
+			synth_data(sy, ofs + i * CHECK_MSS, CHECK_MSS);
+		for(i = 0; i < CHECK_BLOCK - 1; i += 2)
+			synth_data(sy, ofs + i * CHECK_MSS, CHECK_MSS);
+		synth_ack(sy, ofs + CHECK_BLOCK * CHECK_MSS);
+	}
+	synth_close(sy);
+	return 1;
+}
+
+/* The server's ACKs trail the client by a few segments, as in any bulk
+ * transfer, so each one should push what it covers without waiting for
+ * the client to go idle.
+ */
+#define CHECK_TRAIL	3
+static int case_trailing_ack(struct synth *sy)
+{
+	size_t ofs;
+
+	synth_open(sy);
+	for(ofs = 0; ofs < sy->data_len; ofs += CHECK_MSS) {
+		synth_data(sy, ofs, CHECK_MSS);
+		if ( ofs >= CHECK_TRAIL * CHECK_MSS )
+			synth_ack(sy, ofs - (CHECK_TRAIL - 1) * CHECK_MSS);
+	}
+	synth_ack(sy, sy->data_len);
+	synth_close(sy);
+	return 1;
+}
+
+/* The client's sequence numbers wrap a few segments in, and the server's
+ * on its SYN-ACK.
+ */
+static int case_isn_wrap(struct synth *sy)
+{
+	sy->c_isn = -(8 * CHECK_MSS + 17);
+	sy->s_isn = -1;
+	return case_reordered(sy);
+}
+
+/* The app only wants CHECK_DEPTH bytes, the rest is bypassed */
+static int case_depth(struct synth *sy)
+{
+	sy->s_port = CHECK_DEPTH_PORT;
+	sy->want_len = CHECK_DEPTH;
+	return case_in_order(sy);
+}
+
+/* Conflicting copies of three segments, in units of CHECK_MSS:
+ *
+ *  1-3 then 2-4: the new copy starts inside the old one
+ *  5-6 then 5-7: they start together and the new copy is longer
+ *  9-10 then 8-10: the new copy starts first
+ *
+ * The first segment goes last so that all of it is out of order, and
+ * last_* say whether the new copy wins each overlapped unit.
+ */
+static int case_overlap(struct synth *sy, int last_inside, int last_same,
+			int last_before)
+{
+	size_t u = CHECK_MSS;
+
+	synth_open(sy);
+	synth_data(sy, 1 * u, 2 * u);
+	synth_alt(sy, 2 * u, 2 * u);
+	synth_data(sy, 5 * u, 1 * u);
+	synth_alt(sy, 5 * u, 2 * u);
+	synth_data(sy, 9 * u, 1 * u);
+	synth_alt(sy, 8 * u, 2 * u);
+	synth_data(sy, 10 * u, sy->data_len - 10 * u);
+	synth_data(sy, 4 * u, 1 * u);
+	synth_data(sy, 7 * u, 1 * u);
+	synth_data(sy, 0, 1 * u);
+	synth_ack(sy, sy->data_len);
+	synth_close(sy);
+
+	/* the parts of the new copies that overlapped nothing */
+	memcpy(sy->want + 3 * u, sy->alt + 3 * u, u);
+	memcpy(sy->want + 6 * u, sy->alt + 6 * u, u);
+	memcpy(sy->want + 8 * u, sy->alt + 8 * u, u);
+
+	if ( last_inside )
+		memcpy(sy->want + 2 * u, sy->alt + 2 * u, u);
+	if ( last_same )
+		memcpy(sy->want + 5 * u, sy->alt + 5 * u, u);
+	if ( last_before )
+		memcpy(sy->want + 9 * u, sy->alt + 9 * u, u);
+	return 1;
+}
+
+static int case_overlap_first(struct synth *sy)
+{
+	return case_overlap(sy, 0, 0, 0);
+}
+
+static int case_overlap_last(struct synth *sy)
+{
+	return case_overlap(sy, 1, 1, 1);
+}
+
+static int case_overlap_bsd(struct synth *sy)
+{
+	return case_overlap(sy, 0, 0, 1);
+}
+
+static int case_overlap_linux(struct synth *sy)
+{
+	return case_overlap(sy, 0, 1, 1);
+}
+
+static const struct check_case cases[] = {
+	{"in order", 64 * CHECK_MSS, case_in_order, 8},
+	{"reordered", 64 * CHECK_MSS, case_reordered, 8},
+	{"split gaps", 2048 * CHECK_MSS, case_split_gaps, 64},
+	{"trailing ack", 32 * CHECK_MSS, case_trailing_ack, 16},
+	{"isn wrap", 32 * CHECK_MSS, case_isn_wrap, 4},
+	{"depth", 32 * CHECK_MSS, case_depth, 1},
+	{"overlap", 16 * CHECK_MSS, case_overlap_first, 1, "first"},
+	{"overlap", 16 * CHECK_MSS, case_overlap_last, 1, "last"},
+	{"overlap", 16 * CHECK_MSS, case_overlap_bsd, 1, "bsd"},
+	{"overlap", 16 * CHECK_MSS, case_overlap_linux, 1, "linux"},
+	{"overlap", 16 * CHECK_MSS, case_overlap_first, 1, "windows"},
+};
+#define NUM_CASES (sizeof(cases)/sizeof(*cases))
+
+static int run_case(const struct check_case *c, int stable)
+{
+	char policy[64];
+	struct synth *sy;
+	uint64_t want_hash;
+	size_t want_bytes;
+	pipeline_t p;
+
+	sy = synth_new(stable, c->len, 1);
+	if ( NULL == sy )
+		return 0;
+
+	if ( !c->build(sy) || sy->err ) {
+		source_free(&sy->src);
+		return 0;
+	}
+
+	want_bytes = sy->want_len;
+	want_hash = fnv(FNV_BASIS, sy->want, sy->want_len);
+
+	/* the policy table is read as each pipeline's trackers are made */
+	if ( c->policy ) {
+		snprintf(policy, sizeof(policy), "0.0.0.0/0=%s", c->policy);
+		setenv("FIRESTORM_TCP_POLICY", policy, 1);
+	}else{
+		unsetenv("FIRESTORM_TCP_POLICY");
+	}
+
+	p = pipeline_new();
+	if ( NULL == p || !pipeline_add_source(p, &sy->src) ) {
+		source_free(&sy->src);
+		pipeline_free(p);
+		return 0;
+	}
+
+	memset(&result, 0, sizeof(result));
+	pipeline_go(p);
+	pipeline_free(p);
+
+	if ( result.sessions != 1 || result.bytes != want_bytes ||
+			result.hash != want_hash ||
+			result.pushes < c->min_pushes ) {
+		printf("stream_check: %s%s%s (%s): FAIL, %u sessions, "
+			"%llu of %zu bytes delivered in %u pushes%s\n",
+			c->name, (c->policy) ? " " : "",
+			(c->policy) ? c->policy : "",
+			(stable) ? "ref" : "copy", result.sessions,
+			(unsigned long long)result.bytes, want_bytes,
+			result.pushes,
+			(result.bytes == want_bytes) ? ", wrong copy" : "");
+		return 0;
+	}
+
+	printf("stream_check: %s%s%s (%s): ok\n",
+		c->name, (c->policy) ? " " : "",
+		(c->policy) ? c->policy : "",
+		(stable) ? "ref" : "copy");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, fails = 0;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "v")) != -1 ) {
+		switch(opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( !memchunk_init(4096) )
+		return EXIT_FAILURE;
+
+	decode_init();
+
+	for(i = 0; i < NUM_CASES; i++) {
+		if ( !run_case(&cases[i], 1) )
+			fails++;
+		if ( !run_case(&cases[i], 0) )
+			fails++;
+	}
+
+	memchunk_fini();
+
+	printf("stream_check: %u of %u runs failed\n", fails,
+		(unsigned int)NUM_CASES * 2);
+	return (fails) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
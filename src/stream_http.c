@@ -8,8 +8,9 @@
 #include <f_packet.h>
 #include <f_decode.h>
 #include <p_stream.h>
+#include <p_tcp.h>
 
-#if 1
+#if 0
 #define dmesg mesg
 #define dhex_dump hex_dump
 #else
@@ -79,7 +80,7 @@ static size_t http_hdr_append(void *priv, const uint8_t *buf, size_t len)
 			continue;
 		}
 		if ( RSTATE_TERMINAL(sm->state) ) {
-			mesg(M_DEBUG, "sm_http: got message of %zu bytes\n",
+			dmesg(M_DEBUG, "sm_http: got message of %zu bytes",
 				sm->len + i + 1);
 			return sm->len + i + 1;
 		}
@@ -87,7 +88,7 @@ static size_t http_hdr_append(void *priv, const uint8_t *buf, size_t len)
 
 	sm->len += i;
 
-	mesg(M_DEBUG, "sm_http: %zu bytes, now at %u bytes total", i, sm->len);
+	dmesg(M_DEBUG, "sm_http: %zu bytes, now at %u bytes total", i, sm->len);
 	return 0;
 }
 
@@ -96,3 +97,289 @@ const struct stream_ops _sm_http_hdr = {
 	.sm_ctor = http_hdr_ctor,
 	.sm_append = http_hdr_append,
 };
+
+/* HTTP/1.x message framing over a TCP session. Headers are scanned in place
+ * and left in the stream until they're complete, then linearised once to
+ * pick out the few fields that decide where the message ends. Bodies are
+ * skipped. Chunked bodies and bodies delimited by connection close aren't
+ * framed, we stop parsing that direction.
+ */
+#define HTTP_MAX_HDR		8192
+#define HTTP_MAX_PIPELINE	32
+
+struct http_chan {
+	struct http_msg_state sm;
+	/* bytes of the current header already fed to sm */
+	size_t scanned;
+	/* body bytes still to skip */
+	size_t body;
+	/* lost track of message boundaries, ignore the rest */
+	uint8_t lost;
+};
+
+struct http_sesh {
+	struct http_chan req, resp;
+	/* outstanding requests, oldest in bit 0, set for HEAD */
+	uint32_t head_q;
+	uint8_t num_q;
+};
+
+static const struct ro_vec hdr_clen = {(const uint8_t *)"content-length", 14};
+static const struct ro_vec hdr_te = {(const uint8_t *)"transfer-encoding", 17};
+
+/* Split off the next line, without its CR/LF */
+static int next_line(const uint8_t **ptr, const uint8_t *end,
+			struct ro_vec *line)
+{
+	const uint8_t *p = *ptr, *eol;
+
+	eol = memchr(p, '\n', end - p);
+	if ( NULL == eol )
+		return 0;
+
+	*ptr = eol + 1;
+	if ( eol > p && eol[-1] == '\r' )
+		eol--;
+	line->v_ptr = p;
+	line->v_len = eol - p;
+	return 1;
+}
+
+static void vtrim(struct ro_vec *v)
+{
+	while ( v->v_len && (*v->v_ptr == ' ' || *v->v_ptr == '\t') ) {
+		v->v_ptr++;
+		v->v_len--;
+	}
+	while ( v->v_len && (v->v_ptr[v->v_len - 1] == ' ' ||
+			v->v_ptr[v->v_len - 1] == '\t') )
+		v->v_len--;
+}
+
+/* Pick out Content-Length and Transfer-Encoding, returns 0 if the body
+ * length can't be known up front.
+ */
+static int hdr_body(const uint8_t *ptr, const uint8_t *end,
+			int *has_clen, size_t *clen)
+{
+	struct ro_vec line, name, val;
+	const uint8_t *colon;
+	unsigned int u;
+
+	*has_clen = 0;
+	*clen = 0;
+
+	while ( next_line(&ptr, end, &line) && line.v_len ) {
+		colon = memchr(line.v_ptr, ':', line.v_len);
+		if ( NULL == colon )
+			continue;
+
+		name.v_ptr = line.v_ptr;
+		name.v_len = colon - line.v_ptr;
+		val.v_ptr = colon + 1;
+		val.v_len = line.v_len - (name.v_len + 1);
+		vtrim(&name);
+		vtrim(&val);
+
+		if ( !vcasecmp(&name, &hdr_te) ) {
+			if ( !vstrcmp(&val, "identity") )
+				continue;
+			return 0;
+		}
+
+		if ( !vcasecmp(&name, &hdr_clen) ) {
+			if ( 0 == val.v_len || vtouint(&val, &u) != val.v_len )
+				return 0;
+			*has_clen = 1;
+			*clen = u;
+		}
+	}
+
+	return 1;
+}
+
+static void http_request(struct http_sesh *h, const uint8_t *hdr, size_t len)
+{
+	struct http_chan *c = &h->req;
+	const uint8_t *ptr = hdr, *end = hdr + len, *sp;
+	struct ro_vec line, meth;
+	int has_clen;
+
+	/* tolerate stray CRLF's between requests */
+	do {
+		if ( !next_line(&ptr, end, &line) )
+			goto lost;
+	}while( 0 == line.v_len );
+
+	sp = memchr(line.v_ptr, ' ', line.v_len);
+	if ( NULL == sp || sp == line.v_ptr )
+		goto lost;
+
+	meth.v_ptr = line.v_ptr;
+	meth.v_len = sp - line.v_ptr;
+	dmesg(M_DEBUG, "http: request: %.*s", (int)line.v_len, line.v_ptr);
+
+	if ( h->num_q < HTTP_MAX_PIPELINE ) {
+		if ( !vstrcmp(&meth, "HEAD") )
+			h->head_q |= (1U << h->num_q);
+		h->num_q++;
+	}
+
+	if ( !hdr_body(ptr, end, &has_clen, &c->body) )
+		goto lost;
+	return;
+lost:
+	c->lost = 1;
+}
+
+static void http_response(struct http_sesh *h, const uint8_t *hdr, size_t len)
+{
+	struct http_chan *c = &h->resp;
+	const uint8_t *ptr = hdr, *end = hdr + len;
+	struct ro_vec line, code;
+	unsigned int status;
+	int has_clen, head;
+
+	do {
+		if ( !next_line(&ptr, end, &line) )
+			goto lost;
+	}while( 0 == line.v_len );
+
+	if ( line.v_len < 12 || memcmp(line.v_ptr, "HTTP/", 5) )
+		goto lost;
+
+	code.v_ptr = line.v_ptr + 9;
+	code.v_len = 3;
+	if ( vtouint(&code, &status) != 3 )
+		goto lost;
+
+	dmesg(M_DEBUG, "http: response: %.*s", (int)line.v_len, line.v_ptr);
+
+	/* interim responses come before the real one */
+	if ( status < 200 ) {
+		c->body = 0;
+		return;
+	}
+
+	head = h->head_q & 1;
+	if ( h->num_q ) {
+		h->head_q >>= 1;
+		h->num_q--;
+	}
+
+	if ( !hdr_body(ptr, end, &has_clen, &c->body) )
+		goto lost;
+
+	if ( head || status == 204 || status == 304 ) {
+		c->body = 0;
+		return;
+	}
+
+	/* delimited by connection close */
+	if ( !has_clen )
+		goto lost;
+	return;
+lost:
+	c->lost = 1;
+}
+
+/* Feed the header state machine from ofs on, returns the length of the
+ * header once it's complete.
+ */
+static size_t scan_hdr(struct http_chan *c, const struct ro_vec *vec,
+			size_t numv, size_t ofs)
+{
+	size_t i, ret;
+
+	for(i = 0; i < numv; i++) {
+		if ( ofs >= vec[i].v_len ) {
+			ofs -= vec[i].v_len;
+			continue;
+		}
+
+		ret = _sm_http_hdr.sm_append(&c->sm, vec[i].v_ptr + ofs,
+						vec[i].v_len - ofs);
+		if ( ret )
+			return ret;
+		ofs = 0;
+	}
+
+	return 0;
+}
+
+static size_t http_push(tcp_sesh_t sesh, tcp_chan_t chan,
+			const struct ro_vec *vec, size_t numv, size_t bytes)
+{
+	struct http_sesh *h = tcp_sesh_priv(sesh);
+	struct http_chan *c;
+	uint8_t buf[HTTP_MAX_HDR];
+	const uint8_t *hdr;
+	size_t taken, len;
+
+	c = (chan == TCP_CHAN_TO_SERVER) ? &h->req : &h->resp;
+
+	for(taken = 0; taken < bytes; ) {
+		if ( c->lost ) {
+			tcp_sesh_bypass(sesh, chan);
+			return bytes;
+		}
+
+		if ( c->body ) {
+			len = bytes - taken;
+			if ( len > c->body )
+				len = c->body;
+			c->body -= len;
+			taken += len;
+			continue;
+		}
+
+		len = scan_hdr(c, vec, numv, taken + c->scanned);
+		if ( 0 == len ) {
+			c->scanned = bytes - taken;
+			if ( c->scanned > HTTP_MAX_HDR )
+				c->lost = 1;
+			break;
+		}
+
+		http_hdr_ctor(&c->sm);
+		c->scanned = 0;
+
+		if ( len > HTTP_MAX_HDR ) {
+			c->lost = 1;
+			continue;
+		}
+
+		hdr = vlinear(vec, numv, taken, len, buf);
+		assert(NULL != hdr);
+		if ( chan == TCP_CHAN_TO_SERVER )
+			http_request(h, hdr, len);
+		else
+			http_response(h, hdr, len);
+		taken += len;
+	}
+
+	return taken;
+}
+
+static int http_init(tcp_sesh_t sesh)
+{
+	struct http_sesh *h = tcp_sesh_priv(sesh);
+
+	memset(h, 0, sizeof(*h));
+	http_hdr_ctor(&h->req.sm);
+	http_hdr_ctor(&h->resp.sm);
+	return 1;
+}
+
+static struct tcp_app http_app = {
+	.a_push = http_push,
+	.a_init = http_init,
+	.a_state_sz = sizeof(struct http_sesh),
+	.a_label = "http",
+};
+
+static void __attribute__((constructor)) _ctor(void)
+{
+	tcp_app_register(&http_app);
+	tcp_app_register_dport(&http_app, 80);
+}
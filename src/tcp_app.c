@@ -20,6 +20,7 @@ struct dpe {
 static struct dpe *dports;
 static unsigned int num_dports;
 static struct tcp_app *apps;
+static unsigned int num_apps;
 
 void tcp_app_register(struct tcp_app *app)
 {
@@ -27,28 +28,20 @@ void tcp_app_register(struct tcp_app *app)
 
 	assert(NULL == app->a_next);
 	assert(NULL != app->a_label);
+	assert(NULL != app->a_push);
 	assert(0 == app->a_max_dcb);
 
-	for(p = app->a_decode->d_protos; p; p = p->p_next)
-		if ( app->a_max_dcb < p->p_dcb_sz )
-			app->a_max_dcb = p->p_dcb_sz;
+	if ( app->a_decode ) {
+		for(p = app->a_decode->d_protos; p; p = p->p_next)
+			if ( app->a_max_dcb < p->p_dcb_sz )
+				app->a_max_dcb = p->p_dcb_sz;
+	}
 
+	app->a_idx = num_apps++;
 	app->a_next = apps;
 	apps = app;
 }
 
-size_t _tcp_app_max_dcb(void)
-{
-	struct tcp_app *app;
-	size_t dcb = 0;
-
-	for(app = apps; app; app = app->a_next)
-		if ( dcb < app->a_max_dcb )
-			dcb = app->a_max_dcb;
-
-	return dcb + sizeof(struct tcpstream_dcb);
-}
-
 static int dp_assure(void)
 {
 	static void *new;
@@ -107,3 +100,38 @@ struct tcp_app *_tcp_app_find_by_dport(uint16_t dport)
 
 	return NULL;
 }
+
+/* Per-app session state caches come out of the TCP tracker's pool */
+struct tcp_app_inst *_tcp_app_ctor(mempool_t pool)
+{
+	struct tcp_app_inst *inst;
+	struct tcp_app *app;
+
+	/* one spare so there's something to return with no apps */
+	inst = calloc(num_apps + 1, sizeof(*inst));
+	if ( NULL == inst )
+		return NULL;
+
+	for(app = apps; app; app = app->a_next) {
+		if ( 0 == app->a_state_sz )
+			continue;
+		inst[app->a_idx].cache = objcache_init(pool, app->a_label,
+							app->a_state_sz);
+		if ( NULL == inst[app->a_idx].cache ) {
+			free(inst);
+			return NULL;
+		}
+	}
+
+	return inst;
+}
+
+void _tcp_app_dtor(struct tcp_app_inst *inst)
+{
+	struct tcp_app *app;
+
+	for(app = apps; app; app = app->a_next)
+		mesg(M_INFO, "tcp_app: %s: %u sessions",
+			app->a_label, inst[app->a_idx].num_sesh);
+	free(inst);
+}
@@ -0,0 +1,229 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Target based overlap policies for TCP reassembly. Which copy of an
+ * overlapped byte a host keeps depends on its stack, so the policy is
+ * picked by receiving address. FIRESTORM_TCP_POLICY is a comma separated
+ * list of net/len=policy, eg. "10.0.0.0/8=linux,10.1.2.3=windows", the
+ * longest match wins. The prefixes are flattened at startup in to sorted,
+ * disjoint address ranges so that a lookup is a binary search.
+*/
+
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <list.h>
+#include <p_tcp.h>
+#include "tcpip.h"
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* configuration options */
+/* for hosts that aren't in the table */
+static const uint8_t default_policy = TCP_POLICY_FIRST;
+
+#define MAX_PREFIXES	256
+
+static const char * const policy_name[TCP_POLICY_MAX] = {
+	[TCP_POLICY_FIRST] = "first",
+	[TCP_POLICY_LAST] = "last",
+	[TCP_POLICY_BSD] = "bsd",
+	[TCP_POLICY_LINUX] = "linux",
+	[TCP_POLICY_WINDOWS] = "windows",
+};
+
+struct prefix {
+	uint32_t net;
+	uint32_t mask;
+	uint8_t len;
+	uint8_t policy;
+};
+
+/* addresses from lo up to the next range's lo get policy */
+struct range {
+	uint32_t lo;
+	uint8_t policy;
+};
+
+static struct range *ranges;
+static unsigned int num_ranges;
+
+const char *_tcp_policy_name(uint8_t policy)
+{
+	assert(policy < TCP_POLICY_MAX);
+	return policy_name[policy];
+}
+
+uint8_t _tcp_policy_lookup(uint32_t addr)
+{
+	unsigned int lo, hi, mid;
+
+	if ( 0 == num_ranges )
+		return default_policy;
+
+	/* ranges[0].lo is always zero */
+	addr = be32toh(addr);
+	for(lo = 0, hi = num_ranges; hi - lo > 1; ) {
+		mid = (lo + hi) / 2;
+		if ( addr < ranges[mid].lo )
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return ranges[lo].policy;
+}
+
+static int parse_prefix(struct prefix *p, const char *str, size_t len)
+{
+	char buf[64], *pol, *slash, *end;
+	struct in_addr in;
+	unsigned long plen;
+	unsigned int i;
+
+	if ( len >= sizeof(buf) )
+		return 0;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	pol = strchr(buf, '=');
+	if ( NULL == pol )
+		return 0;
+	*pol++ = '\0';
+
+	for(i = 0; i < TCP_POLICY_MAX; i++)
+		if ( !strcmp(pol, policy_name[i]) )
+			break;
+	if ( i >= TCP_POLICY_MAX )
+		return 0;
+	p->policy = i;
+
+	p->len = 32;
+	slash = strchr(buf, '/');
+	if ( slash ) {
+		*slash++ = '\0';
+		plen = strtoul(slash, &end, 10);
+		if ( end == slash || *end != '\0' || plen > 32 )
+			return 0;
+		p->len = plen;
+	}
+
+	if ( !inet_aton(buf, &in) )
+		return 0;
+
+	p->mask = (p->len) ? ~0U << (32 - p->len) : 0;
+	p->net = be32toh(in.s_addr) & p->mask;
+	return 1;
+}
+
+static int u32_cmp(const void *A, const void *B)
+{
+	const uint32_t *a = A, *b = B;
+	if ( *a < *b )
+		return -1;
+	return (*a > *b);
+}
+
+/* Every prefix starts a range and the address after its end starts
+ * another, within each one the longest matching prefix applies.
+ */
+static int flatten(const struct prefix *p, unsigned int num)
+{
+	uint32_t *edge;
+	unsigned int i, j, n;
+	int best;
+
+	edge = malloc(sizeof(*edge) * (num * 2 + 1));
+	ranges = malloc(sizeof(*ranges) * (num * 2 + 1));
+	if ( NULL == edge || NULL == ranges ) {
+		free(edge);
+		free(ranges);
+		ranges = NULL;
+		return 0;
+	}
+
+	n = 0;
+	edge[n++] = 0;
+	for(i = 0; i < num; i++) {
+		edge[n++] = p[i].net;
+		if ( (p[i].net | ~p[i].mask) != ~0U )
+			edge[n++] = (p[i].net | ~p[i].mask) + 1;
+	}
+	qsort(edge, n, sizeof(*edge), u32_cmp);
+
+	for(num_ranges = i = 0; i < n; i++) {
+		uint8_t policy = default_policy;
+
+		if ( i && edge[i] == edge[i - 1] )
+			continue;
+
+		for(best = -1, j = 0; j < num; j++) {
+			if ( (edge[i] & p[j].mask) != p[j].net )
+				continue;
+			if ( best < 0 || p[j].len >= p[best].len )
+				best = j;
+		}
+		if ( best >= 0 )
+			policy = p[best].policy;
+
+		if ( num_ranges && ranges[num_ranges - 1].policy == policy )
+			continue;
+
+		ranges[num_ranges].lo = edge[i];
+		ranges[num_ranges].policy = policy;
+		num_ranges++;
+	}
+
+	free(edge);
+	return 1;
+}
+
+int _tcp_policy_ctor(void)
+{
+	struct prefix pfx[MAX_PREFIXES];
+	const char *str, *end;
+	unsigned int num = 0;
+	size_t len;
+
+	str = getenv("FIRESTORM_TCP_POLICY");
+	if ( NULL == str || '\0' == *str )
+		return 1;
+
+	for(; *str; str = (*end) ? end + 1 : end) {
+		end = strchr(str, ',');
+		if ( NULL == end )
+			end = str + strlen(str);
+		len = end - str;
+
+		if ( num >= MAX_PREFIXES ) {
+			mesg(M_WARN, "FIRESTORM_TCP_POLICY: too many prefixes");
+			break;
+		}
+
+		if ( !parse_prefix(&pfx[num], str, len) ) {
+			mesg(M_WARN, "FIRESTORM_TCP_POLICY: bad entry: %.*s",
+				(int)len, str);
+			continue;
+		}
+		num++;
+	}
+
+	if ( !flatten(pfx, num) )
+		return 0;
+
+	mesg(M_INFO, "tcp_policy: %u prefixes in %u ranges, default %s",
+		num, num_ranges, policy_name[default_policy]);
+	return 1;
+}
+
+void _tcp_policy_dtor(void)
+{
+	free(ranges);
+	ranges = NULL;
+	num_ranges = 0;
+}
@@ -2,7 +2,10 @@
  * Author: Gianni Tedesco (gianni at scaramanga dot co dot uk)
  *
  * This is a fast tcp stream reassembly module which manages allocation of
- * contiguous chunks of memory (say 2 to the power of 7-9 bytes).
+ * contiguous chunks of memory (2 to the power of 8-12 bytes). Each stream
+ * picks a chunk size from what it's seen of segment sizes and how much
+ * data turns up per push, so interactive streams stay compact while bulk
+ * transfers use a few big chunks.
 */
 #include <firestorm.h>
 #include <f_packet.h>
@@ -10,37 +13,68 @@
 #include <list.h>
 #include <p_tcp.h>
 #include <pkt/tcp.h>
+#include <f_trace.h>
 #include "tcpip.h"
 
+#include <unistd.h>
+#include <time.h>
+
 #if 0
 #define ddmesg mesg
 #else
 #define ddmesg(x...) do { } while(0);
 #endif
 
-#if 1
-#define dmesg mesg
-#else
-#define dmesg(x...) do { } while(0);
+/* Check s_gap_bytes against the tree after every fill. That's a walk of
+ * the whole tree each time, so it's for stream_check, not production.
+ */
+#ifndef TCP_REASM_CHECK_GAPS
+#define TCP_REASM_CHECK_GAPS 0
 #endif
 
-#define RBUF_SHIFT	8
-#define RBUF_SIZE	(1<<RBUF_SHIFT)
-#define RBUF_MASK	(RBUF_SIZE - 1)
-#define RBUF_BASE	(~RBUF_MASK)
+/* configuration options */
+/* most data we'll hold beyond a hole in one direction of a stream */
+static const uint32_t max_ooo = 256 << 10;
+/* bytes of each direction to reassemble if the app doesn't say, 0 for all */
+static const uint32_t max_depth = 0;
+/* whether to bother with streams that no app is bound to */
+static const int reasm_unbound = 0;
+/* hold data from stable capture buffers by reference instead of copying */
+static const int ref_mode = 1;
+
+/* chunk size classes, a chunk can't be bigger than a memchunk (4K) */
+#define RBUF_MIN_SHIFT	8
+#define RBUF_MAX_SHIFT	12
+#define RBUF_CLASSES	(RBUF_MAX_SHIFT - RBUF_MIN_SHIFT + 1)
+/* initial slots in a chunk ring, doubled whenever the window outgrows it */
+#define RBUF_RING_MIN	8
 
 struct tcp_rbuf {
-	/** List entry */
-	struct list_head	r_list;
 	/** buffer base pointer */
 	uint8_t			*r_base;
 	/** sequence number of first byte of buffer */
 	uint32_t		r_seq;
 };
 
+/* Holes in the stream are kept in a treap keyed on g_begin, the
+ * priorities are seeded at startup so they can't be steered by an attacker
+ * picking sequence numbers. The same trees record which segment sent each
+ * range of out of order data, for the overlap policies that need to know.
+ */
 struct tcp_gap {
+	struct tcp_gap		*g_left;
+	struct tcp_gap		*g_right;
 	uint32_t 		g_begin;
 	uint32_t 		g_end;
+	uint32_t		g_prio;
+};
+
+/* Segment held by reference to the packet it arrived in */
+struct tcp_seg {
+	struct list_head	d_list;
+	const uint8_t		*d_ptr;
+	uint32_t		d_seq;
+	uint32_t		d_len;
 };
 
 struct tcp_ptr {
@@ -48,14 +82,35 @@ struct tcp_ptr {
 	uint32_t		p_seq;
 };
 
-/* Reassembly buffer */
-#define TCP_REASM_MAX_GAPS	20
+/* Reassembly buffer. Chunks live in a ring indexed by their distance in
+ * chunks from s_ring_seq, which is only moved when the ring is empty, so
+ * finding the chunk for a sequence number is a shift and a mask. The ring
+ * is always big enough to hold every chunk from s_begin to s_end, which
+ * is also how it's walked in order.
+ *
+ * While all the data came from stable capture buffers and no two segments
+ * overlapped, the stream is in reference mode: there are no chunks, just
+ * a list of segments in sequence order. Anything else copies them out.
+ */
 struct tcp_sbuf {
-	/** Buffer list */
-	struct list_head	s_bufs;
-	struct tcp_rbuf		*s_contig;
-	/** array of gap descriptors */
-	struct tcp_gap		*s_gap[TCP_REASM_MAX_GAPS];
+	/** chunk ring */
+	struct tcp_rbuf		**s_ring;
+	uint32_t		s_ring_sz;
+	/** sequence number that maps to slot zero */
+	uint32_t		s_ring_seq;
+	/** segments, in reference mode */
+	struct list_head	s_segs;
+	uint32_t		s_num_segs;
+	/** tree of gap descriptors */
+	struct tcp_gap		*s_gaps;
+	/** number of gaps and total bytes missing from them */
+	uint32_t		s_num_gaps;
+	uint32_t		s_gap_bytes;
+	/** out of order data by the segment that it came from */
+	struct tcp_gap		*s_pieces;
+	uint32_t		s_num_pieces;
+	/** sequence number of the first byte of the stream */
+	uint32_t		s_isn;
 	/** begin seq for buffer purposes */
 	uint32_t		s_begin;
 	/** Sequence of first byte not reassembled */
@@ -65,34 +120,98 @@ struct tcp_sbuf {
 	uint32_t		s_end;
 	/** Number of allocated rbufs */
 	uint16_t		s_num_rbuf;
-	/** number of gaps in reassembly */
-	uint8_t			s_num_gaps;
-	uint8_t			_pad0;
+	/** log2 of chunk size */
+	uint8_t			s_shift;
+	/** in reference mode */
+	uint8_t			s_ref;
+	/** overlap policy of the receiving host */
+	uint8_t			s_policy;
+	/** largest segment seen */
+	uint16_t		s_mss;
+	/** bytes made available by the last push */
+	uint32_t		s_flight;
+	/** memory held, counting the sbuf itself and the ring */
+	uint32_t		s_mem;
+	uint32_t		s_objs;
+	/** reassembler this stream belongs to */
+	struct tcp_reasm	*s_reasm;
 };
 
-static objcache_t sbuf_cache;
-static objcache_t rbuf_cache;
-static objcache_t data_cache;
-static objcache_t gap_cache;
-static unsigned int max_gaps;
-static unsigned int num_push;
-static unsigned int num_reasm;
-static unsigned int num_inject;
-static uint64_t inject_bytes;
+static const char * const data_label[RBUF_CLASSES] = {
+	"tcp_data256",
+	"tcp_data512",
+	"tcp_data1K",
+	"tcp_data2K",
+	"tcp_data4K",
+};
 
-static uint32_t seq_base(struct tcp_sbuf *s, uint32_t seq)
+/* One per tracker instance, sessions find it through their tracker and
+ * streams keep a pointer back to it.
+ */
+struct tcp_reasm {
+	struct tcpflow *tf;
+
+	/* memory caches */
+	objcache_t sbuf_cache;
+	objcache_t rbuf_cache;
+	objcache_t data_cache[RBUF_CLASSES];
+	objcache_t gap_cache;
+	objcache_t seg_cache;
+	struct tcp_app_inst *apps;
+	uint32_t gap_seed;
+
+	/* vectors for handing stream data to apps, grown on demand */
+	struct ro_vec *vbuf;
+	size_t vbuf_sz;
+
+	/* stats */
+	unsigned int max_gaps;
+	uint32_t max_ring;
+	unsigned int num_ooo_drop;
+	unsigned int num_push;
+	unsigned int num_reasm;
+	unsigned int num_inject;
+	unsigned int num_rechunk;
+	unsigned int num_chunks[RBUF_CLASSES];
+	unsigned int num_stall;
+	unsigned int num_bypass_depth;
+	unsigned int num_bypass_app;
+	unsigned int num_bypass_unbound;
+	uint64_t bypass_bytes;
+	unsigned int num_ref;
+	unsigned int num_unref;
+	unsigned int num_overlap;
+	unsigned int num_conflict;
+	unsigned int num_missing;
+	unsigned int num_ack_behind;
+	uint64_t ref_bytes;
+	uint64_t inject_bytes;
+	uint64_t push_bytes;
+};
+
+static uint32_t rbuf_size(struct tcp_sbuf *s)
 {
-	return s->s_begin + (tcp_diff(s->s_begin, seq) & RBUF_BASE);
+	return 1U << s->s_shift;
 }
 
-static uint32_t seq_ofs(struct tcp_sbuf *s, uint32_t seq)
+static uint32_t rbuf_mask(struct tcp_sbuf *s)
+{
+	return rbuf_size(s) - 1;
+}
+
+static objcache_t rbuf_data_cache(struct tcp_sbuf *s)
+{
+	return s->s_reasm->data_cache[s->s_shift - RBUF_MIN_SHIFT];
+}
+
+static uint32_t seq_base(struct tcp_sbuf *s, uint32_t seq)
 {
-	return tcp_diff(s->s_begin, seq) & RBUF_MASK;
+	return s->s_begin + (tcp_diff(s->s_begin, seq) & ~rbuf_mask(s));
 }
 
-static void gap_free(struct tcp_gap *g)
+static uint32_t seq_ofs(struct tcp_sbuf *s, uint32_t seq)
 {
-	objcache_free2(gap_cache, g);
+	return tcp_diff(s->s_begin, seq) & rbuf_mask(s);
 }
 
 static uint32_t gap_len(struct tcp_gap *g)
@@ -101,304 +220,678 @@ static uint32_t gap_len(struct tcp_gap *g)
 	return tcp_diff(g->g_begin, g->g_end);
 }
 
-static uint32_t rbuf_end_seq(struct tcp_rbuf *r)
+/* Everything a stream holds is charged to it as it's allocated so that
+ * its footprint is known without walking anything.
+ */
+static void *stream_alloc(struct tcp_session *ss, struct tcp_sbuf *s,
+				objcache_t o)
+{
+	void *ret;
+
+	ret = _tcp_alloc(ss->tf, ss, o);
+	if ( ret ) {
+		s->s_mem += objcache_size(o);
+		s->s_objs++;
+	}
+	return ret;
+}
+
+static void stream_release(struct tcp_sbuf *s, objcache_t o, void *obj)
+{
+	s->s_mem -= objcache_size(o);
+	s->s_objs--;
+	_tcp_release(s->s_reasm->tf, o, obj);
+}
+
+static void gap_free(struct tcp_sbuf *s, struct tcp_gap *g)
 {
-	return r->r_seq + RBUF_SIZE;
+	s->s_gap_bytes -= gap_len(g);
+	s->s_num_gaps--;
+	stream_release(s, s->s_reasm->gap_cache, g);
+}
+
+static uint32_t rbuf_end_seq(struct tcp_sbuf *s, struct tcp_rbuf *r)
+{
+	return r->r_seq + rbuf_size(s);
+}
+
+static uint32_t ring_slot(struct tcp_sbuf *s, uint32_t seq)
+{
+	return ((seq - s->s_ring_seq) >> s->s_shift) & (s->s_ring_sz - 1);
+}
+
+/* Room for chunks up to number want counting from s_begin */
+static int ring_grow(struct tcp_session *ss, struct tcp_sbuf *s,
+			uint32_t want)
+{
+	struct tcp_reasm *tr = s->s_reasm;
+	struct tcp_rbuf **old = s->s_ring;
+	uint32_t old_sz = s->s_ring_sz;
+	uint32_t i, sz;
+
+	for(sz = (old_sz) ? old_sz << 1 : RBUF_RING_MIN; sz < want; sz <<= 1)
+		/* nothing */;
+
+	s->s_ring = _tcp_alloc_array(tr->tf, ss, sz, sizeof(*s->s_ring));
+	if ( NULL == s->s_ring ) {
+		s->s_ring = old;
+		return 0;
+	}
+
+	s->s_ring_sz = sz;
+	for(i = 0; i < old_sz; i++)
+		if ( old[i] )
+			s->s_ring[ring_slot(s, old[i]->r_seq)] = old[i];
+	if ( old )
+		_tcp_release_array(tr->tf, old, old_sz, sizeof(*old));
+
+	s->s_mem += (sz - old_sz) * sizeof(*s->s_ring);
+	if ( 0 == old_sz )
+		s->s_objs++;
+
+	if ( sz > tr->max_ring )
+		tr->max_ring = sz;
+	return 1;
 }
 
 static struct tcp_rbuf *rbuf_alloc(struct tcp_session *ss,
 					struct tcp_sbuf *s, uint32_t seq)
 {
+	struct tcp_reasm *tr = s->s_reasm;
 	struct tcp_rbuf *r;
-	assert(((seq - s->s_begin) & RBUF_MASK) == 0);
-	r = _tcp_alloc(ss, rbuf_cache, 1);
+	assert(((seq - s->s_begin) & rbuf_mask(s)) == 0);
+	r = stream_alloc(ss, s, tr->rbuf_cache);
 	if ( r ) {
-		s->s_num_rbuf++;
-		INIT_LIST_HEAD(&r->r_list);
 		r->r_seq = seq;
-		r->r_base = _tcp_alloc(ss, data_cache, 1);
+		r->r_base = stream_alloc(ss, s, rbuf_data_cache(s));
 		if ( NULL == r->r_base ) {
-			objcache_free2(rbuf_cache, r);
+			stream_release(s, tr->rbuf_cache, r);
 			return NULL;
 		}
+		s->s_num_rbuf++;
+		tr->num_chunks[s->s_shift - RBUF_MIN_SHIFT]++;
 		ddmesg(M_DEBUG, " Allocated rbuf %u seq=%u",
 			s->s_num_rbuf, seq);
 	}
 	return r;
 }
 
-static void rbuf_free(struct tcp_sbuf *s, struct tcp_rbuf *r)
+static void rbuf_release(struct tcp_sbuf *s, struct tcp_rbuf *r)
 {
-	list_del(&r->r_list);
-	objcache_free2(data_cache, r->r_base);
-	objcache_free2(rbuf_cache, r);
+	stream_release(s, rbuf_data_cache(s), r->r_base);
+	stream_release(s, s->s_reasm->rbuf_cache, r);
 	s->s_num_rbuf--;
 }
 
-static struct tcp_rbuf *rbuf_next(struct tcp_sbuf *s, struct tcp_rbuf *r)
+static void rbuf_free(struct tcp_sbuf *s, struct tcp_rbuf *r)
+{
+	s->s_ring[ring_slot(s, r->r_seq)] = NULL;
+	rbuf_release(s, r);
+}
+
+/* Chunk starting at base, if there is one */
+static struct tcp_rbuf *rbuf_find(struct tcp_sbuf *s, uint32_t base)
 {
-	if ( r->r_list.next == &s->s_bufs )
+	struct tcp_rbuf *r;
+
+	if ( (tcp_diff(s->s_begin, base) >> s->s_shift) >= s->s_ring_sz )
 		return NULL;
-	return list_entry(r->r_list.next, struct tcp_rbuf, r_list);
+
+	r = s->s_ring[ring_slot(s, base)];
+	assert(NULL == r || r->r_seq == base);
+	return r;
 }
 
-static struct tcp_rbuf *rbuf_prev(struct tcp_sbuf *s, struct tcp_rbuf *r)
+/* Chunk starting at base, allocated if need be */
+static struct tcp_rbuf *rbuf_get(struct tcp_session *ss, struct tcp_sbuf *s,
+					uint32_t base)
 {
-	if ( r->r_list.prev == &s->s_bufs )
+	struct tcp_rbuf *r;
+	uint32_t n;
+
+	assert(!tcp_before(base, s->s_begin));
+	n = tcp_diff(s->s_begin, base) >> s->s_shift;
+	if ( n >= s->s_ring_sz && !ring_grow(ss, s, n + 1) )
 		return NULL;
-	return list_entry(r->r_list.prev, struct tcp_rbuf, r_list);
+
+	r = s->s_ring[ring_slot(s, base)];
+	if ( r ) {
+		assert(r->r_seq == base);
+		return r;
+	}
+
+	r = rbuf_alloc(ss, s, base);
+	if ( NULL == r )
+		return NULL;
+
+	s->s_ring[ring_slot(s, base)] = r;
+	return r;
 }
 
-/* Allocates a new gap ready for insertion in to the tree with the given
- * particulars.
- */
-static struct tcp_gap *gap_new(struct tcp_session *ss,
+static void ring_free(struct tcp_sbuf *s)
+{
+	uint32_t i;
+
+	for(i = 0; i < s->s_ring_sz; i++)
+		if ( s->s_ring[i] )
+			rbuf_release(s, s->s_ring[i]);
+
+	if ( s->s_ring ) {
+		s->s_mem -= s->s_ring_sz * sizeof(*s->s_ring);
+		s->s_objs--;
+		_tcp_release_array(s->s_reasm->tf, s->s_ring,
+					s->s_ring_sz, sizeof(*s->s_ring));
+	}
+	s->s_ring = NULL;
+	s->s_ring_sz = 0;
+}
+
+static struct tcp_gap *node_new(struct tcp_session *ss, struct tcp_sbuf *s,
 				uint32_t begin, uint32_t end)
 {
+	struct tcp_reasm *tr = s->s_reasm;
 	struct tcp_gap *g;
+	uint32_t h;
 
-	assert(!tcp_after(begin, end));
+	assert(tcp_after(end, begin));
 
-	g = _tcp_alloc(ss, gap_cache, 1);
+	g = stream_alloc(ss, s, tr->gap_cache);
 	if ( NULL != g ) {
+		g->g_left = g->g_right = NULL;
 		g->g_begin = begin;
 		g->g_end = end;
+
+		h = (begin ^ tr->gap_seed) * 0x9e3779b1;
+		g->g_prio = h ^ (h >> 16);
 	}
 
 	return g;
 }
 
-static struct tcp_rbuf *first_buffer(struct tcp_sbuf *s)
+/* Allocates a new gap ready for insertion in to the tree with the given
+ * particulars.
+ */
+static struct tcp_gap *gap_new(struct tcp_session *ss, struct tcp_sbuf *s,
+				uint32_t begin, uint32_t end)
 {
-	if ( list_empty(&s->s_bufs) )
-		return NULL;
-	return list_entry(s->s_bufs.next, struct tcp_rbuf, r_list);
+	struct tcp_reasm *tr = s->s_reasm;
+	struct tcp_gap *g;
+
+	g = node_new(ss, s, begin, end);
+	if ( NULL != g ) {
+		s->s_gap_bytes += gap_len(g);
+		if ( ++s->s_num_gaps > tr->max_gaps )
+			tr->max_gaps = s->s_num_gaps;
+	}
+
+	return g;
 }
 
-static struct tcp_rbuf *last_buffer(struct tcp_sbuf *s)
+/* Split a tree in to gaps beginning before seq and the rest */
+static void gap_split(struct tcp_gap *t, uint32_t seq,
+			struct tcp_gap **l, struct tcp_gap **r)
 {
-	if ( list_empty(&s->s_bufs) )
-		return NULL;
-	return list_entry(s->s_bufs.prev, struct tcp_rbuf, r_list);
+	if ( NULL == t ) {
+		*l = *r = NULL;
+		return;
+	}
+
+	if ( tcp_before(t->g_begin, seq) ) {
+		gap_split(t->g_right, seq, &t->g_right, r);
+		*l = t;
+	}else{
+		gap_split(t->g_left, seq, l, &t->g_left);
+		*r = t;
+	}
 }
 
-static struct tcp_rbuf *find_buf_fwd(struct tcp_session *ss,struct tcp_sbuf *s,
-					struct tcp_rbuf *r, uint32_t seq)
+/* Join two trees, every gap in l comes before every gap in r */
+static struct tcp_gap *gap_merge(struct tcp_gap *l, struct tcp_gap *r)
 {
-	struct tcp_rbuf *new;
+	if ( NULL == l )
+		return r;
+	if ( NULL == r )
+		return l;
+
+	if ( l->g_prio > r->g_prio ) {
+		l->g_right = gap_merge(l->g_right, r);
+		return l;
+	}else{
+		r->g_left = gap_merge(l, r->g_left);
+		return r;
+	}
+}
 
-	for(; r; r = rbuf_next(s, r)) {
-		if ( r->r_seq == seq )
-			break;
-		if ( tcp_after(r->r_seq, seq) ) {
-			new = rbuf_alloc(ss, s, seq);
-			if ( NULL == new )
-				return NULL;
-			list_add_tail(&new->r_list, &r->r_list);
-			r = new;
-			break;
+static struct tcp_gap *gap_first(struct tcp_gap *t)
+{
+	if ( t )
+		while ( t->g_left )
+			t = t->g_left;
+	return t;
+}
+
+static struct tcp_gap *gap_last(struct tcp_gap *t)
+{
+	if ( t )
+		while ( t->g_right )
+			t = t->g_right;
+	return t;
+}
+
+/* Last gap beginning at or before seq */
+static struct tcp_gap *gap_find(struct tcp_gap *t, uint32_t seq)
+{
+	struct tcp_gap *ret = NULL;
+
+	while ( t ) {
+		if ( tcp_after(t->g_begin, seq) ) {
+			t = t->g_left;
+		}else{
+			ret = t;
+			t = t->g_right;
 		}
 	}
 
-	if ( NULL == r ) {
-		new = rbuf_alloc(ss, s, seq);
-		if ( NULL == new )
-			return NULL;
-		list_add_tail(&new->r_list, &s->s_bufs);
-		r = new;
+	return ret;
+}
+
+/* First gap beginning after seq */
+static struct tcp_gap *gap_after(struct tcp_gap *t, uint32_t seq)
+{
+	struct tcp_gap *ret = NULL;
+
+	while ( t ) {
+		if ( tcp_after(t->g_begin, seq) ) {
+			ret = t;
+			t = t->g_left;
+		}else{
+			t = t->g_right;
+		}
 	}
 
-	return r;
+	return ret;
 }
 
-static struct tcp_rbuf *find_buf_rev(struct tcp_session *ss, struct tcp_sbuf *s,
-					struct tcp_rbuf *r, uint32_t seq)
+static void gap_free_tree(struct tcp_sbuf *s, struct tcp_gap *t,
+				struct tcp_gap *keep)
 {
-	struct tcp_rbuf *new;
+	if ( NULL == t )
+		return;
+	gap_free_tree(s, t->g_left, keep);
+	gap_free_tree(s, t->g_right, keep);
+	if ( t != keep )
+		gap_free(s, t);
+}
 
-	for(; r; r = rbuf_prev(s, r)) {
-		if ( r->r_seq == seq )
-			break;
-		if ( tcp_before(r->r_seq, seq) ) {
-			new = rbuf_alloc(ss, s, seq);
-			if ( NULL == new )
-				return NULL;
-			list_add(&new->r_list, &r->r_list);
-			r = new;
-			break;
+#if TCP_REASM_CHECK_GAPS
+/* Bytes missing from a tree of gaps, for checking s_gap_bytes */
+static uint32_t gap_bytes(struct tcp_gap *t)
+{
+	if ( NULL == t )
+		return 0;
+	return gap_bytes(t->g_left) + gap_len(t) + gap_bytes(t->g_right);
+}
+#endif
+
+/* New data has arrived for seq to seq_end: trim or remove the gaps that it
+ * overlaps, splitting the one it lands in the middle of.
+ */
+static int gap_fill(struct tcp_session *ss, struct tcp_sbuf *s,
+			uint32_t seq, uint32_t seq_end)
+{
+	struct tcp_gap *l, *m, *r, *g, *n;
+
+	gap_split(s->s_gaps, seq, &l, &m);
+	gap_split(m, seq_end, &m, &r);
+
+	/* the gap before might run in to, or right over, the data */
+	g = gap_last(l);
+	if ( g && tcp_after(g->g_end, seq) ) {
+		if ( tcp_after(g->g_end, seq_end) ) {
+			n = gap_new(ss, s, seq_end, g->g_end);
+			if ( NULL == n ) {
+				s->s_gaps = gap_merge(l, gap_merge(m, r));
+				return 0;
+			}
+			ddmesg(M_DEBUG, " split gap %u-%u at %u-%u",
+				g->g_begin, g->g_end, seq, seq_end);
+			s->s_gap_bytes -= tcp_diff(seq_end, g->g_end);
+			g->g_end = seq_end;
+			r = gap_merge(n, r);
 		}
+		s->s_gap_bytes -= tcp_diff(seq, g->g_end);
+		g->g_end = seq;
 	}
 
-	if ( NULL == r ) {
-		new = rbuf_alloc(ss, s, seq);
-		if ( NULL == new )
-			return NULL;
-		list_add_tail(&new->r_list, &s->s_bufs);
-		r = new;
+	/* gaps starting within the data are swallowed, bar the tail end of
+	 * the last one */
+	g = gap_last(m);
+	if ( g && !tcp_after(g->g_end, seq_end) )
+		g = NULL;
+	gap_free_tree(s, m, g);
+	if ( g ) {
+		s->s_gap_bytes -= tcp_diff(g->g_begin, seq_end);
+		g->g_begin = seq_end;
+		g->g_left = g->g_right = NULL;
+		r = gap_merge(g, r);
 	}
 
-	return r;
+	s->s_gaps = gap_merge(l, r);
+#if TCP_REASM_CHECK_GAPS
+	assert(s->s_gap_bytes == gap_bytes(s->s_gaps));
+#endif
+	return 1;
 }
 
-static struct tcp_rbuf *contig_buf(struct tcp_session *ss,
-					struct tcp_sbuf *s, uint32_t seq)
+/* Bytes held beyond the contiguous part of the stream */
+static uint32_t ooo_bytes(struct tcp_sbuf *s)
 {
-	struct tcp_rbuf *r;
-
-	r = (s->s_contig) ? s->s_contig : first_buffer(s);
-	return find_buf_fwd(ss, s, r, seq);
+	return tcp_diff(s->s_contig_seq, s->s_end) - s->s_gap_bytes;
 }
 
-static struct tcp_rbuf *discontig_buf(struct tcp_session *ss,
-					struct tcp_sbuf *s, uint32_t seq)
+/* Copy data in to chunks, allocating them as needed */
+static int copy_in(struct tcp_session *ss, struct tcp_sbuf *s,
+			uint32_t seq, uint32_t len, const uint8_t *buf)
 {
+	uint32_t seq_end = seq + len;
+	uint32_t base, ofs, clen, sseq;
 	struct tcp_rbuf *r;
-	r = find_buf_rev(ss, s, last_buffer(s), seq);
-	return r;
+
+	ddmesg(M_DEBUG, "Copying data to buffers:");
+	for(sseq = seq; tcp_before(sseq, seq_end); ) {
+		base = seq_base(s, sseq);
+		ofs = seq_ofs(s, sseq);
+		clen = ((ofs + len) > rbuf_size(s)) ? (rbuf_size(s) - ofs) : len;
+
+		r = rbuf_get(ss, s, base);
+		if ( NULL == r )
+			return 0;
+
+		ddmesg(M_DEBUG, " Copy data: base=%u ofs=%u len=%u",
+			base, ofs, clen);
+		memcpy(r->r_base + ofs, buf, clen);
+
+		sseq += clen;
+		buf += clen;
+		len -= clen;
+
+		assert(!tcp_after(sseq, seq_end));
+	}
+
+	return 1;
 }
 
-static void swallow_gap(struct tcp_sbuf *s, unsigned int i)
+static void seg_free(struct tcp_sbuf *s, struct tcp_seg *d)
 {
-	ddmesg(M_DEBUG, "Swallow gap %u %u-%u", i,
-		s->s_gap[i]->g_begin, s->s_gap[i]->g_end);
-	gap_free(s->s_gap[i]);
-	for(--s->s_num_gaps; i < s->s_num_gaps; i++) {
-		ddmesg(M_DEBUG, " Shuffle gap %u to %u", i + 1, i);
-		s->s_gap[i] = s->s_gap[i + 1];
-	}
+	list_del(&d->d_list);
+	stream_release(s, s->s_reasm->seg_cache, d);
+	s->s_num_segs--;
 }
 
-static void contig_eat_gaps(struct tcp_sbuf *s,
-				uint32_t seq_end)
+/* Keep a reference to the data, segments nearly always go on the end */
+static int ref_in(struct tcp_session *ss, struct tcp_sbuf *s,
+			uint32_t seq, uint32_t len, const uint8_t *buf)
 {
-	unsigned int i = 0;
-	struct tcp_gap *g = NULL;
+	struct tcp_reasm *tr = s->s_reasm;
+	struct tcp_seg *d, *pos;
+
+	d = stream_alloc(ss, s, tr->seg_cache);
+	if ( NULL == d )
+		return 0;
 
-	while(s->s_num_gaps) {
-		g = s->s_gap[0];
+	d->d_ptr = buf;
+	d->d_seq = seq;
+	d->d_len = len;
 
-		if ( tcp_before(seq_end, g->g_begin) )
-			break;
-		if ( tcp_before(seq_end, g->g_end) ) {
-			g->g_begin = seq_end;
+	list_for_each_entry_reverse(pos, &s->s_segs, d_list)
+		if ( tcp_before(pos->d_seq, seq) )
 			break;
-		}
-		swallow_gap(s, i);
-		g = NULL;
-	}
+	list_add(&d->d_list, &pos->d_list);
 
-	if ( g ) {
-		ddmesg(M_DEBUG, " new contig_seq: %u -> %u",
-			s->s_contig_seq, g->g_begin);
-		s->s_contig_seq = g->g_begin;
-	}else{
-		ddmesg(M_DEBUG, " new contig_seq: %u -> %u (buffer contig)",
-			s->s_contig_seq, seq_end);
-		if ( tcp_after(seq_end, s->s_end) )
-			s->s_contig_seq = seq_end;
-		else
-			s->s_contig_seq = s->s_end;
-	}
+	s->s_num_segs++;
+	tr->num_ref++;
+	tr->ref_bytes += len;
+	return 1;
 }
 
-static int append_gap(struct tcp_session *ss, struct tcp_sbuf *s,
-			struct tcp_rbuf *r, uint32_t seq, uint32_t seq_end)
+/* Does seq to seq_end land on data we already have? It doesn't if it's
+ * all beyond the end or all in one gap.
+ */
+static int overlaps(struct tcp_sbuf *s, uint32_t seq, uint32_t seq_end)
 {
-	ddmesg(M_DEBUG, "Appending gap %u-%u", s->s_end, seq);
-	if (s->s_num_gaps >= TCP_REASM_MAX_GAPS) {
-		mesg(M_CRIT, "tcp_reasm: MAX_GAPS exceeded");
+	struct tcp_gap *g;
+
+	if ( !tcp_before(seq, s->s_end) )
 		return 0;
+
+	g = gap_find(s->s_gaps, seq);
+	if ( NULL == g || !tcp_before(seq, g->g_end) )
+		return 1;
+	return tcp_after(seq_end, g->g_end);
+}
+
+static int track_pieces(struct tcp_sbuf *s)
+{
+	return (s->s_policy == TCP_POLICY_BSD ||
+		s->s_policy == TCP_POLICY_LINUX);
+}
+
+static void piece_free_tree(struct tcp_sbuf *s, struct tcp_gap *t,
+				struct tcp_gap *keep)
+{
+	if ( NULL == t )
+		return;
+	piece_free_tree(s, t->g_left, keep);
+	piece_free_tree(s, t->g_right, keep);
+	if ( t != keep ) {
+		stream_release(s, s->s_reasm->gap_cache, t);
+		s->s_num_pieces--;
 	}
-	s->s_gap[s->s_num_gaps] = gap_new(ss, s->s_end, seq);
-	if ( ++s->s_num_gaps > max_gaps )
-		max_gaps = s->s_num_gaps;
-	return 1;
 }
 
-static int split_gap(struct tcp_session *ss, struct tcp_sbuf *s,
-			int i, struct tcp_rbuf *r,
+/* Record that seq to seq_end came from one segment, it takes over the
+ * pieces that it covers. Nothing before seq may run in to it.
+ */
+static int piece_add(struct tcp_session *ss, struct tcp_sbuf *s,
 			uint32_t seq, uint32_t seq_end)
 {
-	int n, j;
+	struct tcp_gap *l, *m, *r, *g, *n;
 
-	if (s->s_num_gaps >= TCP_REASM_MAX_GAPS) {
-		mesg(M_CRIT, "tcp_reasm: MAX_GAPS exceeded");
+	n = node_new(ss, s, seq, seq_end);
+	if ( NULL == n )
 		return 0;
+	s->s_num_pieces++;
+
+	gap_split(s->s_pieces, seq, &l, &m);
+	gap_split(m, seq_end, &m, &r);
+
+	g = gap_last(l);
+	assert(NULL == g || !tcp_after(g->g_end, seq));
+
+	g = gap_last(m);
+	if ( g && !tcp_after(g->g_end, seq_end) )
+		g = NULL;
+	piece_free_tree(s, m, g);
+	if ( g ) {
+		g->g_begin = seq_end;
+		g->g_left = g->g_right = NULL;
+		r = gap_merge(g, r);
 	}
 
-	ddmesg(M_DEBUG, "Split gap");
-	for(n = i + 1, j = s->s_num_gaps; j > n; --j) {
-		ddmesg(M_DEBUG, " Shuffle gap %d to %d", j - 1, j);
-		s->s_gap[j] = s->s_gap[j - 1];
+	s->s_pieces = gap_merge(l, gap_merge(n, r));
+	return 1;
+}
+
+/* Contiguous data is past arguing over */
+static void piece_prune(struct tcp_sbuf *s)
+{
+	struct tcp_gap *l;
+
+	gap_split(s->s_pieces, s->s_contig_seq, &l, &s->s_pieces);
+	piece_free_tree(s, l, NULL);
+}
+
+/* Length of the run from seq towards end that's either all held or all
+ * missing.
+ */
+static uint32_t run_len(struct tcp_sbuf *s, uint32_t seq, uint32_t end,
+			int *held)
+{
+	struct tcp_gap *g;
+	uint32_t stop;
+
+	if ( !tcp_before(seq, s->s_end) ) {
+		*held = 0;
+		return tcp_diff(seq, end);
 	}
 
-	ddmesg(M_DEBUG, " gap %d-%u: %u-%u -> (%u-%u, %u-%u)", i, n,
-		s->s_gap[i]->g_begin, s->s_gap[i]->g_end,
-		s->s_gap[i]->g_begin, seq,
-		seq_end, s->s_gap[i]->g_end);
+	g = gap_find(s->s_gaps, seq);
+	if ( g && tcp_before(seq, g->g_end) ) {
+		*held = 0;
+		stop = g->g_end;
+	}else{
+		*held = 1;
+		g = gap_after(s->s_gaps, seq);
+		stop = (g) ? g->g_begin : s->s_end;
+	}
 
-	s->s_gap[n] = gap_new(ss, seq_end, s->s_gap[i]->g_end);
-	s->s_gap[i]->g_end = seq;
-	if ( ++s->s_num_gaps > max_gaps )
-		max_gaps = s->s_num_gaps;
-	return 1;
+	if ( tcp_after(stop, end) )
+		stop = end;
+	return tcp_diff(seq, stop);
 }
 
-static int frob_gaps(struct tcp_session *ss, struct tcp_sbuf *s,
-			struct tcp_rbuf *r, uint32_t seq, uint32_t seq_end)
+/* Is the data we hold from seq any different to buf */
+static int differs(struct tcp_sbuf *s, uint32_t seq, uint32_t len,
+			const uint8_t *buf)
 {
-	unsigned int i;
+	uint32_t ofs, clen;
+	struct tcp_rbuf *r;
 
-	for(i = 0; i < s->s_num_gaps; i++) {
-		struct tcp_gap *g = s->s_gap[i];
-		if ( tcp_after(seq, g->g_begin) ) {
-			if ( tcp_after(seq, g->g_end) )
-				continue;
+	while ( len ) {
+		ofs = seq_ofs(s, seq);
+		clen = rbuf_size(s) - ofs;
+		if ( clen > len )
+			clen = len;
 
-			/* There can be...only one */
-			if ( tcp_before(seq_end, g->g_end) ) {
-				if ( !split_gap(ss, s, i, r, seq, seq_end) )
-					return 0;
-				return 1;
-			}
+		r = rbuf_find(s, seq_base(s, seq));
+		assert(NULL != r);
+		if ( memcmp(r->r_base + ofs, buf, clen) )
+			return 1;
 
-			ddmesg(M_DEBUG, "Backward overlap");
-			ddmesg(M_DEBUG, " %u-%u -> %u-%u",
-				g->g_begin, g->g_end,
-				g->g_begin, seq);
-			g->g_end = seq;
-		}else{
-			if ( tcp_after(g->g_begin, seq) )
-				break;
+		seq += clen;
+		buf += clen;
+		len -= clen;
+	}
+
+	return 0;
+}
+
+/* Copy in data that overlaps what we hold, keeping whichever copy the
+ * receiving host would. First (and Windows) keep the old data and last
+ * takes the new. BSD keeps the old data of a segment that the new one
+ * starts inside of, Linux too unless they start together and the new one
+ * is longer. Beyond that the new segment started first so it wins.
+ */
+static int resolve(struct tcp_session *ss, struct tcp_sbuf *s,
+			uint32_t seq, uint32_t len, const uint8_t *buf)
+{
+	struct tcp_reasm *tr = s->s_reasm;
+	uint32_t seq_end = seq + len;
+	uint32_t win, sseq, clen;
+	struct tcp_gap *p;
+	int held, conflict = 0;
+
+	switch(s->s_policy) {
+	case TCP_POLICY_LAST:
+		win = seq;
+		break;
+	case TCP_POLICY_BSD:
+	case TCP_POLICY_LINUX:
+		win = seq;
+		p = gap_find(s->s_pieces, seq);
+		if ( NULL == p || !tcp_after(p->g_end, seq) )
+			break;
+		if ( s->s_policy == TCP_POLICY_LINUX &&
+				p->g_begin == seq &&
+				tcp_after(seq_end, p->g_end) )
+			break;
+		win = (tcp_before(p->g_end, seq_end)) ? p->g_end : seq_end;
+		break;
+	default:
+		win = seq_end;
+		break;
+	}
 
-			if ( !tcp_before(seq_end, g->g_end) ) {
-				swallow_gap(s, i);
-				i--;
+	/* runs are split at win, before it the old data wins */
+	for(sseq = seq; tcp_before(sseq, seq_end); sseq += clen, buf += clen) {
+		clen = run_len(s, sseq,
+				(tcp_before(sseq, win)) ? win : seq_end,
+				&held);
+		if ( held ) {
+			if ( differs(s, sseq, clen, buf) )
+				conflict = 1;
+			if ( tcp_before(sseq, win) )
 				continue;
-			}
+		}
+		if ( !copy_in(ss, s, sseq, clen, buf) )
+			return 0;
+	}
+
+	tr->num_overlap++;
+	if ( conflict ) {
+		tmesg(TRACE_TCP_REASM, "conflicting overlap %u - %u, "
+			"%s policy", seq, seq_end,
+			_tcp_policy_name(s->s_policy));
+		tr->num_conflict++;
+	}
+
+	if ( track_pieces(s) && tcp_before(win, seq_end) )
+		return piece_add(ss, s, win, seq_end);
+	return 1;
+}
+
+/* Leave reference mode, copying whatever segments we have in to chunks */
+static int unref(struct tcp_session *ss, struct tcp_sbuf *s)
+{
+	struct tcp_seg *d, *tmp;
 
-			ddmesg(M_DEBUG, "Forward overlap");
-			ddmesg(M_DEBUG, " %u-%u -> %u-%u",
-				g->g_begin, g->g_end,
-				seq_end, g->g_end);
-			g->g_begin = seq_end;
+	s->s_ref = 0;
+	s->s_begin = s->s_reasm_begin;
+	s->s_ring_seq = s->s_begin;
+
+	if ( list_empty(&s->s_segs) )
+		return 1;
+
+	list_for_each_entry(d, &s->s_segs, d_list) {
+		if ( !copy_in(ss, s, d->d_seq, d->d_len, d->d_ptr) ) {
+			ring_free(s);
+			s->s_ref = 1;
+			return 0;
 		}
 	}
+
+	tmesg(TRACE_TCP_REASM, "copied out %u referenced segments",
+		s->s_num_segs);
+	list_for_each_entry_safe(d, tmp, &s->s_segs, d_list)
+		seg_free(s, d);
+	s->s_reasm->num_unref++;
 	return 1;
 }
 
 /* input packet data in to the reassembly system */
 static int do_inject(struct tcp_session *ss, struct tcp_sbuf *s,
-			uint32_t seq, uint32_t len, const uint8_t *buf)
+			uint32_t seq, uint32_t len, const uint8_t *buf,
+			int stable)
 {
 	uint32_t seq_end = seq + len;
-	uint32_t base, ofs, clen, sseq;
-	int is_contig;
-	struct tcp_rbuf *r, *lr;
+	int is_contig, overlap;
 
 	if ( NULL == s )
 		return 1;
 
+	if ( len > s->s_mss )
+		s->s_mss = (len > 0xffff) ? 0xffff : len;
+
 	ddmesg(M_DEBUG, "Inject Packet: %u - %u",
 		seq, seq + len);
 
@@ -417,118 +910,140 @@ static int do_inject(struct tcp_session *ss, struct tcp_sbuf *s,
 	ddmesg(M_DEBUG, " Trimmed data: %u - %u",
 		seq, seq + len);
 
-	/* Find or allocate buffer for first byte */
-	base = seq_base(s, seq);
 	if ( seq == s->s_contig_seq ) {
-		r = contig_buf(ss, s, base);
-		if ( NULL == r )
-			return 0;
-		contig_eat_gaps(s, seq_end);
 		is_contig = 1;
 	}else{
 		assert(tcp_after(seq, s->s_contig_seq));
-		is_contig = 0;
-		r = discontig_buf(ss, s, base);
-		if ( NULL == r )
-			return 0;
-		if ( tcp_after(seq, s->s_end) ) {
-			if ( !append_gap(ss, s, r, seq, seq_end) )
-				return 0;
-		}else{
-			if ( !frob_gaps(ss, s, r, seq, seq_end) )
-				return 0;
-		}
-	}
-
-	/* Copy payload data, allocating new buffers as needed */
-	ddmesg(M_DEBUG, "Copying data to buffers:");
-	for(sseq = seq; tcp_before(sseq, seq_end); r = rbuf_next(s, r)) {
-		struct tcp_rbuf *nr;
 
-		base = seq_base(s, sseq);
-		ofs = seq_ofs(s, sseq);
-		clen = ((ofs + len) > RBUF_SIZE) ? (RBUF_SIZE - ofs) : len;
+		/* The chunk ring spans the hole as well as the data, so
+		 * don't let it reach further past the hole than we'd hold
+		 * or one segment far ahead sizes it for the distance.
+		 */
+		if ( tcp_diff(s->s_contig_seq, seq) >= max_ooo ) {
+			tmesg(TRACE_TCP_REASM, "beyond out of order limit, "
+				"dropped %u - %u", seq, seq_end);
+			s->s_reasm->num_ooo_drop++;
+			return 1;
+		}
+		if ( tcp_diff(s->s_contig_seq, seq_end) > max_ooo ) {
+			seq_end = s->s_contig_seq + max_ooo;
+			len = tcp_diff(seq, seq_end);
+		}
 
-		if ( NULL == r ) {
-			nr = rbuf_alloc(ss, s, base);
-			if ( NULL == nr )
-				return 0;
-			list_add_tail(&nr->r_list, &s->s_bufs);
-			r = nr;
-		}else if ( tcp_after(base, r->r_seq) ) {
-			nr = rbuf_alloc(ss, s, base);
-			if ( NULL == nr )
-				return 0;
-			ddmesg(M_DEBUG, " ... and put it after %u", r->r_seq);
-			list_add(&nr->r_list, &r->r_list);
-			r = nr;
-		}else if ( tcp_before(base, r->r_seq) ) {
-			nr = rbuf_alloc(ss, s, base);
-			if ( NULL == nr )
-				return 0;
-			ddmesg(M_DEBUG, " ... and put it before %u", r->r_seq);
-			list_add_tail(&nr->r_list, &r->r_list);
-			r = nr;
+		if ( ooo_bytes(s) + len > max_ooo ) {
+			tmesg(TRACE_TCP_REASM, "out of order limit, dropped "
+				"%u - %u", seq, seq_end);
+			s->s_reasm->num_ooo_drop++;
+			return 1;
 		}
+		is_contig = 0;
+	}
 
-		ddmesg(M_DEBUG, " Copy data: base=%u:%u ofs=%u len=%u",
-			r->r_seq, base, ofs, clen);
-		assert(r->r_seq == base);
+	/* an empty stream can always go back to holding references */
+	if ( !s->s_ref && ref_mode && stable && 0 == s->s_num_rbuf )
+		s->s_ref = 1;
 
-		memcpy(r->r_base + ofs, buf, clen);
-		lr = r;
+	overlap = overlaps(s, seq, seq_end);
+	if ( s->s_ref && (!stable || overlap) ) {
+		if ( !unref(ss, s) )
+			return 0;
+	}
 
-		if ( is_contig )
-			s->s_contig = r;
+	if ( s->s_ref ) {
+		if ( !ref_in(ss, s, seq, len, buf) )
+			return 0;
+	}else if ( overlap ) {
+		if ( !resolve(ss, s, seq, len, buf) )
+			return 0;
+	}else{
+		if ( !copy_in(ss, s, seq, len, buf) )
+			return 0;
+	}
 
-		sseq += clen;
-		buf += clen;
-		len -= clen;
+	if ( !overlap && !is_contig && track_pieces(s) ) {
+		if ( !piece_add(ss, s, seq, seq_end) )
+			return 0;
+	}
 
-		assert(!tcp_after(sseq, seq_end));
+	/* Now the data's in, account for it */
+	if ( tcp_after(seq, s->s_end) ) {
+		struct tcp_gap *g;
+
+		ddmesg(M_DEBUG, "Appending gap %u-%u", s->s_end, seq);
+		g = gap_new(ss, s, s->s_end, seq);
+		if ( NULL == g )
+			return 0;
+		s->s_gaps = gap_merge(s->s_gaps, g);
+	}else if ( s->s_gaps ) {
+		if ( !gap_fill(ss, s, seq, seq_end) )
+			return 0;
 	}
 
 	if ( tcp_after(seq_end, s->s_end) ) {
 		ddmesg(M_DEBUG, " Setting seq_end to %u", seq_end);
 		s->s_end = seq_end;
 	}
+
+	if ( is_contig ) {
+		struct tcp_gap *g = gap_first(s->s_gaps);
+		s->s_contig_seq = (g) ? g->g_begin : s->s_end;
+		ddmesg(M_DEBUG, " new contig_seq: %u", s->s_contig_seq);
+		if ( s->s_pieces )
+			piece_prune(s);
+	}
 	return 1;
 }
 
 static void sbuf_free(struct tcp_session *ss, struct tcp_sbuf *s)
 {
-	struct tcp_rbuf *r, *tr;
-	unsigned int i;
+	struct tcp_reasm *tr;
+	struct tcp_seg *d, *tmp;
 
 	if ( NULL == s )
 		return;
 
-	if ( s->s_bufs.prev ) {
-		list_for_each_entry_safe(r, tr, &s->s_bufs, r_list) {
-			rbuf_free(s, r);
-		}
-	}
+	tr = s->s_reasm;
+	list_for_each_entry_safe(d, tmp, &s->s_segs, d_list)
+		seg_free(s, d);
+	ring_free(s);
+	gap_free_tree(s, s->s_gaps, NULL);
+	piece_free_tree(s, s->s_pieces, NULL);
 
-	for(i = 0; i < s->s_num_gaps; i++)
-		gap_free(s->s_gap[i]);
-
-	objcache_free2(sbuf_cache, s);
+	assert(1 == s->s_objs && objcache_size(tr->sbuf_cache) == s->s_mem);
+	_tcp_release(tr->tf, tr->sbuf_cache, s);
 }
 
 static struct tcp_sbuf *sbuf_new(struct tcp_session *ss, uint32_t isn)
 {
+	struct tcp_reasm *tr = ss->tf->reasm;
 	struct tcp_sbuf *s;
 
-	s = _tcp_alloc(ss, sbuf_cache, 1);
+	s = _tcp_alloc(ss->tf, ss, tr->sbuf_cache);
 	if ( s ) {
+		s->s_reasm = tr;
+		s->s_isn = isn;
 		s->s_begin = isn;
 		s->s_reasm_begin = isn;
 		s->s_end = isn;
-		INIT_LIST_HEAD(&s->s_bufs);
-		s->s_contig = NULL;
+		s->s_ring = NULL;
+		s->s_ring_sz = 0;
+		s->s_ring_seq = isn;
+		INIT_LIST_HEAD(&s->s_segs);
+		s->s_num_segs = 0;
+		s->s_ref = ref_mode;
 		s->s_contig_seq = isn;
+		s->s_gaps = NULL;
 		s->s_num_gaps = 0;
+		s->s_gap_bytes = 0;
+		s->s_pieces = NULL;
+		s->s_num_pieces = 0;
+		s->s_policy = TCP_POLICY_FIRST;
 		s->s_num_rbuf = 0;
+		s->s_shift = RBUF_MIN_SHIFT;
+		s->s_mss = 0;
+		s->s_flight = 0;
+		s->s_mem = objcache_size(tr->sbuf_cache);
+		s->s_objs = 1;
 	}
 
 	return s;
@@ -547,6 +1062,10 @@ static int alloc_reasm_buffers(struct tcp_session *s)
 		return 0;
 	}
 
+	/* overlaps are resolved the way the receiver would */
+	s->c_wnd.reasm->s_policy = _tcp_policy_lookup(s->s_addr);
+	s->s_wnd->reasm->s_policy = _tcp_policy_lookup(s->c_addr);
+
 	return 1;
 }
 
@@ -575,10 +1094,134 @@ static uint8_t get_chan(uint8_t to_srv)
 	return (to_srv) ? TCP_CHAN_TO_SERVER : TCP_CHAN_TO_CLIENT;
 }
 
+static void do_abort(struct tcp_session *s, uint8_t to_server)
+{
+	struct tcp_sbuf **pptr;
+
+	pptr = get_sbuf_ptr(s, to_server);
+	if ( NULL == pptr || NULL == *pptr )
+		return;
+
+	sbuf_free(s, *pptr);
+	*pptr = NULL;
+}
+
+static uint32_t stream_depth(struct tcp_session *ss)
+{
+	if ( ss->app && ss->app->a_depth )
+		return ss->app->a_depth;
+	return max_depth;
+}
+
+/* Stop buffering a direction, from here on the tracker just follows the
+ * sequence numbers.
+ */
+static void do_bypass(struct tcp_session *ss, uint8_t to_server)
+{
+	tmesg(TRACE_TCP_REASM, "bypass: to %s",
+		(to_server) ? "server" : "client");
+	ss->reasm_bypass |= get_chan(to_server);
+	do_abort(ss, to_server);
+}
+
+/* Apps can ask for a bypass from inside a_push, so their buffers are only
+ * dropped the next time we're in here.
+ */
+static int bypassed(struct tcp_session *ss, uint8_t to_server)
+{
+	if ( !(ss->reasm_bypass & get_chan(to_server)) )
+		return 0;
+	if ( get_sbuf(ss, to_server) ) {
+		do_bypass(ss, to_server);
+		ss->tf->reasm->num_bypass_app++;
+	}
+	return 1;
+}
+
+void tcp_sesh_bypass(tcp_sesh_t s, tcp_chan_t chans)
+{
+	s->reasm_bypass |= chans & (TCP_CHAN_TO_SERVER|TCP_CHAN_TO_CLIENT);
+}
+
 void _tcp_reasm_data(struct tcp_session *s, uint8_t to_server,
-			uint32_t seq, uint32_t len, const uint8_t *buf)
+			uint32_t seq, uint32_t len, const uint8_t *buf,
+			int stable)
+{
+	struct tcp_reasm *tr = s->tf->reasm;
+	struct tcp_sbuf *sb;
+	uint32_t depth, limit;
+
+	if ( bypassed(s, to_server) ) {
+		tr->bypass_bytes += len;
+		return;
+	}
+
+	sb = get_sbuf(s, to_server);
+	depth = stream_depth(s);
+	if ( sb && depth ) {
+		limit = sb->s_isn + depth;
+		if ( !tcp_before(seq, limit) ) {
+			tr->bypass_bytes += len;
+			return;
+		}
+		if ( tcp_after(seq + len, limit) ) {
+			tr->bypass_bytes += tcp_diff(limit, seq + len);
+			len = tcp_diff(seq, limit);
+		}
+	}
+
+	tr->num_inject++;
+	tr->inject_bytes += len;
+	do_inject(s, sb, seq, len, buf, stable);
+}
+
+void *tcp_sesh_priv(tcp_sesh_t s)
+{
+	return s->app_priv;
+}
+
+static void app_bind(struct tcp_session *s)
+{
+	struct tcp_app_inst *inst;
+	struct tcp_app *app;
+
+	app = _tcp_app_find_by_dport(s->s_port);
+	if ( NULL == app )
+		return;
+
+	inst = &s->tf->reasm->apps[app->a_idx];
+	if ( app->a_state_sz ) {
+		s->app_priv = _tcp_alloc(s->tf, s, inst->cache);
+		if ( NULL == s->app_priv )
+			return;
+	}
+
+	s->app = app;
+	if ( app->a_init && !app->a_init(s) ) {
+		if ( s->app_priv )
+			_tcp_release(s->tf, inst->cache, s->app_priv);
+		s->app_priv = NULL;
+		s->app = NULL;
+		return;
+	}
+
+	inst->num_sesh++;
+}
+
+static void app_unbind(struct tcp_session *s)
 {
-	do_inject(s, get_sbuf(s, to_server), seq, len, buf);
+	struct tcp_app_inst *inst;
+
+	if ( NULL == s->app )
+		return;
+
+	inst = &s->tf->reasm->apps[s->app->a_idx];
+	if ( s->app->a_fini )
+		s->app->a_fini(s);
+	if ( s->app_priv )
+		_tcp_release(s->tf, inst->cache, s->app_priv);
+	s->app_priv = NULL;
+	s->app = NULL;
 }
 
 void _tcp_reasm_init(struct tcp_session *s, uint8_t to_server,
@@ -586,7 +1229,18 @@ void _tcp_reasm_init(struct tcp_session *s, uint8_t to_server,
 {
 	s->reasm_shutdown = 0;
 	s->reasm_fin_sent = 0;
-	alloc_reasm_buffers(s);
+	s->reasm_bypass = 0;
+
+	if ( reasm_unbound || _tcp_app_find_by_dport(s->s_port) ) {
+		if ( alloc_reasm_buffers(s) )
+			app_bind(s);
+	}
+
+	if ( NULL == s->app && !reasm_unbound ) {
+		do_bypass(s, 1);
+		do_bypass(s, 0);
+		s->tf->reasm->num_bypass_unbound++;
+	}
 }
 
 static size_t contig_bytes(struct tcp_session *sesh, uint8_t to_server)
@@ -603,16 +1257,21 @@ static size_t contig_bytes(struct tcp_session *sesh, uint8_t to_server)
 		seq--;
 
 	assert(!tcp_before(s->reasm->s_contig_seq, s->reasm->s_reasm_begin));
+	/* Both of these are down to what's on the wire, so anyone can make
+	 * them happen as often as they like. Count them, don't shout.
+	 */
 	if ( tcp_before(seq, s->reasm->s_reasm_begin) ) {
-		dmesg(M_CRIT, "wierd? %u %u", seq, s->reasm->s_reasm_begin);
+		tmesg(TRACE_TCP_REASM, "ack behind reassembly: %u %u",
+			seq, s->reasm->s_reasm_begin);
+		sesh->tf->reasm->num_ack_behind++;
 		return 0;
 	}
 
 	if ( unlikely(tcp_after(seq, s->reasm->s_contig_seq)) ) {
-		/* XXX: blame */
-		dmesg(M_CRIT, "missing segment in stream %u-%u, %u rbufs",
-			s->reasm->s_contig_seq,
+		tmesg(TRACE_TCP_REASM, "missing segment in stream %u-%u, "
+			"%u rbufs", s->reasm->s_contig_seq,
 			seq, s->reasm->s_num_rbuf);
+		sesh->tf->reasm->num_missing++;
 		seq = s->reasm->s_contig_seq;
 	}
 
@@ -629,102 +1288,200 @@ static tcp_chan_t tcp_chan_data(struct tcp_session *s)
 	return ret;
 }
 
-static const uint8_t *do_reasm(struct tcp_sbuf *s, size_t sz)
+static void munch_segs(struct tcp_sbuf *s, uint32_t seq_end)
 {
-	static uint8_t *buf;
-	static size_t buf_sz;
-	struct tcp_rbuf *r;
-	size_t left = sz;
-	uint8_t *ptr;
+	struct tcp_seg *d, *tmp;
+	uint32_t n;
 
-	if ( 0 == sz )
-		return NULL;
+	list_for_each_entry_safe(d, tmp, &s->s_segs, d_list) {
+		if ( !tcp_after(d->d_seq + d->d_len, seq_end) ) {
+			seg_free(s, d);
+			continue;
+		}
+		if ( tcp_before(d->d_seq, seq_end) ) {
+			n = tcp_diff(d->d_seq, seq_end);
+			d->d_ptr += n;
+			d->d_seq += n;
+			d->d_len -= n;
+		}
+		break;
+	}
+}
 
-	/* FIXME: avoid buffer copy if buffer is contained in first rbuf */
+static void munch_bytes(struct tcp_sbuf *s, size_t bytes)
+{
+	struct tcp_rbuf *buf;
+	uint32_t seq, seq_end;
 
-	if ( tcp_after(s->s_reasm_begin + sz, s->s_contig_seq) )
-		return NULL;
+	seq_end = s->s_reasm_begin + bytes;
+	assert(!tcp_after(seq_end, s->s_contig_seq));
 
-	if ( sz > buf_sz ) {
-		uint8_t *new;
+	if ( s->s_ref ) {
+		munch_segs(s, seq_end);
+		s->s_reasm_begin = seq_end;
+		s->s_begin = seq_end;
+		s->s_ring_seq = seq_end;
+		return;
+	}
 
-		new = realloc(buf, sz);
-		dmesg(M_INFO, "tcp_stream: realloc to %zu bytes %p", sz, new);
-		if ( NULL == new )
-			return NULL;
+	for(seq = s->s_begin; s->s_num_rbuf; seq += rbuf_size(s)) {
+		buf = rbuf_find(s, seq);
+		if ( NULL == buf || tcp_before(seq_end, rbuf_end_seq(s, buf)) )
+			break;
+		rbuf_free(s, buf);
+	}
 
-		buf = new;
-		buf_sz = sz;
+	s->s_reasm_begin = seq_end;
+	if ( 0 == s->s_num_rbuf ) {
+		tmesg(TRACE_TCP_REASM, "re-basing from %u to %u",
+			s->s_begin, s->s_reasm_begin);
+		s->s_begin = s->s_reasm_begin;
+		s->s_ring_seq = s->s_begin;
+	}else{
+		s->s_begin = seq;
 	}
+	assert(!tcp_after(s->s_begin, s->s_reasm_begin));
+}
 
-	ptr = buf;
+/* Chunk size for a stream: enough for a whole segment and for what turns
+ * up between pushes. Only shrink once that's well under a chunk so that
+ * streams don't flap between classes.
+ */
+static unsigned int pick_shift(struct tcp_sbuf *s)
+{
+	uint32_t want;
+	unsigned int shift;
 
-	list_for_each_entry(r, &s->s_bufs, r_list) {
-		uint8_t *cp = r->r_base;
-		size_t csz = RBUF_SIZE;
+	want = (s->s_flight > s->s_mss) ? s->s_flight : s->s_mss;
+	for(shift = RBUF_MIN_SHIFT; shift < RBUF_MAX_SHIFT; shift++)
+		if ( want <= (1U << shift) )
+			break;
 
-		if ( tcp_before(r->r_seq, s->s_reasm_begin) ) {
-			cp += tcp_diff(r->r_seq, s->s_reasm_begin);
-			csz -= tcp_diff(r->r_seq, s->s_reasm_begin);
-		}
+	if ( shift < s->s_shift && want > (rbuf_size(s) >> 2) )
+		return s->s_shift;
+	return shift;
+}
 
-		if ( left < csz )
-			csz = left;
+/* Move whatever is buffered in to chunks of the new size. Straight after a
+ * push that's usually not much, only what's in flight. If we can't get the
+ * memory we carry on with the old size.
+ */
+static void rechunk(struct tcp_session *ss, struct tcp_sbuf *s,
+			unsigned int shift)
+{
+	unsigned int old_shift = s->s_shift;
+	uint32_t old_begin = s->s_begin;
+	uint32_t old_ring_seq = s->s_ring_seq;
+	struct tcp_rbuf **old_ring = s->s_ring, **new_ring;
+	uint32_t old_sz = s->s_ring_sz, new_sz;
+	struct tcp_rbuf *r, *nr;
+	uint32_t i;
+
+	tmesg(TRACE_TCP_REASM, "rechunk %u -> %u byte chunks, %u buffered",
+		rbuf_size(s), 1U << shift, s->s_num_rbuf);
+
+	s->s_ring = NULL;
+	s->s_ring_sz = 0;
+	s->s_shift = shift;
+	s->s_begin = s->s_reasm_begin;
+	s->s_ring_seq = s->s_begin;
+
+	/* order doesn't matter, each old chunk lands in its own place */
+	for(i = 0; i < old_sz; i++) {
+		uint32_t seq, end, ofs, len;
+
+		r = old_ring[i];
+		if ( NULL == r )
+			continue;
 
-		memcpy(ptr, cp, csz);
-		ptr += csz;
-		left -= csz;
-		if ( 0 == left )
-			break;
+		seq = r->r_seq;
+		end = r->r_seq + (1U << old_shift);
+		if ( tcp_before(seq, s->s_reasm_begin) )
+			seq = s->s_reasm_begin;
+
+		while ( tcp_before(seq, end) ) {
+			nr = rbuf_get(ss, s, seq_base(s, seq));
+			if ( NULL == nr )
+				goto undo;
+
+			ofs = seq_ofs(s, seq);
+			len = tcp_diff(seq, end);
+			if ( len > rbuf_size(s) - ofs )
+				len = rbuf_size(s) - ofs;
+
+			memcpy(nr->r_base + ofs,
+				r->r_base + tcp_diff(r->r_seq, seq), len);
+			seq += len;
+		}
 	}
 
-	num_reasm++;
-	return buf;
+	new_ring = s->s_ring;
+	new_sz = s->s_ring_sz;
+	s->s_ring = old_ring;
+	s->s_ring_sz = old_sz;
+	s->s_shift = old_shift;
+	ring_free(s);
+	s->s_ring = new_ring;
+	s->s_ring_sz = new_sz;
+	s->s_shift = shift;
+	s->s_reasm->num_rechunk++;
+	return;
+
+undo:
+	ring_free(s);
+	s->s_ring = old_ring;
+	s->s_ring_sz = old_sz;
+	s->s_shift = old_shift;
+	s->s_begin = old_begin;
+	s->s_ring_seq = old_ring_seq;
 }
 
-static void munch_bytes(struct tcp_sbuf *s, size_t bytes)
+static size_t fill_segs(struct tcp_sbuf *s, size_t bytes,
+			struct ro_vec *vec)
 {
-	struct tcp_rbuf *buf, *tmp;
-	uint32_t seq_end;
+	struct tcp_seg *d;
+	size_t i = 0;
+	size_t left = bytes;
+	size_t sz;
+	uint32_t seq = s->s_reasm_begin;
 
-	seq_end = s->s_reasm_begin + bytes;
-	assert(!tcp_after(seq_end, s->s_contig_seq));
+	list_for_each_entry(d, &s->s_segs, d_list) {
+		assert(d->d_seq == seq);
+		sz = (left < d->d_len) ? left : d->d_len;
 
-	list_for_each_entry_safe(buf, tmp, &s->s_bufs, r_list) {
-		if ( tcp_after(seq_end, rbuf_end_seq(buf)) ) {
-			if ( buf == s->s_contig )
-				s->s_contig = NULL;
-			rbuf_free(s, buf);
-		}else
+		tmesg(TRACE_TCP_REASM, " vec[%zu] is %zu bytes by reference",
+			i, sz);
+		vec[i].v_ptr = d->d_ptr;
+		vec[i].v_len = sz;
+		i++;
+		seq += sz;
+		left -= sz;
+		if ( 0 == left )
 			break;
-
 	}
 
-	s->s_reasm_begin = seq_end;
-	if ( list_empty(&s->s_bufs) ) {
-		dmesg(M_DEBUG, "re-basing from %u to %u",
-			s->s_begin, s->s_reasm_begin);
-		s->s_begin = s->s_reasm_begin;
-	}else{
-		buf = first_buffer(s);
-		s->s_begin = buf->r_seq;
-	}
-	assert(!tcp_after(s->s_begin, s->s_reasm_begin));
+	return i;
 }
 
-static void *reasm_dcb;
-static size_t reasm_dcb_sz;
-
 static size_t fill_vectors(struct tcp_sbuf *s, size_t bytes,
 			struct ro_vec *vec)
 {
 	struct tcp_rbuf *r;
 	size_t i = 0;
 	size_t left = bytes;
+	uint32_t seq;
+
+	if ( s->s_ref )
+		return fill_segs(s, bytes, vec);
+
+	/* everything up to contig_seq is there, so no holes in the ring */
+	for(seq = seq_base(s, s->s_reasm_begin); ; seq += rbuf_size(s)) {
+		uint8_t *cp;
+		size_t sz = rbuf_size(s);
 
-	list_for_each_entry(r, &s->s_bufs, r_list) {
-		uint8_t *cp = r->r_base;
-		size_t sz = RBUF_SIZE;
+		r = rbuf_find(s, seq);
+		assert(NULL != r);
+		cp = r->r_base;
 
 		if ( tcp_before(r->r_seq, s->s_reasm_begin) ) {
 			cp += tcp_diff(r->r_seq, s->s_reasm_begin);
@@ -734,7 +1491,7 @@ static size_t fill_vectors(struct tcp_sbuf *s, size_t bytes,
 		if ( left < sz )
 			sz = left;
 
-		dmesg(M_DEBUG, " vec[%zu] is %zu bytes", i, sz);
+		tmesg(TRACE_TCP_REASM, " vec[%zu] is %zu bytes", i, sz);
 		vec[i].v_ptr = cp;
 		vec[i].v_len = sz;
 		i++;
@@ -746,15 +1503,18 @@ static size_t fill_vectors(struct tcp_sbuf *s, size_t bytes,
 	return i;
 }
 
-static int assure_vbuf(struct tcp_sbuf *s, struct ro_vec **vec, size_t *numvec)
+static int assure_vbuf(struct tcp_sbuf *s, size_t bytes,
+			struct ro_vec **vec, size_t *numvec)
 {
-	struct tcp_rbuf *r;
 	struct ro_vec *new;
 	size_t n;
 
-	r = first_buffer(s);
-	n = tcp_diff(r->r_seq, rbuf_end_seq(s->s_contig)) / RBUF_SIZE;
-	dmesg(M_DEBUG, "assuring %zu vectors", n);
+	if ( s->s_ref )
+		n = s->s_num_segs;
+	else
+		n = (seq_ofs(s, s->s_reasm_begin) + bytes + rbuf_mask(s)) >>
+			s->s_shift;
+	tmesg(TRACE_TCP_REASM, "assuring %zu vectors", n);
 
 	if ( *numvec >= n )
 		return 1;
@@ -768,27 +1528,140 @@ static int assure_vbuf(struct tcp_sbuf *s, struct ro_vec **vec, size_t *numvec)
 	return 1;
 }
 
-static void do_abort(struct tcp_session *s, uint8_t to_server)
+/* Describe the first sz reassembled bytes as vectors pointing straight in
+ * to the rbufs, no copying. The vector array belongs to the caller and is
+ * grown as needed. Returns the number of vectors or zero if there aren't
+ * sz contiguous bytes yet.
+ */
+static size_t do_reasm(struct tcp_sbuf *s, size_t sz,
+			struct ro_vec **vec, size_t *numvec)
 {
-	struct tcp_sbuf **pptr;
+	if ( 0 == sz )
+		return 0;
 
-	pptr = get_sbuf_ptr(s, to_server);
-	if ( NULL == pptr || NULL == *pptr )
+	if ( tcp_after(s->s_reasm_begin + sz, s->s_contig_seq) )
+		return 0;
+
+	if ( !assure_vbuf(s, sz, vec, numvec) )
+		return 0;
+
+	s->s_reasm->num_reasm++;
+	return fill_vectors(s, sz, *vec);
+}
+
+static size_t sbuf_size(struct tcp_sbuf *s)
+{
+	if ( NULL == s )
+		return 0;
+	return s->s_mem;
+}
+
+/* Bytes held in reassembly buffers for both directions of a session */
+size_t _tcp_reasm_buffer_size(struct tcp_session *s)
+{
+	size_t ret;
+
+	ret = sbuf_size(get_sbuf(s, 1));
+	ret += sbuf_size(get_sbuf(s, 0));
+	return ret;
+}
+
+/* Bytes and objects held for one direction of a session */
+size_t _tcp_reasm_stream_size(struct tcp_session *s, uint8_t to_server,
+				unsigned int *objs)
+{
+	struct tcp_sbuf *sb;
+
+	sb = get_sbuf(s, to_server);
+	if ( NULL == sb ) {
+		*objs = 0;
+		return 0;
+	}
+
+	*objs = sb->s_objs;
+	return sb->s_mem;
+}
+
+/* Push point: offer everything that's been acknowledged and not yet
+ * consumed to the app. Whatever it doesn't take stays in the reassembly
+ * buffers until the next push, so a parser waiting on the rest of a
+ * message holds back the stream rather than us copying it anywhere.
+ */
+static void do_push(struct tcp_session *ss, uint8_t to_server)
+{
+	struct tcp_reasm *tr = ss->tf->reasm;
+	struct tcp_sbuf *s;
+	size_t bytes, numv, taken;
+	uint32_t depth, end;
+	unsigned int shift;
+
+	if ( bypassed(ss, to_server) )
 		return;
 
-	sbuf_free(s, *pptr);
-	*pptr = NULL;
+	s = get_sbuf(ss, to_server);
+	if ( NULL == s )
+		return;
+
+	bytes = contig_bytes(ss, to_server);
+	if ( 0 == bytes )
+		return;
+
+	end = s->s_reasm_begin + bytes;
+
+	if ( ss->app ) {
+		numv = do_reasm(s, bytes, &tr->vbuf, &tr->vbuf_sz);
+		if ( 0 == numv )
+			return;
+
+		taken = ss->app->a_push(ss, get_chan(to_server),
+					tr->vbuf, numv, bytes);
+		tmesg(TRACE_TCP_STREAM, "push %zu bytes in %zu vectors to %s: "
+			"%zu taken", bytes, numv, ss->app->a_label, taken);
+		tr->num_push++;
+
+		if ( taken > bytes )
+			taken = bytes;
+		if ( taken )
+			tr->push_bytes += taken;
+		else
+			tr->num_stall++;
+
+		if ( bypassed(ss, to_server) )
+			return;
+	}else{
+		/* nobody to hand it to */
+		taken = bytes;
+	}
+
+	if ( taken )
+		munch_bytes(s, taken);
+
+	/* the app has been offered everything it's going to get */
+	depth = stream_depth(ss);
+	if ( depth && !tcp_before(end, s->s_isn + depth) ) {
+		do_bypass(ss, to_server);
+		tr->num_bypass_depth++;
+		return;
+	}
+
+	s->s_flight = bytes;
+	if ( s->s_ref )
+		return;
+	shift = pick_shift(s);
+	if ( shift != s->s_shift )
+		rechunk(ss, s, shift);
 }
 
 void _tcp_reasm_ack(struct tcp_session *s, uint8_t to_server)
 {
-	/* XXX: push point */
+	do_push(s, to_server);
 }
 
 void _tcp_reasm_abort(struct tcp_session *s, int by_proto)
 {
 	if ( by_proto )
-		dmesg(M_DEBUG, "Aborting session due to protocol");
+		tmesg(TRACE_TCP_REASM, "Aborting session due to protocol");
+	app_unbind(s);
 	do_abort(s, 0);
 	do_abort(s, 1);
 }
@@ -802,49 +1675,93 @@ void _tcp_reasm_fin_sent(struct tcp_session *s, uint8_t to_server)
 
 void _tcp_reasm_shutdown(struct tcp_session *s, uint8_t to_server)
 {
-	dmesg(M_DEBUG, "orderly shutdown: to %s",
+	tmesg(TRACE_TCP_REASM, "orderly shutdown: to %s",
 		(to_server) ? "server" : "client");
+	do_push(s, to_server);
+	if ( s->app && s->app->a_shutdown && get_sbuf(s, to_server) )
+		s->app->a_shutdown(s, get_chan(to_server));
 	do_abort(s, to_server);
 }
 
-
-int _tcp_reasm_ctor(mempool_t pool)
+struct tcp_reasm *_tcp_reasm_ctor(struct tcpflow *tf, mempool_t pool)
 {
-	sbuf_cache = objcache_init(pool, "tcp_sbuf", sizeof(struct tcp_sbuf));
-	if ( sbuf_cache == NULL )
-		return 0;
+	struct tcp_reasm *tr;
+	unsigned int i;
 
-	rbuf_cache = objcache_init(pool, "tcp_rbuf", sizeof(struct tcp_rbuf));
-	if ( rbuf_cache == NULL )
-		return 0;
+	tr = calloc(1, sizeof(*tr));
+	if ( NULL == tr )
+		return NULL;
 
-	data_cache = objcache_init(pool, "tcp_data", RBUF_SIZE);
-	if ( data_cache == NULL )
-		return 0;
+	tr->tf = tf;
 
-	gap_cache = objcache_init(pool, "tcp_gap", sizeof(struct tcp_gap));
-	if ( gap_cache == NULL )
-		return 0;
+	tr->sbuf_cache = objcache_init(pool, "tcp_sbuf",
+					sizeof(struct tcp_sbuf));
+	if ( tr->sbuf_cache == NULL )
+		goto err;
 
-#if 0
-	reasm_dcb_sz = _tcp_app_max_dcb();
-	reasm_dcb = malloc(reasm_dcb_sz);
-	if ( NULL == reasm_dcb )
-		return 0;
-#endif
+	tr->rbuf_cache = objcache_init(pool, "tcp_rbuf",
+					sizeof(struct tcp_rbuf));
+	if ( tr->rbuf_cache == NULL )
+		goto err;
 
-	return 1;
+	for(i = 0; i < RBUF_CLASSES; i++) {
+		tr->data_cache[i] = objcache_init(pool, data_label[i],
+						1U << (RBUF_MIN_SHIFT + i));
+		if ( tr->data_cache[i] == NULL )
+			goto err;
+	}
+
+	tr->gap_cache = objcache_init(pool, "tcp_gap", sizeof(struct tcp_gap));
+	if ( tr->gap_cache == NULL )
+		goto err;
+
+	tr->seg_cache = objcache_init(pool, "tcp_seg", sizeof(struct tcp_seg));
+	if ( tr->seg_cache == NULL )
+		goto err;
+	tr->gap_seed = time(NULL) ^ (getpid() << 16) ^ (uintptr_t)tr;
+
+	tr->apps = _tcp_app_ctor(pool);
+	if ( NULL == tr->apps )
+		goto err;
+
+	return tr;
+err:
+	free(tr->apps);
+	free(tr);
+	return NULL;
 }
 
-void _tcp_reasm_dtor(void)
+void _tcp_reasm_dtor(struct tcp_reasm *tr)
 {
 	unsigned int avg;
 
-	avg = inject_bytes / ((num_inject) ? num_inject : 1);
+	avg = tr->inject_bytes / ((tr->num_inject) ? tr->num_inject : 1);
 
 	mesg(M_INFO, "tcp_reasm: push=%u reasm=%u "
-		"inject=%u avg_bytes=%u max_gaps=%u",
-		num_push, num_reasm, num_inject, avg, max_gaps);
-
-	free(reasm_dcb);
+		"inject=%u avg_bytes=%u max_gaps=%u ooo_drop=%u",
+		tr->num_push, tr->num_reasm, tr->num_inject, avg,
+		tr->max_gaps, tr->num_ooo_drop);
+	mesg(M_INFO, "tcp_reasm: %llu bytes consumed by apps, %u stalled pushes",
+		(unsigned long long)tr->push_bytes, tr->num_stall);
+	mesg(M_INFO, "tcp_reasm: chunks allocated: %u/%u/%u/%u/%u "
+		"(256/512/1K/2K/4K), %u re-chunked, max_ring=%u",
+		tr->num_chunks[0], tr->num_chunks[1], tr->num_chunks[2],
+		tr->num_chunks[3], tr->num_chunks[4], tr->num_rechunk,
+		tr->max_ring);
+	mesg(M_INFO, "tcp_reasm: bypassed %u streams at depth, %u by apps, "
+		"%u sessions unbound, %llu bytes skipped",
+		tr->num_bypass_depth, tr->num_bypass_app,
+		tr->num_bypass_unbound, (unsigned long long)tr->bypass_bytes);
+	mesg(M_INFO, "tcp_reasm: %u segments, %llu bytes held by reference, "
+		"%u streams copied out", tr->num_ref,
+		(unsigned long long)tr->ref_bytes, tr->num_unref);
+	mesg(M_INFO, "tcp_reasm: %u overlapping segments, %u conflicting",
+		tr->num_overlap, tr->num_conflict);
+	mesg(M_INFO, "tcp_reasm: %u pushes past missing segments, "
+		"%u acks behind reassembly", tr->num_missing,
+		tr->num_ack_behind);
+
+	_tcp_app_dtor(tr->apps);
+	free(tr->vbuf);
+	free(tr);
 }
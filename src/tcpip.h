@@ -6,6 +6,8 @@
 #ifndef _TCPIP_HEADER_INCLUDED_
 #define _TCPIP_HEADER_INCLUDED_
 
+#include <f_flow.h>
+
 extern struct _decoder _ipv4_decoder;
 extern struct _proto _p_tcpstream;
 extern struct _flow_tracker _ipv4_ipdefrag;
@@ -24,6 +26,14 @@ struct tcp_state {
 	uint32_t	ts_recent; /* a recent timestamp */
 	uint32_t	ts_recent_stamp; /* local time on it */
 
+	/* RTT from the sensor to the receiver and back, in microseconds */
+#define TS_PROBES	4
+	uint32_t	ts_probe[TS_PROBES]; /* TSvals waiting to be echoed */
+	uint32_t	ts_probe_us[TS_PROBES]; /* when we first saw them */
+	uint32_t	srtt_us; /* smoothed, 0 until the first sample */
+	uint32_t	min_rtt_us;
+	uint8_t		ts_probe_head, ts_probe_cnt;
+
 #define TF_SACK_OK	(1<<0)
 #define TF_WSCALE_OK	(1<<1)
 #define TF_TSTAMP_OK	(1<<2)
@@ -49,6 +59,9 @@ struct tcp_session {
 	/* Hash table collision chaining */
 	struct tcp_session **hash_pprev, *hash_next;
 
+	/* tracker instance the session belongs to */
+	struct tcpflow *tf;
+
 	struct list_head lru;
 
 	/* Timeout list */
@@ -59,42 +72,228 @@ struct tcp_session {
 	struct tcp_state *s_wnd;
 
 	uint32_t expire;
+	/* time of last segment, in seconds */
+	uint32_t last_seen;
 
 	/* TCP state: network byte order */
 	uint32_t c_addr, s_addr;
 	uint16_t c_port, s_port;
 
+	/* outer tunnel id and VLAN stack, 0 if untunnelled/untagged */
+	uint32_t tunnel, vlan;
+
+	/* packet and byte counts for flow export */
+	struct flow_acct acct;
+
+	/* bound by server port once established, NULL if none */
+	struct tcp_app *app;
+	void *app_priv;
+
+	/* path MTU from ICMP frag-needed, 0 if we haven't seen one */
+	uint16_t pmtu;
+
 	/* fast state for TCP reassembly */
 	uint8_t state:4;
 	uint8_t reasm_shutdown:1;
-	uint8_t reasm_fin_sent:1;
+	uint8_t reasm_fin_sent:2;
+	/* picked up without seeing the handshake */
+	uint8_t midstream:1;
+	/* channels we only follow sequence numbers for */
+	uint8_t reasm_bypass:2;
+	/* directions a mid-stream pickup has been seen in, bit per
+	 * to_server value */
+	uint8_t mid_seen:2;
+};
+
+/* flow hash */
+#define TCPHASH 509 /* prime */
+
+/* Half-open connections live in a fixed size set-associative table until
+ * the SYN+ACK shows up, so a SYN flood can only ever churn this table and
+ * never touches the session cache.
+ */
+#define SYNHASH 4093 /* prime */
+#define SYN_WAYS 4
+struct tcp_syn {
+	uint32_t c_addr, s_addr;
+	uint16_t c_port, s_port;
+	uint32_t tunnel, vlan;
+	uint32_t isn;
+	uint32_t ts_recent;
+	uint32_t stamp;
+	uint16_t win;
+	uint16_t len;
+	uint8_t flags;
+	uint8_t scale;
+	uint8_t inuse;
 };
 
-int _ipdefrag_ctor(void);
-void _ipdefrag_dtor(void);
-void _ipdefrag_track(pkt_t pkt, dcb_t dcb_ptr);
+/* Reassembler state, private to tcp_reasm.c */
+struct tcp_reasm;
 
-int _tcpflow_ctor(void);
-void _tcpflow_dtor(void);
-void _tcpflow_track(pkt_t pkt, dcb_t dcb_ptr);
+/* An instance of the TCP tracker, each pipeline has its own. Everything
+ * the tracker and the reassembler keep from one segment to the next hangs
+ * off it, so instances share nothing and need no locking.
+ */
+struct tcpflow {
+	struct tcp_session *hash[TCPHASH];
+	struct tcp_syn syn_tab[SYNHASH][SYN_WAYS];
 
-void *_tcp_alloc(struct tcp_session *s, objcache_t o, int reasm);
+	/* memory caches */
+	mempool_t pool;
+	objcache_t session_cache;
+	objcache_t sstate_cache;
 
-int _tcp_reasm_ctor(mempool_t pool);
-void _tcp_reasm_dtor(void);
+	/* timeout lists */
+	struct list_head lru;
+	struct list_head tmo_msl;
+
+	/* NULL if we're not reassembling */
+	struct tcp_reasm *reasm;
+
+	/* flow records go out through here, not shared with other trackers */
+	flow_exporter_t exporter;
+
+	/* stats */
+	unsigned int num_active;
+	unsigned int max_active;
+	unsigned int num_segments;
+	unsigned int state_errs;
+
+	unsigned int num_csum_errs;
+	unsigned int num_csum_trusted;
+	unsigned int num_ttl_errs;
+	unsigned int num_timeouts;
+	unsigned int num_oom;
+	unsigned int num_midstream;
+	unsigned int num_syn;
+	unsigned int num_syn_promoted;
+	unsigned int num_syn_overwritten;
+	unsigned int num_paws;
+	unsigned int num_icmp_abort;
+	unsigned int num_icmp_pmtu;
+	unsigned int num_icmp_bad;
+	unsigned int num_rtt_samples;
+
+	/* memory accounting */
+	size_t flow_mem;
+	size_t max_flow_mem;
+	uint32_t tcp_now;
+	uint32_t tcp_now_us;
+	unsigned int num_evict;
+	uint64_t evict_bytes;
+	uint32_t mem_report_next;
+};
+
+struct udp_session {
+	/* Hash table collision chaining */
+	struct udp_session **hash_pprev, *hash_next;
+
+	/* Timeout list */
+	struct list_head tmo;
+	uint32_t expire;
+
+	/* network byte order */
+	uint32_t c_addr, s_addr;
+	uint16_t c_port, s_port;
+
+	/* outer tunnel id and VLAN stack, 0 if untunnelled/untagged */
+	uint32_t tunnel, vlan;
+
+	/* packet and byte counts for flow export */
+	struct flow_acct acct;
+
+	/* bound by server port at creation, NULL if none */
+	struct udp_app *app;
+	void *app_priv;
+};
+
+/* The IPv4 decoder's flow state, one for each pipeline. Nothing in it
+ * is shared with any other pipeline.
+ */
+struct ipv4_flow {
+	struct tcpflow *tcp;
+	struct udpflow *udp;
+	struct ipflow_table *ip;
+	struct ipdefrag *frag;
+};
+
+struct ipdefrag *_ipdefrag_ctor(void);
+void _ipdefrag_dtor(struct ipdefrag *fd);
+void _ipdefrag_track(struct ipdefrag *fd, pkt_t pkt, dcb_t dcb_ptr);
+void _ip6defrag_track(struct ipdefrag *fd, pkt_t pkt, dcb_t dcb_ptr);
+
+struct tcpflow *_tcpflow_ctor(void);
+void _tcpflow_dtor(struct tcpflow *tf);
+void _tcpflow_track(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr);
+void _tcpflow_icmp_error(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr);
+void _tcpflow_prefetch(struct tcpflow *tf, pkt_t pkt, dcb_t dcb_ptr,
+			unsigned int pass);
+
+struct ipflow_table *_ipflow_ctor(void);
+void _ipflow_dtor(struct ipflow_table *ft);
+void _ipflow_icmp_track(struct ipflow_table *ft, pkt_t pkt, dcb_t dcb_ptr);
+
+struct udpflow *_udpflow_ctor(void);
+void _udpflow_dtor(struct udpflow *uf);
+void _udpflow_track(struct udpflow *uf, pkt_t pkt, dcb_t dcb_ptr);
+void _udpflow_icmp_error(struct udpflow *uf, pkt_t pkt, dcb_t dcb_ptr);
+
+void *_tcp_alloc(struct tcpflow *tf, struct tcp_session *s, objcache_t o);
+void _tcp_release(struct tcpflow *tf, objcache_t o, void *obj);
+void *_tcp_alloc_array(struct tcpflow *tf, struct tcp_session *s,
+			size_t nmemb, size_t size);
+void _tcp_release_array(struct tcpflow *tf, void *ptr,
+			size_t nmemb, size_t size);
+
+struct tcp_reasm *_tcp_reasm_ctor(struct tcpflow *tf, mempool_t pool);
+void _tcp_reasm_dtor(struct tcp_reasm *tr);
 
 void _tcp_reasm_init(struct tcp_session *s, uint8_t to_server,
 			uint32_t seq, uint32_t len, const uint8_t *buf);
 void _tcp_reasm_data(struct tcp_session *s, uint8_t to_server,
-			uint32_t seq, uint32_t len, const uint8_t *buf);
+			uint32_t seq, uint32_t len, const uint8_t *buf,
+			int stable);
 void _tcp_reasm_ack(struct tcp_session *s, uint8_t to_server);
 void _tcp_reasm_shutdown(struct tcp_session *s, uint8_t to_server);
 void _tcp_reasm_fin_sent(struct tcp_session *s, uint8_t to_server);
 void _tcp_reasm_abort(struct tcp_session *s, int rst);
 size_t _tcp_reasm_buffer_size(struct tcp_session *s);
+size_t _tcp_reasm_stream_size(struct tcp_session *s, uint8_t to_server,
+				unsigned int *objs);
+
+/* overlap policies, see tcp_policy.c */
+#define TCP_POLICY_FIRST	0
+#define TCP_POLICY_LAST		1
+#define TCP_POLICY_BSD		2
+#define TCP_POLICY_LINUX	3
+#define TCP_POLICY_WINDOWS	4
+#define TCP_POLICY_MAX		5
+int _tcp_policy_ctor(void);
+void _tcp_policy_dtor(void);
+uint8_t _tcp_policy_lookup(uint32_t addr);
+const char *_tcp_policy_name(uint8_t policy);
 
 struct tcp_app *_tcp_app_find_by_dport(uint16_t dport);
-size_t _tcp_app_max_dcb(void);
+
+/* Each reassembler has its own session state cache for every app, indexed
+ * by a_idx.
+ */
+struct tcp_app_inst {
+	objcache_t cache;
+	unsigned int num_sesh;
+};
+struct tcp_app_inst *_tcp_app_ctor(mempool_t pool);
+void _tcp_app_dtor(struct tcp_app_inst *inst);
+
+struct udp_app *_udp_app_find_by_dport(uint16_t dport);
+
+/* Likewise each UDP tracker, indexed by the udp_app's a_idx */
+struct udp_app_inst {
+	objcache_t cache;
+};
+struct udp_app_inst *_udp_app_ctor(mempool_t pool);
+void _udp_app_dtor(struct udp_app_inst *inst);
 
 extern struct _proto _p_tcpstream;
 #endif /* _TCPIP_HEADER_INCLUDED_ */
@@ -0,0 +1,98 @@
+/*
+ * This file is part of Firestorm NIDS.
+ * Copyright (c) 2010 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Runtime configuration of the developer trace points, see f_trace.h
+*/
+
+#include <firestorm.h>
+#include <f_trace.h>
+
+#if ENABLE_TRACE
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+unsigned int _trace_mask;
+unsigned int _trace_cur;
+uint32_t _trace_addr;
+uint16_t _trace_port;
+
+static const struct {
+	const char *name;
+	unsigned int mask;
+}modules[] = {
+	{"tcp_state", TRACE_TCP_STATE},
+	{"tcp_segment", TRACE_TCP_SEGMENT},
+	{"tcp_stream", TRACE_TCP_STREAM},
+	{"tcp_reasm", TRACE_TCP_REASM},
+	{"all", TRACE_ALL},
+	{NULL, 0}
+};
+
+static void parse_modules(const char *str)
+{
+	const char *end;
+	size_t len;
+	unsigned int i;
+
+	for(; *str; str = (*end) ? end + 1 : end) {
+		end = strchr(str, ',');
+		if ( NULL == end )
+			end = str + strlen(str);
+		len = end - str;
+
+		for(i = 0; modules[i].name; i++) {
+			if ( strlen(modules[i].name) == len &&
+					!strncmp(modules[i].name, str, len) ) {
+				_trace_mask |= modules[i].mask;
+				break;
+			}
+		}
+
+		if ( NULL == modules[i].name )
+			mesg(M_WARN, "trace: unknown module: %.*s",
+				(int)len, str);
+	}
+}
+
+static void parse_flow(const char *str)
+{
+	char buf[64];
+	struct in_addr in;
+	char *port;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+	port = strchr(buf, ':');
+	if ( port ) {
+		*port++ = '\0';
+		_trace_port = htobe16(strtoul(port, NULL, 0));
+	}
+
+	if ( !inet_aton(buf, &in) ) {
+		mesg(M_WARN, "trace: bad flow filter: %s", str);
+		_trace_port = 0;
+		return;
+	}
+
+	_trace_addr = in.s_addr;
+}
+
+static void __attribute__((constructor)) _ctor(void)
+{
+	const char *str;
+
+	str = getenv("FIRESTORM_TRACE");
+	if ( str )
+		parse_modules(str);
+
+	str = getenv("FIRESTORM_TRACE_FLOW");
+	if ( str && *str )
+		parse_flow(str);
+
+	/* until a flow is selected */
+	_trace_cur = (_trace_addr) ? 0 : _trace_mask;
+}
+#endif
@@ -0,0 +1,122 @@
+/* Copyright (c) Gianni Tedesco 2010
+ * Author: Gianni Tedesco (gianni at scaramanga dot co dot uk)
+*/
+#include <firestorm.h>
+#include <f_packet.h>
+#include <f_decode.h>
+#include <list.h>
+#include <p_udp.h>
+#include "tcpip.h"
+
+#define NAMESPACE_ALLOC_CHUNK	(1<<3)
+#define NAMESPACE_ALLOC_MASK	(NAMESPACE_ALLOC_CHUNK-1)
+
+struct dpe {
+	uint16_t dport;
+	struct udp_app *app;
+};
+
+static struct dpe *dports;
+static unsigned int num_dports;
+static struct udp_app *apps;
+static unsigned int num_apps;
+
+void udp_app_register(struct udp_app *app)
+{
+	assert(NULL == app->a_next);
+	assert(NULL != app->a_label);
+	assert(NULL != app->a_datagram);
+
+	app->a_idx = num_apps++;
+	app->a_next = apps;
+	apps = app;
+}
+
+static int dp_assure(void)
+{
+	static void *new;
+
+	if ( num_dports & NAMESPACE_ALLOC_MASK )
+		return 1;
+
+	new = realloc(dports,
+			sizeof(*dports) *
+			(num_dports + NAMESPACE_ALLOC_CHUNK));
+	if ( new == NULL )
+		return 0;
+
+	dports = new;
+	return 1;
+}
+
+static int dp_cmp(const void *A, const void *B)
+{
+	const struct dpe *a = A, *b = B;
+	return a->dport - b->dport;
+}
+
+void udp_app_register_dport(struct udp_app *app, uint16_t dport)
+{
+	if ( !dp_assure() ) {
+		assert(dp_assure());
+		return;
+	}
+
+	dports[num_dports].dport = htobe16(dport);
+	dports[num_dports].app = app;
+	num_dports++;
+
+	qsort(dports, num_dports, sizeof(*dports), dp_cmp);
+}
+
+struct udp_app *_udp_app_find_by_dport(uint16_t dport)
+{
+	unsigned int n;
+	struct dpe *p;
+
+	for(p = dports, n = num_dports; n; ) {
+		unsigned int i;
+
+		i = (n / 2);
+		if ( dport < p[i].dport ) {
+			n = i;
+		}else if ( dport > p[i].dport ) {
+			p = p + (i + 1);
+			n = n - (i + 1);
+		}else{
+			return p[i].app;
+		}
+	}
+
+	return NULL;
+}
+
+/* Per-app flow state caches come out of the UDP tracker's pool */
+struct udp_app_inst *_udp_app_ctor(mempool_t pool)
+{
+	struct udp_app_inst *inst;
+	struct udp_app *app;
+
+	/* one spare so there's something to return with no apps */
+	inst = calloc(num_apps + 1, sizeof(*inst));
+	if ( NULL == inst )
+		return NULL;
+
+	for(app = apps; app; app = app->a_next) {
+		if ( 0 == app->a_state_sz )
+			continue;
+		inst[app->a_idx].cache = objcache_init(pool, app->a_label,
+							app->a_state_sz);
+		if ( NULL == inst[app->a_idx].cache ) {
+			free(inst);
+			return NULL;
+		}
+	}
+
+	return inst;
+}
+
+void _udp_app_dtor(struct udp_app_inst *inst)
+{
+	free(inst);
+}
@@ -71,3 +71,37 @@ int vstrcmp(const struct ro_vec *v1, const char *str)
 
 	return vcasecmp(v1, &v2);
 }
+
+/* Contiguous view of len bytes at ofs in to a vector array. Points straight
+ * in to the vector if the window doesn't straddle two of them, otherwise the
+ * bytes are copied in to buf, which must be at least len bytes. Returns NULL
+ * if the vectors don't cover the window.
+ */
+const uint8_t *vlinear(const struct ro_vec *vec, size_t numv,
+			size_t ofs, size_t len, uint8_t *buf)
+{
+	const struct ro_vec *v, *end;
+	uint8_t *ptr;
+
+	for(v = vec, end = vec + numv; v < end && ofs >= v->v_len; v++)
+		ofs -= v->v_len;
+
+	if ( v >= end )
+		return (len) ? NULL : buf;
+
+	if ( ofs + len <= v->v_len )
+		return v->v_ptr + ofs;
+
+	for(ptr = buf; len && v < end; v++, ofs = 0) {
+		size_t sz = v->v_len - ofs;
+
+		if ( sz > len )
+			sz = len;
+
+		memcpy(ptr, v->v_ptr + ofs, sz);
+		ptr += sz;
+		len -= sz;
+	}
+
+	return (len) ? NULL : buf;
+}